@@ -0,0 +1,163 @@
+#include <cstdlib>
+#include <algorithm>
+#include "api.hpp"
+
+using namespace std;
+
+// Parses routines with their parameters as given on the command line, like "median 2 threshold_auto triangle"
+// Returns false and sets error if an argument could not be understood
+bool parse_routine_arguments(const vector<string> &arguments, vector<routine> *routines, string *error) {
+    int count = arguments.size();
+    // If the argument after i is an integer, it's a parameter of the routine at i, and i moves on to it
+    auto parameter = [&](int &i, int *value) {
+        if (i+1 < count && atoi(arguments[i+1].c_str())) {
+            *value = atoi(arguments[++i].c_str());
+            return true;
+        }
+        return false;
+    };
+    for (int i=0; i < count; i++) {
+        const string &name = arguments[i];
+        routine r;
+        if (name == mean_filter_id || name == gauss_filter_id || name == median_filter_id) {
+            r.kind = name == mean_filter_id ? ROUTINE_MEAN_FILTER
+                   : name == gauss_filter_id ? ROUTINE_GAUSS_FILTER : ROUTINE_MEDIAN_FILTER;
+            parameter(i, &r.radius);
+        } else if (name == threshold_id) {
+            r.kind = ROUTINE_THRESHOLD;
+            parameter(i, &r.thresh);
+        } else if (name == threshold_auto_id) {
+            r.kind = ROUTINE_THRESHOLD_AUTO;
+            if (i+1 < count && arguments[i+1] == triangle_id) {
+                r.method = THRESHOLD_TRIANGLE;
+                i++;
+            } else if (i+1 < count && arguments[i+1] == otsu_id) {
+                i++;
+            }
+        } else if (name == threshold_adaptive_mean_id || name == threshold_adaptive_gauss_id) {
+            r.kind = name == threshold_adaptive_mean_id ? ROUTINE_THRESHOLD_ADAPTIVE_MEAN : ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+            r.radius = 5;
+            if (parameter(i, &r.radius)) { // C can only follow a radius
+                parameter(i, &r.C);
+            }
+        } else if (name == threshold_sauvola_id || name == threshold_bradley_id) {
+            bool sauvola = name == threshold_sauvola_id;
+            r.kind = sauvola ? ROUTINE_THRESHOLD_SAUVOLA : ROUTINE_THRESHOLD_BRADLEY;
+            r.radius = 15;
+            r.k = sauvola ? sauvola_default_k : bradley_default_t;
+            if (parameter(i, &r.radius)) {
+                parameter(i, &r.k);
+            }
+        } else if (name == deskew_id) {
+            r.kind = ROUTINE_DESKEW;
+            parameter(i, &r.angle);
+        } else {
+            if (error != nullptr) {
+                *error = "Could not understand the following argument: " + name;
+            }
+            return false;
+        }
+        routines->push_back(r);
+    }
+    return true;
+}
+
+// What a routine does with its parameters
+static string parameter_description(const routine &r) {
+    switch (r.kind) {
+    case ROUTINE_MEAN_FILTER:
+        return "mean filter with radius " + to_string(r.radius);
+    case ROUTINE_GAUSS_FILTER:
+        return "gauss filter with radius " + to_string(r.radius);
+    case ROUTINE_MEDIAN_FILTER:
+        return "median filter with radius " + to_string(r.radius);
+    case ROUTINE_THRESHOLD:
+        return "global threshold with threshold " + to_string(r.thresh);
+    case ROUTINE_THRESHOLD_AUTO:
+        return "automatic global threshold with method " + (r.method == THRESHOLD_TRIANGLE ? triangle_id : otsu_id);
+    case ROUTINE_THRESHOLD_ADAPTIVE_MEAN:
+        return "adaptive mean threshold with radius " + to_string(r.radius) + " and C " + to_string(r.C);
+    case ROUTINE_THRESHOLD_ADAPTIVE_GAUSS:
+        return "adaptive gauss threshold with radius " + to_string(r.radius) + " and C " + to_string(r.C);
+    case ROUTINE_THRESHOLD_SAUVOLA:
+        return "sauvola threshold with radius " + to_string(r.radius) + " and k " + to_string(r.k) + "%";
+    case ROUTINE_DESKEW:
+        return "deskew searching up to " + to_string(r.angle) + " degrees";
+    default:
+        return "bradley threshold with radius " + to_string(r.radius) + " and t " + to_string(r.k) + "%";
+    }
+}
+
+// What a routine does with its parameters, border policy and allowed error, as announced by prettify
+string routine_description(const routine &r) {
+    bool filter = r.kind == ROUTINE_MEAN_FILTER || r.kind == ROUTINE_GAUSS_FILTER || r.kind == ROUTINE_MEDIAN_FILTER
+               || r.kind == ROUTINE_THRESHOLD_ADAPTIVE_MEAN || r.kind == ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+    string description = parameter_description(r);
+    if (filter && r.border != BORDER_IGNORE) {
+        description += ", " + (r.border == BORDER_REPLICATE ? border_replicate_id : border_reflect_id) + " border";
+    }
+    if (filter && r.kind != ROUTINE_MEDIAN_FILTER && r.max_error > 0) {
+        description += ", approximated within " + to_string(r.max_error) + " levels";
+    }
+    return description;
+}
+
+static bool valid_buffer(const pixel_buffer &buffer) {
+    return buffer.data != nullptr && buffer.width > 0 && buffer.height > 0
+        && (buffer.channels == 1 || buffer.channels == 3)
+        && (buffer.stride == 0 || buffer.stride >= (size_t) buffer.width * buffer.channels);
+}
+
+// Applies the routines to the pixels of input and stores the result in output, which has to have the same size and
+// may be the same buffer. Color input with grayscale output is converted to intensities before the routines, so
+// that they only process one channel; grayscale input gives gray rgb output.
+// Returns false and sets error if the buffers don't fit together
+bool prettify_pixels(const pixel_buffer &input, const pixel_buffer &output, const vector<routine> &routines,
+                     string *error) {
+    if (!valid_buffer(input) || !valid_buffer(output)) {
+        if (error != nullptr) {
+            *error = "Buffers need a data pointer, a size, 1 or 3 channels and room for a row within their stride.";
+        }
+        return false;
+    }
+    if (input.width != output.width || input.height != output.height) {
+        if (error != nullptr) {
+            *error = "Input and output buffers have different sizes.";
+        }
+        return false;
+    }
+    int width = input.width, height = input.height;
+    size_t in_stride = input.stride ? input.stride : (size_t) width * input.channels;
+    size_t out_stride = output.stride ? output.stride : (size_t) width * output.channels;
+    image img(width, height, input.channels == 3 && output.channels == 3 ? 3 : 1);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) {
+        const unsigned char *samples = input.data + i * in_stride;
+        if (input.channels == 1) {
+            copy(samples, samples + width, img.row(0, i));
+        } else if (img.channels == 1) { // Same intensity as image::luma
+            unsigned char *gray = img.row(0, i);
+            for (int j=0; j < width; j++) {
+                gray[j] = (samples[j*3] + samples[j*3 + 1] + samples[j*3 + 2]) / 3;
+            }
+        } else {
+            for (int c=0; c < 3; c++) {
+                unsigned char *plane = img.row(c, i);
+                for (int j=0; j < width; j++) {
+                    plane[j] = samples[j*3 + c];
+                }
+            }
+        }
+    }
+    run_pipeline(img, routines);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) {
+        unsigned char *samples = output.data + i * out_stride;
+        if (output.channels == 3) {
+            img.rgb_row(i, samples);
+        } else {
+            img.luma_row(i, samples);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "prettify.hpp"
+#include "pipeline.hpp"
+using namespace std;
+
+// The part of libprettify meant for programs that link it instead of running prettify for every page. All functions
+// of the library may be called from several threads at once, on different images; only the settings (set_verbose,
+// set_profiling, set_thread_binding, set_simd_level) are meant to be changed before any image is processed.
+
+// Pixels in memory the caller owns: rows of interleaved samples, stride bytes apart
+struct pixel_buffer {
+    unsigned char *data = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 3; // 3 for rgb, 1 for grayscale
+    size_t stride = 0; // 0 for rows without padding, width * channels bytes apart
+};
+
+bool parse_routine_arguments(const vector<string> &arguments, vector<routine> *routines, string *error);
+string routine_description(const routine &r);
+bool prettify_pixels(const pixel_buffer &input, const pixel_buffer &output, const vector<routine> &routines,
+                     string *error=nullptr);
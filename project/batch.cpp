@@ -0,0 +1,197 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <omp.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "batch.hpp"
+#include "threading.hpp"
+
+using namespace std;
+
+// Extension of a file name, including the dot
+static string extension(const string &name) {
+    size_t slash = name.rfind('/');
+    size_t dot = name.rfind('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return "";
+    }
+    return name.substr(dot);
+}
+
+// Name of the output file for an input: its base name in output_dir, with the extension of the chosen format
+static string output_name(const string &input, const string &output_dir, const batch_options &opts) {
+    size_t slash = input.rfind('/');
+    string name = slash == string::npos ? input : input.substr(slash + 1);
+    if (opts.format_set) {
+        string ext = extension(name);
+        name = name.substr(0, name.size() - ext.size());
+        name += format_extension(opts.format);
+    }
+    return output_dir + "/" + name;
+}
+
+// Collects the pages of a batch from source, which is either a directory or a manifest file
+// A directory contributes all its .ppm, .pgm and .pam files, in the order of their names. A manifest has one input
+// file per line, optionally followed by its output file; empty lines and lines starting with # are ignored.
+// Outputs without an explicit name go to output_dir, which is created if it doesn't exist
+bool list_batch_pages(char source[], char output_dir[], const batch_options &opts, vector<batch_page> *pages) {
+    struct stat source_stat;
+    if (stat(source, &source_stat) != 0) {
+        cerr << "Error: Could not open " << source << "." << endl;
+        return false;
+    }
+    string dir(output_dir);
+    if (mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        cerr << "Error: Could not create " << output_dir << "." << endl;
+        return false;
+    }
+    if (S_ISDIR(source_stat.st_mode)) {
+        DIR *listing = opendir(source);
+        if (listing == nullptr) {
+            cerr << "Error: Could not list " << source << "." << endl;
+            return false;
+        }
+        vector<string> names;
+        while (dirent *entry = readdir(listing)) {
+            string ext = extension(entry->d_name);
+            if (ext == ".ppm" || ext == ".pgm" || ext == ".pam") {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(listing);
+        sort(names.begin(), names.end());
+        for (const string &name : names) {
+            string input = string(source) + "/" + name;
+            pages->push_back({input, output_name(input, dir, opts)});
+        }
+        return true;
+    }
+    ifstream manifest(source);
+    string line;
+    while (getline(manifest, line)) {
+        istringstream fields(line);
+        string input, output;
+        fields >> input >> output;
+        if (input.empty() || input[0] == '#') {
+            continue;
+        }
+        pages->push_back({input, output.empty() ? output_name(input, dir, opts) : output});
+    }
+    return true;
+}
+
+// Page indices split among workers: each worker takes pages from the front of its own queue, and when that runs
+// dry it steals from the back of the others, so pages that take longer don't leave the other workers idle
+class page_queues {
+public:
+    page_queues(size_t pages, int workers) : queues(workers), locks(workers) {
+        for (size_t p=0; p < pages; p++) { // Neighbouring pages to the same worker, they are often alike
+            queues[p * workers / pages].push_back(p);
+        }
+    }
+    bool next(int worker, size_t *page) {
+        if (take(worker, page, true)) {
+            return true;
+        }
+        int workers = queues.size();
+        for (int k=1; k < workers; k++) {
+            if (take((worker + k) % workers, page, false)) {
+                return true;
+            }
+        }
+        return false; // No page is left anywhere, and none are ever added
+    }
+private:
+    vector<deque<size_t>> queues;
+    vector<mutex> locks;
+
+    bool take(int worker, size_t *page, bool front) {
+        lock_guard<mutex> guard(locks[worker]);
+        if (queues[worker].empty()) {
+            return false;
+        }
+        if (front) {
+            *page = queues[worker].front();
+            queues[worker].pop_front();
+        } else {
+            *page = queues[worker].back();
+            queues[worker].pop_back();
+        }
+        return true;
+    }
+};
+
+// Reads, filters and writes one page, returns the number of pixels or -1 if the page failed
+static long process_page(const batch_page &page, const vector<routine> &routines, const batch_options &opts) {
+    string input = page.input, output = page.output; // The image functions take modifiable names
+    image img = read_image(&input[0]);
+    if (img.empty()) {
+        return -1;
+    }
+    image_format format = opts.format_set ? opts.format : format_from_filename(&output[0]);
+    if ((opts.gray || gray_format(format)) && img.channels > 1) { // Only the intensity is kept anyway
+        img = img.luma();
+    }
+    run_pipeline(img, routines);
+    write_image(&output[0], img, format);
+    return (long) img.width * img.height;
+}
+
+// Processes all pages, each one read, filtered and written by one worker, so that decoding, filtering and encoding
+// of different pages overlap. Small pages are spread over as many workers as there are threads, each filtering with
+// a single thread; large pages (judged by the first one) are filtered one after the other with all threads, which
+// keeps only one of them in memory. Threads left over when there are fewer pages than threads filter within pages.
+batch_report run_batch(const vector<batch_page> &pages, const vector<routine> &routines, const batch_options &opts) {
+    batch_report report;
+    report.pages = pages.size();
+    if (pages.empty()) {
+        return report;
+    }
+    int threads = omp_get_max_threads();
+    int width, height;
+    string first = pages[0].input;
+    bool large = read_image_size(&first[0], &width, &height) && (long) width * height >= batch_large_page;
+    report.workers = large ? 1 : (int) min((size_t) threads, pages.size());
+    report.threads_per_page = max(1, threads / report.workers);
+
+    set_verbose(false); // Lines of different pages would interleave
+    page_queues queues(pages.size(), report.workers);
+    mutex report_lock;
+    auto start = omp_get_wtime();
+    auto work = [&](int worker) {
+        pin_thread();
+        omp_set_num_threads(report.threads_per_page);
+        size_t p;
+        while (queues.next(worker, &p)) {
+            auto page_start = omp_get_wtime();
+            long page_pixels = process_page(pages[p], routines, opts);
+            auto page_end = omp_get_wtime();
+            lock_guard<mutex> guard(report_lock);
+            if (page_pixels < 0) {
+                report.failed++;
+                cerr << "Error: Could not process " << pages[p].input << endl;
+                continue;
+            }
+            report.pixels += page_pixels;
+            cout << pages[p].input << " -> " << pages[p].output << " took " << page_end - page_start << " seconds" << endl;
+        }
+    };
+    vector<thread> workers;
+    for (int w=1; w < report.workers; w++) {
+        workers.emplace_back(work, w);
+    }
+    work(0);
+    for (thread &t : workers) {
+        t.join();
+    }
+    report.seconds = omp_get_wtime() - start;
+    omp_set_num_threads(threads);
+    set_verbose(true);
+    return report;
+}
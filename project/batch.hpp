@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "prettify.hpp"
+#include "pipeline.hpp"
+using namespace std;
+
+// One page of a batch: where it's read from and where the result goes
+struct batch_page {
+    string input;
+    string output;
+};
+
+// How the pages of a batch are processed
+struct batch_options {
+    image_format format = FORMAT_P3;
+    bool format_set = false; // Otherwise each output format follows the extension of its output file
+    bool gray = false; // Convert every page to grayscale before the routines
+};
+
+// Outcome of a batch
+struct batch_report {
+    size_t pages = 0;
+    size_t failed = 0;
+    double pixels = 0;
+    double seconds = 0;
+    int workers = 0; // Pages processed at the same time
+    int threads_per_page = 0;
+};
+
+// Pages with at least this many pixels are filtered one after the other with all threads each
+const long batch_large_page = 16 << 20;
+
+bool list_batch_pages(char source[], char output_dir[], const batch_options &opts, vector<batch_page> *pages);
+batch_report run_batch(const vector<batch_page> &pages, const vector<routine> &routines, const batch_options &opts);
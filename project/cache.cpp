@@ -0,0 +1,280 @@
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.hpp"
+#include "profile.hpp"
+
+using namespace std;
+
+const char entry_magic[8] = {'P', 'R', 'E', 'T', 'T', 'I', 'F', 'Y'};
+const string entry_extension = ".cache";
+
+// What precedes the key and the planes of an entry
+struct entry_header {
+    char magic[8];
+    uint32_t key_size;
+    uint32_t width, height, channels;
+    uint64_t stride; // Of the image the planes were written from, they're only read back into an image with the same
+};
+
+static const uint64_t prime1 = 11400714785074694791ULL, prime2 = 14029467366897019727ULL,
+                      prime3 = 1609587929392839161ULL, prime4 = 9650029242287828579ULL,
+                      prime5 = 2870177450012600261ULL;
+
+static inline uint64_t rotate_left(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t hash_round(uint64_t accumulator, uint64_t input) {
+    return rotate_left(accumulator + input * prime2, 31) * prime1;
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+}
+
+// Four independent lanes of 8 bytes each per step, so that the multiplications of the lanes overlap
+uint64_t hash_bytes(const unsigned char *data, size_t size, uint64_t seed) {
+    const unsigned char *p = data, *end = data + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + prime1 + prime2, v2 = seed + prime2, v3 = seed, v4 = seed - prime1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = hash_round(v1, load64(p));
+            v2 = hash_round(v2, load64(p + 8));
+            v3 = hash_round(v3, load64(p + 16));
+            v4 = hash_round(v4, load64(p + 24));
+        }
+        h = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+        for (uint64_t v : {v1, v2, v3, v4}) {
+            h = (h ^ hash_round(0, v)) * prime1 + prime4;
+        }
+    } else {
+        h = seed + prime5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8) {
+        h = rotate_left(h ^ hash_round(0, load64(p)), 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        h = rotate_left(h ^ (word * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h = rotate_left(h ^ (*p * prime5), 11) * prime1;
+    }
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hashes the contents of a file, returns false if it can't be read
+bool hash_file(const char *filename, uint64_t *hash) {
+    profile_step step("hash_input");
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Could not open " << filename << "." << endl;
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t file_size = file_stat.st_size;
+    if (file_size == 0) {
+        close(fd);
+        *hash = hash_bytes(nullptr, 0);
+        return true;
+    }
+    void *mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        cerr << "Error: Could not map " << filename << " into memory." << endl;
+        return false;
+    }
+    madvise(mapping, file_size, MADV_SEQUENTIAL);
+    *hash = hash_bytes((const unsigned char*) mapping, file_size);
+    munmap(mapping, file_size);
+    step.add_bytes_moved(file_size);
+    return true;
+}
+
+static string hex(uint64_t value) {
+    const char digits[] = "0123456789abcdef";
+    string text(16, '0');
+    for (int k=15; k >= 0; k--, value >>= 4) {
+        text[k] = digits[value & 15];
+    }
+    return text;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+    unsigned char *p = (unsigned char*) data;
+    while (size > 0) {
+        ssize_t got = read(fd, p, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char*) data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+stage_cache::stage_cache(const string &directory, size_t max_bytes, uint64_t input_hash, bool gray)
+    : directory(directory), max_bytes(max_bytes), input_hash(input_hash), gray(gray) {
+    mkdir(directory.c_str(), 0755); // Writing the first entry reports it if the directory can't be used
+}
+
+// Everything the result of the first prefix routines depends on. The version changes whenever a routine could give
+// another result for the same parameters, so that older entries aren't used anymore.
+string stage_cache::key(const vector<routine> &routines, int prefix) const {
+    string text = "prettify stage cache 1\ninput " + hex(input_hash) + (gray ? " gray\n" : " as read\n");
+    for (int k=0; k < prefix; k++) {
+        text += routine_name(routines[k]) + " border " + to_string(routines[k].border) + " error "
+              + to_string(routines[k].max_error) + "\n";
+    }
+    return text;
+}
+
+string stage_cache::path(const string &key) const {
+    return directory + "/" + hex(hash_bytes((const unsigned char*) key.data(), key.size())) + entry_extension;
+}
+
+int stage_cache::load(const vector<routine> &routines, image *img) {
+    profile_step step("read_cache");
+    for (int prefix=routines.size(); prefix >= 0; prefix--) {
+        string expected = key(routines, prefix);
+        int fd = open(path(expected).c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        entry_header header;
+        string stored;
+        bool valid = read_all(fd, &header, sizeof(header)) && memcmp(header.magic, entry_magic, 8) == 0
+                  && header.key_size == expected.size() && (header.channels == 1 || header.channels == 3)
+                  && header.width > 0 && header.height > 0;
+        if (valid) {
+            stored.resize(header.key_size);
+            valid = read_all(fd, &stored[0], stored.size()) && stored == expected;
+        }
+        if (valid) { // Only now the size is known to be the one of an image this cache wrote
+            image cached(header.width, header.height, header.channels);
+            size_t size = cached.stride * cached.height * cached.channels;
+            if (cached.stride == header.stride && read_all(fd, cached.row(0, 0), size)) {
+                futimens(fd, nullptr); // Recently used
+                close(fd);
+                step.add_bytes_moved(size);
+                *img = move(cached);
+                return prefix;
+            }
+        }
+        close(fd); // Written by another version, or cut off; storing the prefix again replaces it
+    }
+    return -1;
+}
+
+bool stage_cache::store(const vector<routine> &routines, int prefix, const image &img) {
+    profile_step step("write_cache");
+    string entry_key = key(routines, prefix);
+    size_t size = img.stride * img.height * img.channels;
+    if (sizeof(entry_header) + entry_key.size() + size > max_bytes) {
+        return false; // Would evict everything else and itself
+    }
+    entry_header header;
+    memcpy(header.magic, entry_magic, 8);
+    header.key_size = entry_key.size();
+    header.width = img.width;
+    header.height = img.height;
+    header.channels = img.channels;
+    header.stride = img.stride;
+    // Written under a name of its own and renamed, so that other processes never read a partial entry
+    string final_path = path(entry_key), partial = final_path + ".partial" + to_string(getpid());
+    int fd = open(partial.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && write_all(fd, &header, sizeof(header))
+                && write_all(fd, entry_key.data(), entry_key.size()) && write_all(fd, img.row(0, 0), size);
+    if (fd >= 0 && close(fd) != 0) {
+        written = false;
+    }
+    if (!written || rename(partial.c_str(), final_path.c_str()) != 0) {
+        cerr << "Error: Could not write to the cache in " << directory << ": " << strerror(errno) << "." << endl;
+        unlink(partial.c_str());
+        return false;
+    }
+    step.add_bytes_moved(size);
+    evict(final_path);
+    return true;
+}
+
+// Removes the least recently used entries but kept until all of them fit into max_bytes
+void stage_cache::evict(const string &kept) {
+    DIR *listing = opendir(directory.c_str());
+    if (listing == nullptr) {
+        return;
+    }
+    struct entry {
+        string path;
+        size_t size;
+        timespec used;
+    };
+    vector<entry> entries;
+    size_t total = 0;
+    while (dirent *d = readdir(listing)) {
+        string name = d->d_name;
+        if (name.size() <= entry_extension.size()
+            || name.compare(name.size() - entry_extension.size(), string::npos, entry_extension) != 0) {
+            continue;
+        }
+        struct stat entry_stat;
+        string entry_path = directory + "/" + name;
+        if (stat(entry_path.c_str(), &entry_stat) == 0) {
+            entries.push_back({entry_path, (size_t) entry_stat.st_size, entry_stat.st_mtim});
+            total += entry_stat.st_size;
+        }
+    }
+    closedir(listing);
+    sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for (const entry &e : entries) {
+        if (total <= max_bytes) {
+            break;
+        }
+        if (e.path != kept && unlink(e.path.c_str()) == 0) {
+            total -= e.size;
+        }
+    }
+}
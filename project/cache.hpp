@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "image.hpp"
+#include "pipeline.hpp"
+using namespace std;
+
+// On-disk cache of the images between the routines of a chain, so that running the same page again with only the
+// later routines changed starts from the result of the unchanged ones. An entry is the image after the first routines
+// of a chain, keyed by the hash of the input file, the grayscale conversion and those routines with all their
+// parameters. Entries are stored as their padded planes behind a short header, so that they are read with a single
+// read into an image, and the least recently used ones are removed once the directory takes more than its limit.
+
+// 64 bit hash of some bytes, computed like xxHash64
+uint64_t hash_bytes(const unsigned char *data, size_t size, uint64_t seed=0);
+bool hash_file(const char *filename, uint64_t *hash);
+
+class stage_cache {
+public:
+    // Entries for an input file with the given hash go to directory, which is created if it doesn't exist; gray is
+    // whether the input is converted to grayscale before the routines
+    stage_cache(const string &directory, size_t max_bytes, uint64_t input_hash, bool gray);
+    // Longest prefix of routines, up to all of them, whose result is cached, and loads that result into img
+    // Returns -1 and leaves img alone if not even the decoded input is cached
+    int load(const vector<routine> &routines, image *img);
+    // Stores img as the result of the first prefix routines, then removes the least recently used entries until the
+    // cache fits into its limit again. Returns false if the entry couldn't be written.
+    bool store(const vector<routine> &routines, int prefix, const image &img);
+private:
+    string key(const vector<routine> &routines, int prefix) const;
+    string path(const string &key) const;
+    void evict(const string &kept);
+
+    string directory;
+    size_t max_bytes;
+    uint64_t input_hash;
+    bool gray;
+};
@@ -0,0 +1,540 @@
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <unistd.h>
+#include <omp.h>
+#include <zlib.h>
+#include "compress.hpp"
+
+using namespace std;
+
+// Packs a row into bits, the most significant bit first, 1 for a black pixel as pbm and tiff store it
+void pack_bilevel_row(const unsigned char *intensity, unsigned char *bits, int width) {
+    for (int j=0; j < width; j += 8) {
+        unsigned char byte = 0;
+        int n = min(8, width - j);
+        for (int b=0; b < n; b++) {
+            byte |= (intensity[j + b] < bilevel_threshold) << (7 - b);
+        }
+        bits[j / 8] = byte;
+    }
+}
+
+// Writes all of data to fd, returns false on failure
+static bool write_all(int fd, const unsigned char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+chunk_encoder::chunk_encoder(int fd, int width, int height, size_t row_size, int chunk_rows)
+    : fd(fd), width(width), height(height), row_size(row_size), chunk_rows(chunk_rows),
+      group_rows(chunk_rows * omp_get_max_threads()), pending((size_t) group_rows * row_size) {}
+
+bool chunk_encoder::write_bytes(const unsigned char *data, size_t size) {
+    if (!failed) {
+        failed = !write_all(fd, data, size);
+        written += size;
+    }
+    return !failed;
+}
+
+bool chunk_encoder::store(const chunk &c) {
+    return write_bytes(c.data.data(), c.data.size());
+}
+
+// Compresses the pending rows, last if they end the image
+bool chunk_encoder::compress_group(bool last) {
+    int count = (pending_rows + chunk_rows - 1) / chunk_rows;
+    chunks.resize(count);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int k=0; k < count; k++) {
+        int rows = min(chunk_rows, pending_rows - k * chunk_rows);
+        compress(pending.data() + (size_t) k * chunk_rows * row_size, rows, last && k == count - 1, &chunks[k]);
+    }
+    for (int k=0; k < count && !failed; k++) {
+        failed = chunks[k].data.empty() || !store(chunks[k]);
+    }
+    group_stored();
+    pending_rows = 0;
+    return !failed;
+}
+
+// Appends count rows of img, starting at row first. A full group is only compressed once the next row arrives, so
+// that the last chunk is always compressed by finish.
+bool chunk_encoder::write_rows(const image &img, int first, int count) {
+    int done = 0;
+    while (done < count && !failed) {
+        if (pending_rows == group_rows) {
+            compress_group(false);
+        }
+        int rows = min(count - done, group_rows - pending_rows);
+        convert_rows(img, first + done, rows, pending.data() + (size_t) pending_rows * row_size);
+        pending_rows += rows;
+        done += rows;
+    }
+    return !failed;
+}
+
+// Compresses the rest of the rows and completes the file
+bool chunk_encoder::finish() {
+    if (!failed && pending_rows > 0) {
+        compress_group(true);
+    }
+    return !failed && end();
+}
+
+static void put_big_endian(vector<unsigned char> *out, uint32_t value) {
+    for (int shift=24; shift >= 0; shift -= 8) {
+        out->push_back(value >> shift);
+    }
+}
+
+static void put_little_endian(vector<unsigned char> *out, uint32_t value, int bytes) {
+    for (int k=0; k < bytes; k++) {
+        out->push_back(value >> (8 * k));
+    }
+}
+
+// Png with 8 bit samples: each row gets the filter with the smallest sum of absolute differences, and the filtered
+// rows form one zlib stream. Each chunk is a raw deflate stream that ends with a sync flush (the last one ends the
+// stream) and is primed with the 32 KB before it, so the streams continue each other like a single one.
+class png_encoder : public chunk_encoder {
+public:
+    png_encoder(int fd, int width, int height, int channels)
+        : chunk_encoder(fd, width, height, 1 + (size_t) width * channels, rows_per_chunk(width, channels)),
+          channels(channels), previous((size_t) width * channels) {}
+    static int rows_per_chunk(int width, int channels) {
+        size_t row = 1 + (size_t) width * channels;
+        return (int) max((size_t) 1, ((size_t) 256 << 10) / row); // At least the 32 KB of the window
+    }
+    bool start() override {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        vector<unsigned char> header(signature, signature + 8);
+        vector<unsigned char> fields;
+        put_big_endian(&fields, width);
+        put_big_endian(&fields, height);
+        fields.insert(fields.end(), {8, (unsigned char) (channels == 1 ? 0 : 2), 0, 0, 0}); // Gray or rgb, no interlace
+        put_chunk(&header, "IHDR", fields.data(), fields.size());
+        static const unsigned char zlib_header[2] = {0x78, 0x9c}; // Deflate with a 32 KB window, default level
+        put_chunk(&header, "IDAT", zlib_header, 2);
+        return write_bytes(header.data(), header.size());
+    }
+private:
+    static void put_chunk(vector<unsigned char> *out, const char *type, const unsigned char *data, size_t size) {
+        put_big_endian(out, size);
+        size_t start = out->size();
+        out->insert(out->end(), type, type + 4);
+        out->insert(out->end(), data, data + size);
+        put_big_endian(out, crc32(0, out->data() + start, size + 4));
+    }
+    // Writes row filtered against the row above it, after the type of the filter
+    void filter_row(const unsigned char *row, const unsigned char *above, unsigned char *out) {
+        int n = width * channels, bpp = channels;
+        unsigned int sums[5] = {0, 0, 0, 0, 0};
+        for (int k=0; k < n; k++) {
+            int a = k >= bpp ? row[k - bpp] : 0, b = above[k], c = k >= bpp ? above[k - bpp] : 0, x = row[k];
+            sums[0] += abs((signed char) x);
+            sums[1] += abs((signed char) (x - a));
+            sums[2] += abs((signed char) (x - b));
+            sums[3] += abs((signed char) (x - (a + b) / 2));
+            sums[4] += abs((signed char) (x - paeth(a, b, c)));
+        }
+        int type = min_element(sums, sums + 5) - sums;
+        out[0] = type;
+        for (int k=0; k < n; k++) {
+            int a = k >= bpp ? row[k - bpp] : 0, b = above[k], c = k >= bpp ? above[k - bpp] : 0, x = row[k];
+            int predicted = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+            out[1 + k] = x - predicted;
+        }
+    }
+    static int paeth(int a, int b, int c) {
+        int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+    void raw_row(const image &img, int y, unsigned char *out) const {
+        if (channels == 1) {
+            img.luma_row(y, out);
+        } else {
+            img.rgb_row(y, out);
+        }
+    }
+    void convert_rows(const image &img, int first, int count, unsigned char *out) override {
+        size_t n = (size_t) width * channels;
+#pragma omp parallel
+        {
+            pooled_array<unsigned char> row(n), above(n);
+#pragma omp for schedule(static)
+            for (int i=0; i < count; i++) {
+                if (i > 0) {
+                    raw_row(img, first + i - 1, above.data());
+                } else if (rows_converted > 0) {
+                    memcpy(above.data(), previous.data(), n);
+                } else { // The first row of the image is filtered against zeros
+                    memset(above.data(), 0, n);
+                }
+                raw_row(img, first + i, row.data());
+                filter_row(row.data(), above.data(), out + i * row_size);
+            }
+        }
+        raw_row(img, first + count - 1, previous.data());
+        rows_converted += count;
+    }
+    void compress(const unsigned char *rows, int count, bool last, chunk *out) override {
+        size_t size = (size_t) count * row_size;
+        out->data.clear();
+        out->raw_size = size;
+        out->check = adler32(adler32(0, nullptr, 0), rows, size);
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+            return;
+        }
+        if (rows != pending.data()) { // Chunks hold at least 32 KB, the one before is still pending
+            deflateSetDictionary(&z, rows - window_size, window_size);
+        } else if (!window.empty()) {
+            deflateSetDictionary(&z, window.data(), window.size());
+        }
+        vector<unsigned char> &data = out->data;
+        data.resize(8 + deflateBound(&z, size) + 64); // Room for the empty block of the flush, and the chunk frame
+        z.next_in = (Bytef*) rows;
+        z.avail_in = size;
+        z.next_out = data.data() + 8;
+        z.avail_out = data.size() - 8;
+        int result = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+        size_t compressed = z.total_out;
+        deflateEnd(&z);
+        if (result != (last ? Z_STREAM_END : Z_OK) || z.avail_in != 0) {
+            data.clear();
+            return;
+        }
+        data.resize(8 + compressed);
+        for (int k=0; k < 4; k++) {
+            data[k] = compressed >> (24 - 8 * k);
+        }
+        memcpy(data.data() + 4, "IDAT", 4);
+        uint32_t crc = crc32(0, data.data() + 4, compressed + 4);
+        for (int shift=24; shift >= 0; shift -= 8) {
+            data.push_back(crc >> shift);
+        }
+    }
+    bool store(const chunk &c) override {
+        checksum = adler32_combine(checksum, c.check, c.raw_size);
+        return chunk_encoder::store(c);
+    }
+    void group_stored() override { // The last 32 KB prime the first chunk of the next group
+        size_t size = (size_t) pending_rows * row_size;
+        size_t kept = min(size, window_size);
+        window.assign(pending.data() + size - kept, pending.data() + size);
+    }
+    bool end() override {
+        vector<unsigned char> trailer, check;
+        put_big_endian(&check, checksum);
+        put_chunk(&trailer, "IDAT", check.data(), 4);
+        put_chunk(&trailer, "IEND", nullptr, 0);
+        return write_bytes(trailer.data(), trailer.size());
+    }
+
+    static const size_t window_size = 32768;
+    int channels;
+    pooled_array<unsigned char> previous; // Unfiltered last row that was converted, the row above the next one
+    size_t rows_converted = 0;
+    vector<unsigned char> window; // Last 32 KB of the filtered rows of the earlier groups
+    uint32_t checksum = 1; // Adler-32 of all filtered rows so far
+};
+
+// Codes of the CCITT T.4 runs, as bits and their count
+struct fax_code {
+    uint16_t bits;
+    uint8_t length;
+};
+
+static const fax_code white_terminating[64] = {
+    {0b00110101, 8}, {0b000111, 6}, {0b0111, 4}, {0b1000, 4}, {0b1011, 4}, {0b1100, 4}, {0b1110, 4}, {0b1111, 4},
+    {0b10011, 5}, {0b10100, 5}, {0b00111, 5}, {0b01000, 5}, {0b001000, 6}, {0b000011, 6}, {0b110100, 6},
+    {0b110101, 6}, {0b101010, 6}, {0b101011, 6}, {0b0100111, 7}, {0b0001100, 7}, {0b0001000, 7}, {0b0010111, 7},
+    {0b0000011, 7}, {0b0000100, 7}, {0b0101000, 7}, {0b0101011, 7}, {0b0010011, 7}, {0b0100100, 7}, {0b0011000, 7},
+    {0b00000010, 8}, {0b00000011, 8}, {0b00011010, 8}, {0b00011011, 8}, {0b00010010, 8}, {0b00010011, 8},
+    {0b00010100, 8}, {0b00010101, 8}, {0b00010110, 8}, {0b00010111, 8}, {0b00101000, 8}, {0b00101001, 8},
+    {0b00101010, 8}, {0b00101011, 8}, {0b00101100, 8}, {0b00101101, 8}, {0b00000100, 8}, {0b00000101, 8},
+    {0b00001010, 8}, {0b00001011, 8}, {0b01010010, 8}, {0b01010011, 8}, {0b01010100, 8}, {0b01010101, 8},
+    {0b00100100, 8}, {0b00100101, 8}, {0b01011000, 8}, {0b01011001, 8}, {0b01011010, 8}, {0b01011011, 8},
+    {0b01001010, 8}, {0b01001011, 8}, {0b00110010, 8}, {0b00110011, 8}, {0b00110100, 8}
+};
+
+static const fax_code black_terminating[64] = {
+    {0b0000110111, 10}, {0b010, 3}, {0b11, 2}, {0b10, 2}, {0b011, 3}, {0b0011, 4}, {0b0010, 4}, {0b00011, 5},
+    {0b000101, 6}, {0b000100, 6}, {0b0000100, 7}, {0b0000101, 7}, {0b0000111, 7}, {0b00000100, 8},
+    {0b00000111, 8}, {0b000011000, 9}, {0b0000010111, 10}, {0b0000011000, 10}, {0b0000001000, 10},
+    {0b00001100111, 11}, {0b00001101000, 11}, {0b00001101100, 11}, {0b00000110111, 11}, {0b00000101000, 11},
+    {0b00000010111, 11}, {0b00000011000, 11}, {0b000011001010, 12}, {0b000011001011, 12}, {0b000011001100, 12},
+    {0b000011001101, 12}, {0b000001101000, 12}, {0b000001101001, 12}, {0b000001101010, 12}, {0b000001101011, 12},
+    {0b000011010010, 12}, {0b000011010011, 12}, {0b000011010100, 12}, {0b000011010101, 12}, {0b000011010110, 12},
+    {0b000011010111, 12}, {0b000001101100, 12}, {0b000001101101, 12}, {0b000011011010, 12}, {0b000011011011, 12},
+    {0b000001010100, 12}, {0b000001010101, 12}, {0b000001010110, 12}, {0b000001010111, 12}, {0b000001100100, 12},
+    {0b000001100101, 12}, {0b000001010010, 12}, {0b000001010011, 12}, {0b000000100100, 12}, {0b000000110111, 12},
+    {0b000000111000, 12}, {0b000000100111, 12}, {0b000000101000, 12}, {0b000001011000, 12}, {0b000001011001, 12},
+    {0b000000101011, 12}, {0b000000101100, 12}, {0b000001011010, 12}, {0b000001100110, 12}, {0b000001100111, 12}
+};
+
+// Runs of 64 to 1728 in steps of 64
+static const fax_code white_makeup[27] = {
+    {0b11011, 5}, {0b10010, 5}, {0b010111, 6}, {0b0110111, 7}, {0b00110110, 8}, {0b00110111, 8}, {0b01100100, 8},
+    {0b01100101, 8}, {0b01101000, 8}, {0b01100111, 8}, {0b011001100, 9}, {0b011001101, 9}, {0b011010010, 9},
+    {0b011010011, 9}, {0b011010100, 9}, {0b011010101, 9}, {0b011010110, 9}, {0b011010111, 9}, {0b011011000, 9},
+    {0b011011001, 9}, {0b011011010, 9}, {0b011011011, 9}, {0b010011000, 9}, {0b010011001, 9}, {0b010011010, 9},
+    {0b011000, 6}, {0b010011011, 9}
+};
+
+static const fax_code black_makeup[27] = {
+    {0b0000001111, 10}, {0b000011001000, 12}, {0b000011001001, 12}, {0b000001011011, 12}, {0b000000110011, 12},
+    {0b000000110100, 12}, {0b000000110101, 12}, {0b0000001101100, 13}, {0b0000001101101, 13}, {0b0000001001010, 13},
+    {0b0000001001011, 13}, {0b0000001001100, 13}, {0b0000001001101, 13}, {0b0000001110010, 13},
+    {0b0000001110011, 13}, {0b0000001110100, 13}, {0b0000001110101, 13}, {0b0000001110110, 13},
+    {0b0000001110111, 13}, {0b0000001010010, 13}, {0b0000001010011, 13}, {0b0000001010100, 13},
+    {0b0000001010101, 13}, {0b0000001011010, 13}, {0b0000001011011, 13}, {0b0000001100100, 13}, {0b0000001100101, 13}
+};
+
+// Runs of 1792 to 2560 in steps of 64, the same for both colors
+static const fax_code extended_makeup[13] = {
+    {0b00000001000, 11}, {0b00000001100, 11}, {0b00000001101, 11}, {0b000000010010, 12}, {0b000000010011, 12},
+    {0b000000010100, 12}, {0b000000010101, 12}, {0b000000010110, 12}, {0b000000010111, 12}, {0b000000011100, 12},
+    {0b000000011101, 12}, {0b000000011110, 12}, {0b000000011111, 12}
+};
+
+static const fax_code pass_code = {0b0001, 4};
+static const fax_code horizontal_code = {0b001, 3};
+static const fax_code vertical_codes[7] = { // For b1 - a1 from -3 (a1 right of b1) to 3
+    {0b0000011, 7}, {0b000011, 6}, {0b011, 3}, {0b1, 1}, {0b010, 3}, {0b000010, 6}, {0b0000010, 7}
+};
+
+// Collects codes into bytes, the first bit is the most significant one
+class bit_writer {
+public:
+    bit_writer(vector<unsigned char> *out) : out(out) {}
+    void put(fax_code code) {
+        bits = (bits << code.length) | code.bits;
+        count += code.length;
+        while (count >= 8) {
+            count -= 8;
+            out->push_back(bits >> count);
+        }
+        bits &= (1u << count) - 1;
+    }
+    void put_run(int run, bool black) {
+        const fax_code *makeup = black ? black_makeup : white_makeup;
+        while (run >= 2624) { // Longer than the largest makeup and terminating code together
+            put(extended_makeup[12]);
+            run -= 2560;
+        }
+        if (run >= 64) {
+            int k = run / 64;
+            put(k <= 27 ? makeup[k - 1] : extended_makeup[k - 28]);
+            run -= k * 64;
+        }
+        put((black ? black_terminating : white_terminating)[run]);
+    }
+    void flush() {
+        if (count > 0) {
+            out->push_back(bits << (8 - count));
+            count = 0;
+            bits = 0;
+        }
+    }
+private:
+    vector<unsigned char> *out;
+    uint32_t bits = 0;
+    int count = 0;
+};
+
+// Positions where the color of a packed row changes, starting from white before the first pixel, followed by three
+// times the width so that the coder can look past the last change
+static void changing_elements(const unsigned char *bits, int width, vector<int> *changes) {
+    changes->clear();
+    int color = 0;
+    for (int j=0; j < width; j += 8) {
+        unsigned char byte = bits[j / 8];
+        if (byte == (color ? 0xff : 0x00) && j + 8 <= width) {
+            continue;
+        }
+        int n = min(8, width - j);
+        for (int b=0; b < n; b++) {
+            int pixel = (byte >> (7 - b)) & 1;
+            if (pixel != color) {
+                changes->push_back(j + b);
+                color = pixel;
+            }
+        }
+    }
+    changes->insert(changes->end(), 3, width);
+}
+
+// Codes a row in two dimensional mode against the row above it, as T.6 describes it. Changes with an even index make
+// a row black, those with an odd index white again.
+static void encode_g4_row(const vector<int> &row, const vector<int> &reference, int width, bit_writer *out) {
+    int a0 = 0;
+    bool black = false; // Color at a0
+    bool start = true; // a0 is before the first pixel
+    size_t i = 0, r = 0; // First changes after a0 of both rows
+    while (true) {
+        int after = start ? -1 : a0;
+        while (row[i] <= after) {
+            i++;
+        }
+        while (reference[r] <= after) {
+            r++;
+        }
+        int a1 = row[i];
+        size_t b = r + ((r % 2 == 1) != black); // b1 changes to the color that a0 doesn't have
+        int b1 = reference[b], b2 = reference[b + 1];
+        if (b2 < a1) {
+            out->put(pass_code);
+            a0 = b2;
+        } else if (abs(b1 - a1) <= 3) {
+            out->put(vertical_codes[b1 - a1 + 3]);
+            a0 = a1;
+            black = !black;
+        } else {
+            int a2 = row[i + 1];
+            out->put(horizontal_code);
+            out->put_run(a1 - a0, black);
+            out->put_run(a2 - a1, !black);
+            a0 = a2;
+        }
+        start = false;
+        if (a0 >= width) {
+            break;
+        }
+    }
+}
+
+// Tiff with one bit per pixel and CCITT group 4 compression, every chunk is a strip that starts against a white
+// row and ends with an EOFB. The strips are written after the header, the directory with their offsets at the end.
+class tiff_g4_encoder : public chunk_encoder {
+public:
+    tiff_g4_encoder(int fd, int width, int height)
+        : chunk_encoder(fd, width, height, ((size_t) width + 7) / 8, strip_rows) {}
+    bool start() override {
+        start_offset = lseek(fd, 0, SEEK_CUR); // The directory offset is filled in at the end
+        unsigned char header[8] = {'I', 'I', 42, 0, 0, 0, 0, 0};
+        return start_offset >= 0 && write_bytes(header, 8);
+    }
+    static const int strip_rows = 128;
+private:
+    void convert_rows(const image &img, int first, int count, unsigned char *out) override {
+#pragma omp parallel
+        {
+            pooled_array<unsigned char> intensity(width);
+#pragma omp for schedule(static)
+            for (int i=0; i < count; i++) {
+                img.luma_row(first + i, intensity.data());
+                pack_bilevel_row(intensity.data(), out + i * row_size, width);
+            }
+        }
+    }
+    void compress(const unsigned char *rows, int count, bool, chunk *out) override {
+        out->data.clear();
+        bit_writer bits(&out->data);
+        vector<int> reference(3, width), row; // The first row is coded against a white one
+        for (int i=0; i < count; i++) {
+            changing_elements(rows + i * row_size, width, &row);
+            encode_g4_row(row, reference, width, &bits);
+            swap(row, reference);
+        }
+        static const fax_code eol = {0b000000000001, 12};
+        bits.put(eol);
+        bits.put(eol);
+        bits.flush();
+    }
+    bool store(const chunk &c) override {
+        strip_offsets.push_back(written);
+        strip_sizes.push_back(c.data.size());
+        return chunk_encoder::store(c);
+    }
+    bool end() override {
+        vector<unsigned char> directory;
+        if (written % 2 == 1) { // The directory starts at a word boundary
+            directory.push_back(0);
+        }
+        size_t strips = strip_offsets.size();
+        const int entries = 9;
+        size_t directory_offset = written + directory.size();
+        size_t arrays_offset = directory_offset + 2 + entries * 12 + 4;
+        if (arrays_offset + strips * 8 > UINT32_MAX) {
+            return false; // Tiff offsets have 32 bits
+        }
+        // Arrays of a single value are stored in their entry
+        uint32_t offsets_at = strips == 1 ? strip_offsets[0] : arrays_offset;
+        uint32_t sizes_at = strips == 1 ? strip_sizes[0] : arrays_offset + strips * 4;
+        auto entry = [&](int tag, int type, uint32_t count, uint32_t value) {
+            put_little_endian(&directory, tag, 2);
+            put_little_endian(&directory, type, 2);
+            put_little_endian(&directory, count, 4);
+            put_little_endian(&directory, value, 4);
+        };
+        const int type_short = 3, type_long = 4;
+        put_little_endian(&directory, entries, 2);
+        entry(256, type_long, 1, width); // ImageWidth
+        entry(257, type_long, 1, height); // ImageLength
+        entry(258, type_short, 1, 1); // BitsPerSample
+        entry(259, type_short, 1, 4); // Compression: CCITT group 4
+        entry(262, type_short, 1, 0); // PhotometricInterpretation: white is zero
+        entry(273, type_long, strips, offsets_at); // StripOffsets
+        entry(277, type_short, 1, 1); // SamplesPerPixel
+        entry(278, type_long, 1, strip_rows); // RowsPerStrip
+        entry(279, type_long, strips, sizes_at); // StripByteCounts
+        put_little_endian(&directory, 0, 4); // No further directory
+        if (strips > 1) {
+            for (size_t offset : strip_offsets) {
+                put_little_endian(&directory, offset, 4);
+            }
+            for (size_t size : strip_sizes) {
+                put_little_endian(&directory, size, 4);
+            }
+        }
+        if (!write_bytes(directory.data(), directory.size())) {
+            return false;
+        }
+        unsigned char offset[4] = {(unsigned char) directory_offset, (unsigned char) (directory_offset >> 8),
+                                   (unsigned char) (directory_offset >> 16), (unsigned char) (directory_offset >> 24)};
+        return pwrite(fd, offset, 4, start_offset + 4) == 4;
+    }
+
+    off_t start_offset = 0;
+    vector<size_t> strip_offsets, strip_sizes;
+};
+
+unique_ptr<chunk_encoder> make_chunk_encoder(int fd, int width, int height, int channels, image_format format) {
+    if (format == FORMAT_PNG) {
+        return unique_ptr<chunk_encoder>(new png_encoder(fd, width, height, channels));
+    } else if (format == FORMAT_TIFF) {
+        return unique_ptr<chunk_encoder>(new tiff_g4_encoder(fd, width, height));
+    }
+    return nullptr;
+}
+
+// Bytes an encoder keeps: the converted rows of a group and what they are compressed to
+size_t chunk_encoder_memory(int width, int channels, image_format format) {
+    size_t row_size, chunk_rows;
+    if (format == FORMAT_PNG) {
+        row_size = 1 + (size_t) width * channels;
+        chunk_rows = png_encoder::rows_per_chunk(width, channels);
+    } else if (format == FORMAT_TIFF) {
+        row_size = ((size_t) width + 7) / 8;
+        chunk_rows = tiff_g4_encoder::strip_rows;
+    } else {
+        return 0;
+    }
+    return 2 * chunk_rows * omp_get_max_threads() * row_size;
+}
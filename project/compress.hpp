@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include "prettify.hpp"
+#include "pool.hpp"
+using namespace std;
+
+// Encoders of the compressed formats raster_writer can write. Rows are collected into chunks of a fixed height, the
+// chunks of a group are compressed at the same time, one per thread, and written in order. The height of a chunk
+// only depends on the width, so a file is the same whatever strips or threads it was written with.
+
+void pack_bilevel_row(const unsigned char *intensity, unsigned char *bits, int width);
+
+class chunk_encoder {
+public:
+    chunk_encoder(int fd, int width, int height, size_t row_size, int chunk_rows);
+    chunk_encoder(const chunk_encoder&) = delete;
+    chunk_encoder& operator=(const chunk_encoder&) = delete;
+    virtual ~chunk_encoder() {}
+    virtual bool start() = 0;
+    bool write_rows(const image &img, int first, int count);
+    bool finish();
+    size_t bytes_written() const { return written; }
+protected:
+    // A compressed chunk, empty if it couldn't be compressed, with what the file needs to know about it
+    struct chunk {
+        vector<unsigned char> data;
+        size_t raw_size = 0;
+        uint32_t check = 0;
+    };
+    // Converts count rows of img, starting at row first, to row_size bytes each; called in the order of the rows
+    virtual void convert_rows(const image &img, int first, int count, unsigned char *out) = 0;
+    // Compresses count converted rows that start a chunk, called for all chunks of a group at once
+    virtual void compress(const unsigned char *rows, int count, bool last, chunk *out) = 0;
+    // Appends a compressed chunk to the file, called in the order of the chunks
+    virtual bool store(const chunk &c);
+    // Called once all chunks of a group are stored, before their rows are replaced
+    virtual void group_stored() {}
+    virtual bool end() = 0;
+    bool write_bytes(const unsigned char *data, size_t size);
+    bool compress_group(bool last);
+
+    int fd;
+    int width, height;
+    size_t row_size; // Bytes of a converted row
+    int chunk_rows, group_rows;
+    pooled_array<unsigned char> pending; // Converted rows of the group that isn't compressed yet
+    int pending_rows = 0;
+    vector<chunk> chunks;
+    size_t written = 0;
+    bool failed = false;
+};
+
+// Encoder for the compressed formats, nullptr for the others; channels is 1 for a grayscale png, 3 for rgb
+unique_ptr<chunk_encoder> make_chunk_encoder(int fd, int width, int height, int channels, image_format format);
+size_t chunk_encoder_memory(int width, int channels, image_format format);
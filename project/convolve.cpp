@@ -0,0 +1,413 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "convolve.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Rounds a fixed-point sum of weighted samples to the nearest sample value
+inline unsigned char round_sum(int32_t sum) {
+    sum = (sum + (1 << (kernel_shift-1))) >> kernel_shift;
+    return sum > 255 ? 255 : sum;
+}
+
+// out[k] is the weighted sum of src[t][k] over all taps t, with weights in fixed point, for k from first to n
+static void weighted_sum_scalar(const unsigned char * const *src, const int16_t *weights, int taps, unsigned char *out,
+                                size_t n, size_t first=0) {
+    for (size_t k=first; k < n; k++) {
+        int32_t sum = 0;
+        for (int t=0; t < taps; t++) {
+            sum += src[t][k] * weights[t];
+        }
+        out[k] = round_sum(sum);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same as weighted_sum_scalar with 16 samples at a time, products are computed in 32 bit so no precision is lost
+__attribute__((target("avx2")))
+static void weighted_sum_avx2(const unsigned char * const *src, const int16_t *weights, int taps, unsigned char *out,
+                              size_t n) {
+    size_t k = 0;
+    const __m256i rounding = _mm256_set1_epi32(1 << (kernel_shift-1));
+    for (; k + 16 <= n; k += 16) {
+        __m256i sum_lo = rounding;
+        __m256i sum_hi = rounding;
+        for (int t=0; t < taps; t++) {
+            __m128i samples = _mm_loadu_si128((const __m128i*) (src[t] + k));
+            __m256i weight = _mm256_set1_epi32(weights[t]);
+            __m256i lower = _mm256_cvtepu8_epi32(samples), upper = _mm256_cvtepu8_epi32(_mm_srli_si128(samples, 8));
+            sum_lo = _mm256_add_epi32(sum_lo, _mm256_mullo_epi32(lower, weight));
+            sum_hi = _mm256_add_epi32(sum_hi, _mm256_mullo_epi32(upper, weight));
+        }
+        sum_lo = _mm256_srai_epi32(sum_lo, kernel_shift);
+        sum_hi = _mm256_srai_epi32(sum_hi, kernel_shift);
+        // Packing works within 128 bit lanes, so the 64 bit quarters have to be put back in order twice
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum_lo, sum_hi), 0xD8);
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+        _mm_storeu_si128((__m128i*) (out + k), _mm256_castsi256_si128(bytes));
+    }
+    weighted_sum_scalar(src, weights, taps, out, n, k); // The last few samples don't fill a whole vector
+}
+
+// Same as weighted_sum_avx2 with all 16 sums in one register, which can be narrowed to bytes directly
+__attribute__((target("avx512f")))
+static void weighted_sum_avx512(const unsigned char * const *src, const int16_t *weights, int taps, unsigned char *out,
+                                size_t n) {
+    size_t k = 0;
+    const __m512i rounding = _mm512_set1_epi32(1 << (kernel_shift-1));
+    for (; k + 16 <= n; k += 16) {
+        __m512i sum = rounding;
+        for (int t=0; t < taps; t++) {
+            __m512i samples = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (src[t] + k)));
+            sum = _mm512_add_epi32(sum, _mm512_mullo_epi32(samples, _mm512_set1_epi32(weights[t])));
+        }
+        sum = _mm512_srai_epi32(sum, kernel_shift);
+        _mm_storeu_si128((__m128i*) (out + k), _mm512_cvtusepi32_epi8(sum));
+    }
+    weighted_sum_scalar(src, weights, taps, out, n, k);
+}
+#endif
+
+// Same as the kernels above with the number of taps known at compile time, for the radii scans are mostly filtered
+// with: the tap loops are unrolled, and weights and row pointers are kept in registers instead of being reloaded
+// for every vector, since the compiler can't tell that writing out doesn't change them
+template <int taps>
+static void weighted_sum_scalar_fixed(const unsigned char * const *src, const int16_t *weights, unsigned char *out,
+                                      size_t n) {
+    const unsigned char *rows[taps];
+    int32_t w[taps];
+    for (int t=0; t < taps; t++) {
+        rows[t] = src[t];
+        w[t] = weights[t];
+    }
+    for (size_t k=0; k < n; k++) {
+        int32_t sum = 0;
+#pragma GCC unroll 16
+        for (int t=0; t < taps; t++) {
+            sum += rows[t][k] * w[t];
+        }
+        out[k] = round_sum(sum);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <int taps>
+__attribute__((target("avx2")))
+static void weighted_sum_avx2_fixed(const unsigned char * const *src, const int16_t *weights, unsigned char *out,
+                                    size_t n) {
+    const unsigned char *rows[taps];
+    __m256i w[taps];
+    for (int t=0; t < taps; t++) {
+        rows[t] = src[t];
+        w[t] = _mm256_set1_epi32(weights[t]);
+    }
+    size_t k = 0;
+    const __m256i rounding = _mm256_set1_epi32(1 << (kernel_shift-1));
+    for (; k + 16 <= n; k += 16) {
+        __m256i sum_lo = rounding;
+        __m256i sum_hi = rounding;
+#pragma GCC unroll 16
+        for (int t=0; t < taps; t++) {
+            __m128i samples = _mm_loadu_si128((const __m128i*) (rows[t] + k));
+            __m256i lower = _mm256_cvtepu8_epi32(samples), upper = _mm256_cvtepu8_epi32(_mm_srli_si128(samples, 8));
+            sum_lo = _mm256_add_epi32(sum_lo, _mm256_mullo_epi32(lower, w[t]));
+            sum_hi = _mm256_add_epi32(sum_hi, _mm256_mullo_epi32(upper, w[t]));
+        }
+        sum_lo = _mm256_srai_epi32(sum_lo, kernel_shift);
+        sum_hi = _mm256_srai_epi32(sum_hi, kernel_shift);
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum_lo, sum_hi), 0xD8);
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+        _mm_storeu_si128((__m128i*) (out + k), _mm256_castsi256_si128(bytes));
+    }
+    for (int t=0; t < taps; t++) {
+        rows[t] += k;
+    }
+    weighted_sum_scalar_fixed<taps>(rows, weights, out + k, n - k);
+}
+
+template <int taps>
+__attribute__((target("avx512f")))
+static void weighted_sum_avx512_fixed(const unsigned char * const *src, const int16_t *weights, unsigned char *out,
+                                      size_t n) {
+    const unsigned char *rows[taps];
+    __m512i w[taps];
+    for (int t=0; t < taps; t++) {
+        rows[t] = src[t];
+        w[t] = _mm512_set1_epi32(weights[t]);
+    }
+    size_t k = 0;
+    const __m512i rounding = _mm512_set1_epi32(1 << (kernel_shift-1));
+    for (; k + 16 <= n; k += 16) {
+        __m512i sum = rounding;
+#pragma GCC unroll 16
+        for (int t=0; t < taps; t++) {
+            __m512i samples = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (rows[t] + k)));
+            sum = _mm512_add_epi32(sum, _mm512_mullo_epi32(samples, w[t]));
+        }
+        sum = _mm512_srai_epi32(sum, kernel_shift);
+        _mm_storeu_si128((__m128i*) (out + k), _mm512_cvtusepi32_epi8(sum));
+    }
+    for (int t=0; t < taps; t++) {
+        rows[t] += k;
+    }
+    weighted_sum_scalar_fixed<taps>(rows, weights, out + k, n - k);
+}
+#endif
+
+simd_level detected_simd_level() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+// The best level the cpu supports, unless PRETTIFY_SIMD (scalar, avx2 or avx512) asks for a lower one
+static simd_level initial_simd_level() {
+    simd_level level = detected_simd_level();
+    const char *requested = getenv("PRETTIFY_SIMD");
+    if (requested != nullptr && strcmp(requested, "scalar") == 0) {
+        level = SIMD_SCALAR;
+    } else if (requested != nullptr && strcmp(requested, "avx2") == 0 && level > SIMD_AVX2) {
+        level = SIMD_AVX2;
+    }
+    return level;
+}
+
+static simd_level active_level = initial_simd_level();
+
+simd_level current_simd_level() {
+    return active_level;
+}
+
+void set_simd_level(simd_level level) {
+    simd_level supported = detected_simd_level();
+    active_level = level > supported ? supported : level;
+}
+
+static bool specialized = true;
+
+bool specialized_kernels() {
+    return specialized;
+}
+
+void set_specialized_kernels(bool enabled) {
+    specialized = enabled;
+}
+
+template <int taps>
+static void weighted_sum_fixed(const unsigned char * const *src, const int16_t *weights, unsigned char *out, size_t n) {
+    switch (active_level) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX512:
+            weighted_sum_avx512_fixed<taps>(src, weights, out, n);
+            break;
+        case SIMD_AVX2:
+            weighted_sum_avx2_fixed<taps>(src, weights, out, n);
+            break;
+#endif
+        default:
+            weighted_sum_scalar_fixed<taps>(src, weights, out, n);
+    }
+}
+
+// Dispatches to the kernel of the active simd level, specialized for the number of taps of radii up to
+// specialized_radius. Other numbers of taps, like those of rows near the top and bottom of an image, use the
+// generic kernels.
+void weighted_sum(const unsigned char * const *src, const int16_t *weights, int taps, unsigned char *out, size_t n) {
+    if (specialized) {
+        switch (taps) {
+            case 3:
+                return weighted_sum_fixed<3>(src, weights, out, n);
+            case 5:
+                return weighted_sum_fixed<5>(src, weights, out, n);
+            case 7:
+                return weighted_sum_fixed<7>(src, weights, out, n);
+            case 9:
+                return weighted_sum_fixed<9>(src, weights, out, n);
+            case 11:
+                return weighted_sum_fixed<11>(src, weights, out, n);
+        }
+    }
+    switch (active_level) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX512:
+            weighted_sum_avx512(src, weights, taps, out, n);
+            break;
+        case SIMD_AVX2:
+            weighted_sum_avx2(src, weights, taps, out, n);
+            break;
+#endif
+        default:
+            weighted_sum_scalar(src, weights, taps, out, n);
+    }
+}
+
+// Index of the pixel that stands in for pos in a row or column of n pixels, -1 if it is left out
+// Reflection repeats as often as needed, for windows larger than the image
+int border_index(int pos, int n, border_policy border) {
+    if (pos >= 0 && pos < n) {
+        return pos;
+    }
+    switch (border) {
+        case BORDER_REPLICATE:
+            return pos < 0 ? 0 : n-1;
+        case BORDER_REFLECT: {
+            if (n == 1) {
+                return 0;
+            }
+            int period = 2*n - 2;
+            pos %= period;
+            if (pos < 0) {
+                pos += period;
+            }
+            return pos < n ? pos : period - pos;
+        }
+        default:
+            return -1;
+    }
+}
+
+// Convolves the n samples of a row with a kernel of 2*radius+1 taps, step samples apart (3 for interleaved rgb)
+// Taps outside the row are handled by the border policy, ignoring them causes shadows with large radii
+void convolve_row(const unsigned char *in, unsigned char *out, size_t n, int step, const int16_t *kernel, int radius,
+                  border_policy border) {
+    // Samples closer than this to an end of the row have taps outside of it
+    size_t border_width = min((size_t) radius * step, n);
+    long pixels = n / step;
+    auto convolve_edge = [&](size_t k) {
+        int32_t sum = 0;
+        long pixel = k / step;
+        for (int x=-radius; x <= radius; x++) {
+            long pos = border_index(pixel + x, pixels, border);
+            if (pos >= 0) {
+                sum += in[pos*step + k % step] * kernel[x+radius];
+            }
+        }
+        out[k] = round_sum(sum);
+    };
+    for (size_t k=0; k < border_width; k++) {
+        convolve_edge(k);
+    }
+    if (n > 2*border_width) { // Every tap of the interior is inside the row, so it goes to the vector kernels
+        // Kept by each thread for the next rows, so that convolving a row doesn't allocate
+        static thread_local vector<const unsigned char*> src;
+        src.resize(2*radius+1);
+        for (int x=-radius; x <= radius; x++) {
+            src[x+radius] = in + border_width + (long) x*step;
+        }
+        weighted_sum(src.data(), kernel, 2*radius+1, out + border_width, n - 2*border_width);
+    }
+    for (size_t k=max(border_width, n - border_width); k < n; k++) {
+        convolve_edge(k);
+    }
+}
+
+// Interpolates a plane between the four pixels around a position in bilinear_shift fixed point, with 8 bit weights
+// Pixels outside the plane count as outside, so that the edges of the plane fade into it
+static inline unsigned char bilinear_sample(const unsigned char *plane, size_t stride, int width, int height,
+                                            int64_t x, int64_t y, unsigned char outside) {
+    int64_t ix = x >> bilinear_shift, iy = y >> bilinear_shift;
+    int32_t fx = (x >> (bilinear_shift-8)) & 255, fy = (y >> (bilinear_shift-8)) & 255;
+    int32_t p[4];
+    for (int k=0; k < 4; k++) {
+        int64_t px = ix + (k & 1), py = iy + (k >> 1);
+        p[k] = px >= 0 && px < width && py >= 0 && py < height ? plane[py*stride + px] : outside;
+    }
+    int32_t top = p[0]*256 + (p[1]-p[0])*fx, bottom = p[2]*256 + (p[3]-p[2])*fx;
+    return (top*256 + (bottom-top)*fy + 32768) >> 16;
+}
+
+static void bilinear_row_scalar(const unsigned char *plane, size_t stride, int width, int height, int64_t x, int64_t y,
+                                int32_t dx, int32_t dy, unsigned char *out, size_t n, unsigned char outside) {
+    for (size_t k=0; k < n; k++, x += dx, y += dy) {
+        out[k] = bilinear_sample(plane, stride, width, height, x, y, outside);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Interpolates between the two lowest bytes of every lane: left*256 + (right-left)*fx
+__attribute__((target("avx2")))
+static inline __m256i bilinear_horizontal(__m256i pair, __m256i fx) {
+    const __m256i byte = _mm256_set1_epi32(255);
+    __m256i left = _mm256_and_si256(pair, byte), right = _mm256_and_si256(_mm256_srli_epi32(pair, 8), byte);
+    return _mm256_add_epi32(_mm256_slli_epi32(left, 8), _mm256_mullo_epi32(_mm256_sub_epi32(right, left), fx));
+}
+
+// Same as bilinear_row_scalar with 8 pixels at a time, whenever all four neighbours of all 8 are inside the plane.
+// Positions move along a line, so if the first and the last pixel of 8 are inside, all of them are. The two
+// neighbours in a row are gathered as one 32 bit word from the top row and one from the bottom row.
+__attribute__((target("avx2")))
+static void bilinear_row_avx2(const unsigned char *plane, size_t stride, int width, int height, int64_t x, int64_t y,
+                              int32_t dx, int32_t dy, unsigned char *out, size_t n, unsigned char outside) {
+    // Gathers read 4 bytes, which have to be within the row, and offsets are 32 bit
+    int64_t last_x = min((int64_t) width - 2, (int64_t) stride - 4), last_y = height - 2;
+    if (width >= 32768 || height >= 32768 || (uint64_t) stride * height >= ((uint64_t) 1 << 31)) {
+        return bilinear_row_scalar(plane, stride, width, height, x, y, dx, dy, out, n, outside);
+    }
+    auto inside = [&](int64_t px, int64_t py) {
+        px >>= bilinear_shift;
+        py >>= bilinear_shift;
+        return px >= 0 && px <= last_x && py >= 0 && py <= last_y;
+    };
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step_x = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dx));
+    const __m256i step_y = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dy));
+    const __m256i row_stride = _mm256_set1_epi32((int32_t) stride);
+    const __m256i byte = _mm256_set1_epi32(255), rounding = _mm256_set1_epi32(32768);
+    size_t k = 0;
+    while (k < n) {
+        if (k + 8 > n || !inside(x, y) || !inside(x + 7*(int64_t) dx, y + 7*(int64_t) dy)) {
+            out[k++] = bilinear_sample(plane, stride, width, height, x, y, outside);
+            x += dx;
+            y += dy;
+            continue;
+        }
+        __m256i px = _mm256_add_epi32(_mm256_set1_epi32((int32_t) x), step_x);
+        __m256i py = _mm256_add_epi32(_mm256_set1_epi32((int32_t) y), step_y);
+        __m256i fx = _mm256_and_si256(_mm256_srai_epi32(px, bilinear_shift-8), byte);
+        __m256i fy = _mm256_and_si256(_mm256_srai_epi32(py, bilinear_shift-8), byte);
+        __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(py, bilinear_shift), row_stride),
+                                          _mm256_srai_epi32(px, bilinear_shift));
+        __m256i upper = _mm256_i32gather_epi32((const int*) plane, offset, 1);
+        __m256i lower = _mm256_i32gather_epi32((const int*) (plane + stride), offset, 1);
+        __m256i top = bilinear_horizontal(upper, fx), bottom = bilinear_horizontal(lower, fx);
+        __m256i blend = _mm256_mullo_epi32(_mm256_sub_epi32(bottom, top), fy);
+        __m256i value = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(top, 8), blend), rounding);
+        value = _mm256_srai_epi32(value, 16);
+        __m256i words = _mm256_packs_epi32(value, value);
+        __m256i bytes = _mm256_packus_epi16(words, words); // Pixels 0-3 in the lower lane, 4-7 in the upper one
+        __m128i pixels = _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+        _mm_storel_epi64((__m128i*) (out + k), pixels);
+        k += 8;
+        x += 8*(int64_t) dx;
+        y += 8*(int64_t) dy;
+    }
+}
+#endif
+
+// out[k] is the plane interpolated at (x + k*dx, y + k*dy), positions in bilinear_shift fixed point
+// The vector kernel gives exactly the same pixels as the scalar one, avx512 runs it as well
+void bilinear_row(const unsigned char *plane, size_t stride, int width, int height, int64_t x, int64_t y,
+                  int32_t dx, int32_t dy, unsigned char *out, size_t n, unsigned char outside) {
+    switch (active_level) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX512:
+        case SIMD_AVX2:
+            bilinear_row_avx2(plane, stride, width, height, x, y, dx, dy, out, n, outside);
+            break;
+#endif
+        default:
+            bilinear_row_scalar(plane, stride, width, height, x, y, dx, dy, out, n, outside);
+    }
+}
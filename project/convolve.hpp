@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Fixed-point weights of convolution kernels sum up to 1 << kernel_shift
+const int kernel_shift = 14;
+
+enum simd_level { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 }; // Instruction sets the kernels are available for
+
+simd_level detected_simd_level();
+simd_level current_simd_level();
+void set_simd_level(simd_level level); // Levels the cpu doesn't support fall back to the best supported one
+
+const int specialized_radius = 5; // Largest radius the kernels are specialized for at compile time
+bool specialized_kernels();
+void set_specialized_kernels(bool enabled); // Generic kernels only, for comparing them with the specialized ones
+
+// What the filters take for the pixels of a window that are outside the image: BORDER_IGNORE leaves them out (the
+// mean and gauss filters count them as black, the median as white), BORDER_REPLICATE repeats the pixel at the edge and
+// BORDER_REFLECT mirrors the image at its edge pixel
+enum border_policy { BORDER_IGNORE, BORDER_REPLICATE, BORDER_REFLECT };
+int border_index(int pos, int n, border_policy border);
+
+void weighted_sum(const unsigned char * const *src, const int16_t *weights, int taps, unsigned char *out, size_t n);
+void convolve_row(const unsigned char *in, unsigned char *out, size_t n, int step, const int16_t *kernel, int radius,
+                  border_policy border=BORDER_IGNORE);
+
+// Coordinates of bilinear_row are in fixed point with this many fraction bits
+const int bilinear_shift = 16;
+void bilinear_row(const unsigned char *plane, size_t stride, int width, int height, int64_t x, int64_t y,
+                  int32_t dx, int32_t dy, unsigned char *out, size_t n, unsigned char outside);
@@ -0,0 +1,158 @@
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "prettify.hpp"
+#include "convolve.hpp"
+#include "profile.hpp"
+
+using namespace std;
+
+const int ink_block = 8; // Columns whose ink skew_angle counts together, they move by the same number of rows
+const int shift_fraction = 256; // Steps a block moves by between two rows of the projection
+const double search_steps[] = {0.25, 0.05, 0.01}; // Degrees between the angles skew_angle tries, coarse to fine
+
+// Angle in degrees the lines of a page are skewed by, between -max_angle and max_angle: positive if they go down to
+// the right. Rotating the page by it makes them horizontal.
+// The page is binarized with Otsu's threshold, which separates the ink from the paper also on pages a threshold
+// routine has already made black and white. Every ink pixel is projected along the angle onto the left edge of the
+// page; along the angle of the lines, rows of text and the gaps between them fall into separate rows of the
+// projection, so the projection changes the most from one row to the next. A block that moves by a fraction of a row
+// is split between the two rows around it; with whole rows all angles that round to the same rows score the same, and
+// the angle would only be known to about a row over half the width of the page.
+// The angles are first tried 0.25 degrees apart, then around the best one 0.05 and 0.01 degrees apart, each step tries
+// its angles in parallel.
+// Pages without ink, or with nothing but ink, aren't skewed.
+double skew_angle(const image &img, int max_angle) {
+    if (img.empty()) {
+        return 0;
+    }
+    int thresh = auto_threshold(img, THRESHOLD_OTSU);
+    profile_step step("skew_angle");
+    int width = img.width, height = img.height, channels = img.channels;
+    int blocks = (width + ink_block - 1) / ink_block;
+    // Ink pixels of each block of columns in each row, the rows of a block next to each other
+    vector<uint8_t> ink((size_t) blocks * height);
+    long total = 0;
+    #pragma omp parallel for schedule(static) reduction(+:total)
+    for (int y=0; y < height; y++) {
+        const unsigned char *r = img.row(0, y), *g = img.row(channels == 3 ? 1 : 0, y), *b = img.row(channels == 3 ? 2 : 0, y);
+        for (int block=0; block < blocks; block++) {
+            int count = 0;
+            for (int x=block*ink_block; x < min(width, (block+1)*ink_block); x++) {
+                int intensity = channels == 1 ? r[x] : (r[x] + g[x] + b[x]) / 3;
+                count += intensity <= thresh;
+            }
+            ink[(size_t) block*height + y] = count;
+            total += count;
+        }
+    }
+    step.add_bytes_moved((double) width * height * channels);
+    if (total == 0 || total == (long) width * height) {
+        return 0;
+    }
+
+    // Rows a block moves by at most, the projection has room for them above and below the page
+    int margin = (int) ceil(tan(max_angle * M_PI / 180) * (width / 2.0 + ink_block)) + 2;
+    auto score = [&](double degrees, vector<int32_t> &projection) {
+        double slope = tan(degrees * M_PI / 180);
+        fill(projection.begin(), projection.end(), 0);
+        for (int block=0; block < blocks; block++) {
+            long shift = lround((block*ink_block + ink_block/2.0 - width/2.0) * slope * shift_fraction);
+            long whole = (long) floor((double) shift / shift_fraction);
+            int32_t part = shift - whole*shift_fraction;
+            int32_t *rows = projection.data() + margin - whole;
+            const uint8_t *column = ink.data() + (size_t) block*height;
+            for (int y=0; y < height; y++) {
+                rows[y] += column[y] * (shift_fraction - part);
+                rows[y-1] += column[y] * part;
+            }
+        }
+        int64_t sum = 0;
+        for (size_t i=1; i < projection.size(); i++) {
+            int64_t difference = projection[i] - projection[i-1];
+            sum += difference * difference;
+        }
+        return sum;
+    };
+
+    double best = 0, span = max_angle;
+    size_t tried = 0;
+    for (double search_step : search_steps) {
+        vector<double> angles;
+        int count = (int) lround(span / search_step);
+        for (int i=-count; i <= count; i++) {
+            double angle = best + i*search_step;
+            if (fabs(angle) <= max_angle + 1e-9) {
+                angles.push_back(angle);
+            }
+        }
+        tried += angles.size();
+        vector<int64_t> scores(angles.size());
+        #pragma omp parallel
+        {
+            vector<int32_t> projection(height + 2*margin);
+            #pragma omp for schedule(dynamic)
+            for (int i=0; i < (int) angles.size(); i++) {
+                scores[i] = score(angles[i], projection);
+            }
+        }
+        // Equal scores go to the smaller angle, so that the result doesn't depend on the order of the angles
+        size_t chosen = 0;
+        for (size_t i=1; i < angles.size(); i++) {
+            if (scores[i] > scores[chosen] || (scores[i] == scores[chosen] && fabs(angles[i]) < fabs(angles[chosen]))) {
+                chosen = i;
+            }
+        }
+        best = angles[chosen];
+        span = search_step; // The next step looks between the neighbours of the best angle
+    }
+    step.add_bytes_moved((double) ink.size() * tried);
+    return round(best * 100) / 100;
+}
+
+// Rotates the content of img counterclockwise by degrees around its center, the image keeps its size
+// Every output pixel is interpolated bilinearly from the input, corners that come from outside of it are white.
+// The output is produced in tiles of 32 rows of 512 pixels, in parallel, the input rows a tile reads stay in the cache
+// while it is produced. Within a row the position in the input moves by the same step from pixel to pixel, so the
+// rows of a tile go to the vector kernel of bilinear_row.
+void rotate(image &img, double degrees) {
+    if (img.empty()) {
+        return;
+    }
+    profile_step step("rotate");
+    int width = img.width, height = img.height, channels = img.channels;
+    double c = cos(degrees * M_PI / 180), s = sin(degrees * M_PI / 180);
+    double cx = (width - 1) / 2.0, cy = (height - 1) / 2.0;
+    const double one = 1 << bilinear_shift;
+    int32_t dx = (int32_t) lround(c * one), dy = (int32_t) lround(s * one);
+    const int tile_rows = 32, tile_columns = 512;
+    int tiles_across = (width + tile_columns - 1) / tile_columns, tiles_down = (height + tile_rows - 1) / tile_rows;
+    image result(width, height, channels);
+    #pragma omp parallel for schedule(static)
+    for (int t=0; t < tiles_across * tiles_down; t++) {
+        int first_row = t / tiles_across * tile_rows, first_column = t % tiles_across * tile_columns;
+        int columns = min(tile_columns, width - first_column);
+        for (int y=first_row; y < min(first_row + tile_rows, height); y++) {
+            // Positions are computed anew for every row of a tile, so the fixed point steps don't add up their errors
+            double ox = first_column - cx, oy = y - cy;
+            int64_t x = llround((cx + c*ox - s*oy) * one), y_in = llround((cy + s*ox + c*oy) * one);
+            for (int ch=0; ch < channels; ch++) {
+                bilinear_row(img.row(ch, 0), img.stride, width, height, x, y_in, dx, dy, result.row(ch, y) + first_column,
+                             columns, 255);
+            }
+        }
+    }
+    step.add_bytes_moved(2.0 * width * height * channels);
+    img = move(result);
+}
+
+// Geometric routine that rotates a skewed page so that its lines of text are horizontal
+// max_angle:  determines how many degrees the page may be skewed by in either direction, see skew_angle
+void deskew(image &img, int max_angle) {
+    double angle = skew_angle(img, max_angle);
+    if (angle != 0) {
+        rotate(img, angle);
+    }
+}
@@ -0,0 +1,111 @@
+#include <cstring>
+#include <algorithm>
+#include <omp.h>
+#include "image.hpp"
+#include "profile.hpp"
+
+using namespace std;
+
+const size_t row_alignment = 64; // Cache line size, buffers of the pool are aligned to it as well
+
+image::image(int width, int height, int channels) : width(width), height(height), channels(channels) {
+    stride = ((size_t) width + row_alignment - 1) / row_alignment * row_alignment;
+    samples.reset(default_pool().acquire(stride * height * channels));
+}
+
+// Deep copy of the image
+image image::clone() const {
+    image copy(width, height, channels);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) { // Every thread first touches the rows it will process
+        for (int c=0; c < channels; c++) {
+            memcpy(copy.row(c, i), row(c, i), stride);
+        }
+    }
+    return copy;
+}
+
+// Intensity of every pixel, the mean of its channels as used by the thresholds
+void image::luma_row(int y, unsigned char *out) const {
+    if (channels == 1) {
+        memcpy(out, row(0, y), width);
+        return;
+    }
+    const unsigned char *r = row(0, y);
+    const unsigned char *g = row(1, y);
+    const unsigned char *b = row(2, y);
+    for (int j=0; j < width; j++) {
+        out[j] = (r[j] + g[j] + b[j]) / 3;
+    }
+}
+
+// Interleaved rgb samples of a row, grayscale is spread over all three channels
+void image::rgb_row(int y, unsigned char *out) const {
+    const unsigned char *r = row(0, y);
+    const unsigned char *g = row(channels == 3 ? 1 : 0, y);
+    const unsigned char *b = row(channels == 3 ? 2 : 0, y);
+    for (int j=0; j < width; j++) {
+        out[j*3] = r[j];
+        out[j*3 + 1] = g[j];
+        out[j*3 + 2] = b[j];
+    }
+}
+
+// Grayscale version of the image, with the intensity of each pixel
+image image::luma() const {
+    profile_step step("luma");
+    step.add_bytes_moved((double) width * height * (channels + 1));
+    image gray(width, height, 1);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) {
+        luma_row(i, gray.row(0, i));
+    }
+    return gray;
+}
+
+// Rgb version of the image, a grayscale image is copied to all three planes
+image image::to_rgb() const {
+    if (channels == 3) {
+        return clone();
+    }
+    image rgb(width, height, 3);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) {
+        for (int c=0; c < 3; c++) {
+            memcpy(rgb.row(c, i), row(0, i), stride);
+        }
+    }
+    return rgb;
+}
+
+// Whether all three channels of interleaved rgb samples are equal everywhere
+bool image::rgb_is_gray(const unsigned char *rgb, size_t pixels) {
+    bool gray = true;
+    for (size_t p=0; p < pixels && gray; p += 4096) { // Stops early for color images
+        size_t block_end = min(p + 4096, pixels);
+        unsigned char differ = 0;
+        for (size_t q=p; q < block_end; q++) {
+            differ |= (rgb[q*3] ^ rgb[q*3 + 1]) | (rgb[q*3] ^ rgb[q*3 + 2]);
+        }
+        gray = differ == 0;
+    }
+    return gray;
+}
+
+// Splits interleaved rgb samples into planes
+// If all three channels are equal everywhere, which they are for scanned documents saved as ppm, only one plane is kept
+image image::from_rgb(const unsigned char *rgb, int width, int height) {
+    bool gray = rgb_is_gray(rgb, (size_t) width * height);
+    image img(width, height, gray ? 1 : 3);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) {
+        const unsigned char *samples = rgb + (size_t) i*width*3;
+        for (int c=0; c < img.channels; c++) {
+            unsigned char *out = img.row(c, i);
+            for (int j=0; j < width; j++) {
+                out[j] = samples[j*3 + c];
+            }
+        }
+    }
+    return img;
+}
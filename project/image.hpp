@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include "pool.hpp"
+using namespace std;
+
+// An image stored as one plane per channel: three planes for rgb, a single one for grayscale
+// Rows of all planes are stride bytes apart, and stride is padded so that every row starts at a 64 byte boundary
+// The image owns its samples and gives them back to the buffer pool when it goes out of scope, so images of the same
+// size reuse the same memory. It can be moved but only copied with clone()
+class image {
+public:
+    int width = 0;
+    int height = 0;
+    int channels = 0; // 1 or 3
+    size_t stride = 0;
+
+    image() {}
+    image(int width, int height, int channels);
+    image(image &&other) = default;
+    image& operator=(image &&other) = default;
+
+    bool empty() const {
+        return !samples;
+    }
+    unsigned char* row(int c, int y) {
+        return samples.get() + ((size_t) c*height + y) * stride;
+    }
+    const unsigned char* row(int c, int y) const {
+        return samples.get() + ((size_t) c*height + y) * stride;
+    }
+    image clone() const;
+    image luma() const;
+    image to_rgb() const;
+    void rgb_row(int y, unsigned char *out) const;
+    void luma_row(int y, unsigned char *out) const;
+    static image from_rgb(const unsigned char *rgb, int width, int height);
+    static bool rgb_is_gray(const unsigned char *rgb, size_t pixels);
+
+private:
+    struct pool_deleter {
+        void operator()(unsigned char *p) const {
+            default_pool().release(p);
+        }
+    };
+    unique_ptr<unsigned char[], pool_deleter> samples;
+};
@@ -1,14 +1,149 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include <csignal>
 #include <omp.h>
+#include <unistd.h>
 
 #include "prettify.hpp"
+#include "pipeline.hpp"
+#include "batch.hpp"
+#include "profile.hpp"
+#include "stream.hpp"
+#include "threading.hpp"
+#include "api.hpp"
+#include "server.hpp"
+#include "cache.hpp"
 
 using namespace std;
 
 inline void print_usage(char *program_name) {
-    cout << "Usage: " << program_name << " input_file output_file [routines]" << endl;
+    cout << "Usage: " << program_name << " [options] input_file output_file [routines]" << endl
+         << "       " << program_name << " [options] --batch input_dir|manifest output_dir [routines]" << endl
+         << "       " << program_name << " [options] --serve|--socket path" << endl;
+}
+
+// Settings given as --option arguments, independent of the routines
+struct options {
+    image_format format;
+    bool format_set = false; // Otherwise the format is chosen by the extension of output_file
+    bool gray = false; // Convert to grayscale before applying the routines
+    bool batch = false; // input_file and output_file are a directory or manifest and an output directory
+    string profile; // File to write a trace of the run to, empty if the run isn't profiled
+    size_t max_memory = 0; // Bytes an image may take before it's processed in strips, 0 for half the physical memory
+    int threads = 0; // 0 for OMP_NUM_THREADS or all cores
+    thread_binding binding = BIND_NONE;
+    bool binding_set = false; // Otherwise PRETTIFY_BIND is used, if it is set
+    omp_sched_t schedule = omp_sched_static;
+    int chunk = 0;
+    bool schedule_set = false; // Otherwise OMP_SCHEDULE is used, or a static schedule if it isn't set
+    bool serve = false; // Serve requests from stdin instead of processing input_file
+    string socket; // Unix socket to serve requests on instead of stdin, empty for stdin
+    bool explain = false; // Print the plan of the routines before running them
+    border_policy border = BORDER_IGNORE; // Of all filters and adaptive thresholds
+    int max_error = 0; // Levels the means and gausses may be off by when computed on a pyramid level, 0 for exact
+    string cache; // Directory of the stage cache, empty if results aren't cached
+    size_t cache_size = (size_t) 1 << 30; // Bytes the cached results may take together
+};
+
+// Removes all --option arguments (except --help) from argv and stores them in opts
+// Returns the new argc, or -1 if an option could not be understood
+int parse_options(int argc, char *argv[], options *opts) {
+    int new_argc = 1;
+    for (int i=1; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0) {
+            if (i+1 >= argc) {
+                cerr << "Error: --format needs one of " << format_p3_id << ", " << format_p5_id << ", "
+                     << format_p6_id << ", " << format_pam_id << ", " << format_pbm_id << ", " << format_png_id << ", "
+                     << format_tiff_id << "." << endl;
+                return -1;
+            }
+            i++;
+            if (!parse_format(argv[i], &opts->format)) {
+                cerr << "Error: Unknown output format " << argv[i] << "." << endl;
+                return -1;
+            }
+            opts->format_set = true;
+        } else if (strcmp(argv[i], "--gray") == 0) {
+            opts->gray = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            opts->batch = true;
+        } else if (strcmp(argv[i], "--max-memory") == 0) {
+            if (i+1 >= argc || atol(argv[i+1]) <= 0) {
+                cerr << "Error: --max-memory needs the number of megabytes an image may take." << endl;
+                return -1;
+            }
+            opts->max_memory = (size_t) atol(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "Error: --threads needs the number of threads to use." << endl;
+                return -1;
+            }
+            opts->threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bind") == 0) {
+            if (i+1 >= argc || !parse_binding(argv[i+1], &opts->binding)) {
+                cerr << "Error: --bind needs one of " << bind_none_id << ", " << bind_close_id << ", "
+                     << bind_spread_id << "." << endl;
+                return -1;
+            }
+            i++;
+            opts->binding_set = true;
+        } else if (strcmp(argv[i], "--schedule") == 0) {
+            if (i+1 >= argc || !parse_schedule(argv[i+1], &opts->schedule, &opts->chunk)) {
+                cerr << "Error: --schedule needs static, dynamic or guided, optionally followed by ,chunk." << endl;
+                return -1;
+            }
+            i++;
+            opts->schedule_set = true;
+        } else if (strcmp(argv[i], "--border") == 0) {
+            if (i+1 >= argc || !parse_border(argv[i+1], &opts->border)) {
+                cerr << "Error: --border needs one of " << border_ignore_id << ", " << border_replicate_id << ", "
+                     << border_reflect_id << "." << endl;
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--approximate") == 0) {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "Error: --approximate needs the number of intensity levels the result may be off by." << endl;
+                return -1;
+            }
+            opts->max_error = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i+1 >= argc) {
+                cerr << "Error: --cache needs the directory to keep the cached results in." << endl;
+                return -1;
+            }
+            opts->cache = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0) {
+            if (i+1 >= argc || atol(argv[i+1]) <= 0) {
+                cerr << "Error: --cache-size needs the number of megabytes the cached results may take." << endl;
+                return -1;
+            }
+            opts->cache_size = (size_t) atol(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--explain") == 0) {
+            opts->explain = true;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            opts->serve = true;
+        } else if (strcmp(argv[i], "--socket") == 0) {
+            if (i+1 >= argc) {
+                cerr << "Error: --socket needs the path of the socket to listen on." << endl;
+                return -1;
+            }
+            opts->socket = argv[++i];
+            opts->serve = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            if (i+1 >= argc) {
+                cerr << "Error: --profile needs the file to write the trace to." << endl;
+                return -1;
+            }
+            opts->profile = argv[++i];
+        } else {
+            argv[new_argc++] = argv[i];
+        }
+    }
+    return new_argc;
 }
 
 // Handles the printing of help messages, returns 1 if the program should exit
@@ -16,14 +151,57 @@ int handle_help(int argc, char *argv[]) {
     if (argc == 2 && (strcmp(argv[1], "--help")==0 || strcmp(argv[1], "-h")==0)) {
         cout << "prettify: Simple command-line based scanned document enhancer" << endl;
         print_usage(argv[0]);
-        cout << " input_file and output_file need to be P3 (ASCII-encoded) portable pix map (.ppm) files without comments." << endl;
+        cout << " input_file may be a P3 (ASCII-encoded) portable pix map (.ppm) file," << endl
+             << " or a binary P6 .ppm, P5 .pgm or P7 .pam file." << endl;
+        cout << " output_file is written as P5 if it ends in .pgm, as P7 if it ends in .pam, as P4 if it ends in .pbm, as png" << endl
+             << " if it ends in .png, as CCITT group 4 tiff if it ends in .tif or .tiff and as P3 otherwise." << endl;
+        cout << " Options:" << endl
+             << "   --format " << format_p3_id << "|" << format_p5_id << "|" << format_p6_id << "|" << format_pam_id << "|"
+             << format_pbm_id << "|" << format_png_id << "|" << format_tiff_id << endl
+             << "            Overrides the format of output_file (p5 stores the grayscale intensity; pbm and tiff one bit" << endl
+             << "            per pixel, black below an intensity of " << bilevel_threshold << ", for binarized pages)" << endl
+             << "   --gray   Converts the image to grayscale before the routines, which then only have to process one channel." << endl
+             << "            Implied by p5, pbm and tiff output. Grayscale input is always processed as one channel." << endl
+             << "   --batch  Processes many pages with the same routines: input_dir is a directory whose .ppm, .pgm and .pam files" << endl
+             << "            are processed, or a manifest file with one input file per line (optionally followed by its output file)." << endl
+             << "            Results go to output_dir under the name of their input, small pages are processed in parallel." << endl
+             << "   --max-memory MB  Images that would take more memory are read, processed and written in strips of rows" << endl
+             << "            that fit into MB megabytes, for scans that are larger than the memory. Defaults to half the" << endl
+             << "            physical memory. With --serve or --socket, requests may carry files up to MB megabytes." << endl
+             << "   --threads N  Uses N threads instead of OMP_NUM_THREADS or all cores." << endl
+             << "   --bind " << bind_none_id << "|" << bind_close_id << "|" << bind_spread_id
+             << "  Pins every thread to a core: close fills one socket before the next, spread uses all" << endl
+             << "            sockets and their memory. Defaults to PRETTIFY_BIND, or none (OMP_PROC_BIND and OMP_PLACES still apply)." << endl
+             << "   --schedule static|dynamic|guided[,chunk]  How bands of rows are handed to the threads. Defaults to" << endl
+             << "            OMP_SCHEDULE, or static, which keeps every row on the NUMA node of the thread that read it." << endl
+             << "   --border " << border_ignore_id << "|" << border_replicate_id << "|" << border_reflect_id
+             << "  What the filters and adaptive thresholds take for pixels outside the image:" << endl
+             << "            ignore leaves them out, which darkens the edges of mean and gauss filters with large radii," << endl
+             << "            replicate repeats the edge pixels and reflect mirrors the image at them. Defaults to ignore." << endl
+             << "   --approximate levels  Computes mean and gauss filters and adaptive thresholds with large radii on a" << endl
+             << "            downsampled image, as long as no pixel can be off by more than levels intensity levels" << endl
+             << "            (away from the edges, which are approximated more roughly). Much faster for gauss radii of 30 and more." << endl
+             << "   --cache dir  Keeps the image before the last routine and the result in dir, keyed by the contents of" << endl
+             << "            input_file and the routines. Running the same page again with only the last routine changed starts" << endl
+             << "            from there. The last routine gets a pass over the image of its own then." << endl
+             << "   --cache-size MB  Removes the least recently used results once the cache takes more. Defaults to 1024." << endl
+             << "   --explain  Prints how the routines are run: merged and dropped thresholds, the sweeps over the image" << endl
+             << "            and their stages." << endl
+             << "   --serve  Keeps running and processes the images sent on stdin, see server.hpp for the framing." << endl
+             << "   --socket path  Like --serve, but listens for connections on a unix socket at path." << endl
+             << "   --profile trace.json  Records the time, allocations and bandwidth of reading, writing and every routine," << endl
+             << "            writes them to trace.json (for chrome://tracing or ui.perfetto.dev) and prints a summary." << endl;
         cout << " The specified [routines] will operate on the image and may be any (even multiple) of the following, in any order: " << endl;
         cout << "   " << mean_filter_id << " [radius]" << endl 
              << "   " << gauss_filter_id << " [radius]" << endl 
              << "   " << median_filter_id << " [radius]" << endl
              << "   " << threshold_id << " [threshold]" << endl
+             << "   " << threshold_auto_id << " [" << otsu_id << "|" << triangle_id << "]" << endl
              << "   " << threshold_adaptive_mean_id << " [radius [C]]" << endl
-             << "   " << threshold_adaptive_gauss_id << " [radius [C]]" << endl;
+             << "   " << threshold_adaptive_gauss_id << " [radius [C]]" << endl
+             << "   " << threshold_sauvola_id << " [radius [k]]" << endl
+             << "   " << threshold_bradley_id << " [radius [t]]" << endl
+             << "   " << deskew_id << " [max_angle]" << endl;
         cout << "Try \"" << argv[0] << " -h routine\" for information on a specific routine" << endl; 
         return 1;
     }
@@ -48,6 +226,12 @@ int handle_help(int argc, char *argv[]) {
                  << "Used to remove image background, especially shadows. Only works when background is cleanly separable by its brightness." << endl
                  << "Usage: " << argv[0] << " input_file output_file " << threshold_id << " [threshold]" << endl
                  << "  thresh:  Determines the threshold." << endl;
+        } else if (threshold_auto_id.compare(argv[2]) == 0) {
+            cout << "Nonlinear filter that makes a pixel white if it isn't darker than a threshold chosen from the histogram of the image." << endl
+                 << "Used like " << threshold_id << " on pages whose brightness differs, costs little more than it." << endl
+                 << "Usage: " << argv[0] << " input_file output_file " << threshold_auto_id << " [" << otsu_id << "|" << triangle_id << "]" << endl
+                 << "  " << otsu_id << ":      Separates the histogram into two classes that are as distinct as possible (default)." << endl
+                 << "  " << triangle_id << ":  Cuts where the histogram falls off from its peak, for pages with little text." << endl;
         } else if (threshold_adaptive_mean_id.compare(argv[2]) == 0) {
             cout << "Nonlinear filter that makes a pixel white if its not significantly darker than the mean of its surrounding pixels." << endl
                  << "Used to remove image background, especially shadows. Only works with pure text document images." << endl
@@ -60,14 +244,39 @@ int handle_help(int argc, char *argv[]) {
                  << "Usage: " << argv[0] << " input_file output_file " << threshold_adaptive_gauss_id << " [radius [C]]" << endl
                  << "  radius:  Determines the size of the surrounding square in which the weighted mean is calculated." << endl
                  << "  C:       Determines how much darker than the mean a pixel has to be." << endl;
+        } else if (threshold_sauvola_id.compare(argv[2]) == 0) {
+            cout << "Nonlinear filter that makes a pixel white unless it is darker than mean * (1 + k * (deviation / 128 - 1))," << endl
+                 << "computed from the mean and standard deviation of its surrounding pixels." << endl
+                 << "Used to remove image background on unevenly lit scans, keeps faint text where the contrast is low." << endl
+                 << "Takes the same time for any radius." << endl
+                 << "Usage: " << argv[0] << " input_file output_file " << threshold_sauvola_id << " [radius [k]]" << endl
+                 << "  radius:  Determines the size of the surrounding square, should be about the height of a line of text (default 15)." << endl
+                 << "  k:       In percent, determines how far the threshold is below the mean in areas of low contrast (default " << sauvola_default_k << ")." << endl;
+        } else if (threshold_bradley_id.compare(argv[2]) == 0) {
+            cout << "Nonlinear filter that makes a pixel white unless it is more than t percent darker than the mean of its surrounding pixels." << endl
+                 << "Used to remove image background, especially shadows. Takes the same time for any radius." << endl
+                 << "Usage: " << argv[0] << " input_file output_file " << threshold_bradley_id << " [radius [t]]" << endl
+                 << "  radius:  Determines the size of the surrounding square in which the mean is calculated (default 15)." << endl
+                 << "  t:       In percent, determines how much darker than the mean a pixel has to be (default " << bradley_default_t << ")." << endl;
+        } else if (deskew_id.compare(argv[2]) == 0) {
+            cout << "Geometric routine that finds the angle the lines of text are skewed by and rotates the image back by it." << endl
+                 << "Used on pages that were scanned askew, the corners that come from outside of the page are white." << endl
+                 << "Finds the angle on the ink the image has where it is in the chain, so it works best after a threshold." << endl
+                 << "Needs the whole image, so it can't be applied to images that are processed in strips." << endl
+                 << "Usage: " << argv[0] << " input_file output_file " << deskew_id << " [max_angle]" << endl
+                 << "  max_angle:  Determines how many degrees the page may be skewed by in either direction, from 1 to 45 (default " << deskew_default_angle << ")." << endl;
         } else {
             cout << "Either use -h or --help without further arguments or specify exactly one of the routines: " << endl;
             cout << "   " << mean_filter_id << endl 
              << "   " << gauss_filter_id << endl 
              << "   " << median_filter_id << endl
              << "   " << threshold_id << endl
+             << "   " << threshold_auto_id << endl
              << "   " << threshold_adaptive_mean_id << endl
-             << "   " << threshold_adaptive_gauss_id << endl;
+             << "   " << threshold_adaptive_gauss_id << endl
+             << "   " << threshold_sauvola_id << endl
+             << "   " << threshold_bradley_id << endl
+             << "   " << deskew_id << endl;
         }
         return 1;
     }
@@ -79,95 +288,229 @@ int handle_help(int argc, char *argv[]) {
     return 0;
 }
 
+// Parses the routines following input_file and output_file, returns false if an argument could not be understood
+bool parse_routines(int argc, char *argv[], const options &opts, vector<routine> *routines) {
+    string error;
+    if (!parse_routine_arguments(vector<string>(argv + min(argc, 3), argv + argc), routines, &error)) {
+        cout << error << endl;
+        print_usage(argv[0]);
+        return false;
+    }
+    for (routine &r : *routines) {
+        r.border = opts.border;
+        r.max_error = opts.max_error;
+        cout << "Applying " << routine_description(r) << endl;
+    }
+    return true;
+}
+
+// Processes all pages of a directory or manifest with the same routines and reports the throughput
+int run_batch_mode(char source[], char output_dir[], int argc, char *argv[], const options &opts) {
+    batch_options batch_opts;
+    batch_opts.format = opts.format;
+    batch_opts.format_set = opts.format_set;
+    batch_opts.gray = opts.gray;
+    vector<batch_page> pages;
+    vector<routine> routines;
+    if (!parse_routines(argc, argv, opts, &routines)) {
+        return 0;
+    }
+    if (!list_batch_pages(source, output_dir, batch_opts, &pages)) {
+        return 1;
+    }
+    batch_report report = run_batch(pages, routines, batch_opts);
+    cout << "Processed " << report.pages - report.failed << " of " << report.pages << " pages in " << report.seconds
+         << " seconds with " << report.workers << " pages at once and " << report.threads_per_page << " threads per page" << endl;
+    if (report.seconds > 0) {
+        cout << report.pages / report.seconds << " pages per second, "
+             << report.pixels / report.seconds / 1e6 << " MPixel per second" << endl;
+    }
+    return report.failed == 0 ? 0 : 1;
+}
+
+// Writes the trace and prints the summary if the run was profiled, returns false if the trace could not be written
+bool finish_profile(const options &opts) {
+    if (opts.profile.empty()) {
+        return true;
+    }
+    print_profile_summary(cout);
+    if (!write_trace(opts.profile)) {
+        return false;
+    }
+    cout << "Wrote trace to " << opts.profile << endl;
+    return true;
+}
+
+// Processes an image that doesn't fit into the memory limit in strips
+int run_stream_mode(char in_filename[], char out_filename[], int argc, char *argv[], const options &opts,
+                    const raster_reader &probe, int channels) {
+    vector<routine> routines;
+    if (!parse_routines(argc, argv, opts, &routines)) {
+        return 0;
+    }
+    if (opts.explain) {
+        explain_plan(routines, probe.width, probe.height, channels, cout);
+    }
+    cout << "Streaming " << in_filename << " to " << out_filename << endl;
+    auto start = omp_get_wtime();
+    int strip_rows;
+    if (!stream_image(in_filename, out_filename, routines, opts.format, opts.gray, opts.max_memory, &strip_rows)) {
+        return 1;
+    }
+    cout << "Took " << omp_get_wtime() - start << " seconds in strips of " << strip_rows << " rows" << endl;
+    return finish_profile(opts) ? 0 : 1;
+}
+
+// Processes an image that fits into memory while it is read and written, channels is known before it is decoded
+int run_overlap_mode(char in_filename[], char out_filename[], int argc, char *argv[], const options &opts,
+                     const raster_reader &probe, int channels) {
+    vector<routine> routines;
+    if (!parse_routines(argc, argv, opts, &routines)) {
+        return 0;
+    }
+    if (opts.explain) {
+        explain_plan(routines, probe.width, probe.height, channels, cout);
+    }
+    cout << "Reading image " << in_filename << " with width " << probe.width << " and height " << probe.height
+         << " while processing it and writing " << out_filename << endl;
+    auto start = omp_get_wtime();
+    if (!overlap_image(in_filename, out_filename, routines, opts.format, channels)) {
+        return 1;
+    }
+    cout << "Took " << omp_get_wtime() - start << " seconds, with reading and writing" << endl;
+    return finish_profile(opts) ? 0 : 1;
+}
+
+// Sets up the threads before any image is read. OpenMP reads OMP_NUM_THREADS, OMP_PROC_BIND, OMP_PLACES and
+// OMP_SCHEDULE itself, the options override them.
+bool apply_threading(options &opts) {
+    if (opts.threads > 0) {
+        omp_set_num_threads(opts.threads);
+    }
+    if (opts.schedule_set) {
+        omp_set_schedule(opts.schedule, opts.chunk);
+    } else if (getenv("OMP_SCHEDULE") == nullptr) {
+        omp_set_schedule(omp_sched_static, 0);
+    }
+    const char *bind = getenv("PRETTIFY_BIND");
+    if (!opts.binding_set && bind != nullptr && !parse_binding(bind, &opts.binding)) {
+        cerr << "Error: PRETTIFY_BIND has to be one of " << bind_none_id << ", " << bind_close_id << ", "
+             << bind_spread_id << "." << endl;
+        return false;
+    }
+    if (opts.binding != BIND_NONE) {
+        set_thread_binding(opts.binding);
+        bind_threads();
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     char *in_filename;
     char *out_filename;
 
+    options opts;
+    argc = parse_options(argc, argv, &opts);
+    if (argc < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (opts.max_memory == 0) {
+        opts.max_memory = (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+    }
+    if (opts.serve) { // Neither input_file nor output_file, the images come with the requests
+        if (!apply_threading(opts)) {
+            return 1;
+        }
+        set_verbose(false); // Stdout may carry the responses
+        size_t max_request = min(opts.max_memory, serve_max_request);
+        if (opts.socket.empty()) {
+            signal(SIGPIPE, SIG_IGN); // A client that stops reading stdout makes serve_connection fail instead
+            return serve_connection(0, 1, max_request) ? 0 : 1;
+        }
+        return serve_socket(opts.socket.c_str(), max_request) ? 0 : 1;
+    }
     if (handle_help(argc, argv)) {
         return 0;
     }
     
     in_filename = argv[1];
     out_filename = argv[2];
+    if (!apply_threading(opts)) {
+        return 1;
+    }
+    if (!opts.profile.empty()) {
+        set_profiling(true);
+    }
+    if (opts.batch) {
+        int status = run_batch_mode(in_filename, out_filename, argc, argv, opts);
+        return finish_profile(opts) ? status : 1;
+    }
+    if (!opts.format_set) {
+        opts.format = format_from_filename(out_filename);
+    }
+    raster_reader probe;
+    if (!probe.open(in_filename)) {
+        return 1;
+    }
+    int channels = opts.gray || gray_format(opts.format) ? 1 : probe.channels;
+    if (image_memory(probe.width, probe.height, channels) > opts.max_memory) {
+        return run_stream_mode(in_filename, out_filename, argc, argv, opts, probe, channels);
+    }
+    int planes = opts.gray || gray_format(opts.format) ? 1 : probe.image_planes();
+    // The planes of a color P3 file are only known once it is decoded, and a single core has nothing to overlap
+    if (opts.cache.empty() && planes > 0 && omp_get_num_procs() > 1) {
+        return run_overlap_mode(in_filename, out_filename, argc, argv, opts, probe, planes);
+    }
 
 
-    unsigned char *img;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    if (img == nullptr) {
-        cerr << "Error: could not read " << in_filename << endl;
-        return 1;
+    vector<routine> routines;
+    if (!parse_routines(argc, argv, opts, &routines)) {
+        return 0;
+    }
+    bool gray = opts.gray || gray_format(opts.format);
+    unique_ptr<stage_cache> cache;
+    uint64_t input_hash;
+    if (!opts.cache.empty() && !routines.empty() && hash_file(in_filename, &input_hash)) {
+        cache.reset(new stage_cache(opts.cache, opts.cache_size, input_hash, gray));
+    }
+    image img;
+    int done = cache ? cache->load(routines, &img) : -1; // Routines whose result was cached, -1 for none
+    if (done >= 0) {
+        cout << "Resuming from the cached result of " << done << " of " << routines.size() << " routines" << endl;
+    } else {
+        img = read_image(in_filename);
+        if (img.empty()) {
+            cerr << "Error: could not read " << in_filename << endl;
+            return 1;
+        }
     }
     auto start = omp_get_wtime();
-    for (int i=3; i < argc; i++) {
-        if (mean_filter_id.compare(argv[i]) == 0) {
-            int radius = 1;
-            if (i+1 < argc && atoi(argv[i+1])) { // If the next argument is an integer, it's for this routine
-                radius = atoi(argv[i+1]);
-                i++; // Next argument was the radius -> skip next iteration
-            }
-            cout << "Applying mean filter with radius " << radius << endl;
-            img = mean_filter(img, width, height, radius);
-        } else if (gauss_filter_id.compare(argv[i]) == 0) {
-            int radius = 1;
-            if (i+1 < argc && atoi(argv[i+1])) {
-                radius = atoi(argv[i+1]);
-                i++;
-            }
-            cout << "Applying gauss filter with radius " << radius << endl;
-            img = gauss_filter(img, width, height, radius);
-        } else if (median_filter_id.compare(argv[i]) == 0) {
-            int radius = 1;
-            if (i+1 < argc && atoi(argv[i+1])) {
-                radius = atoi(argv[i+1]);
-                i++;
-            }
-            cout << "Applying median filter with radius " << radius << endl;
-            img = median_filter(img, width, height, radius);
-        } else if (threshold_id.compare(argv[i]) == 0){
-            int thresh = 100;
-            if (i+1 < argc && atoi(argv[i+1])) {
-                thresh = atoi(argv[i+1]);
-                i++;
-            }
-            cout << "Applying global threshold with threshold " << thresh << endl;
-            img = threshold(img, width, height, thresh);
-        } else if (threshold_adaptive_mean_id.compare(argv[i]) == 0) {
-            int radius = 5;
-            int C = 10;
-            if (i+1 < argc && atoi(argv[i+1])) {
-                radius = atoi(argv[i+1]);
-                i++;
-                if (i+1 < argc && atoi(argv[i+1])) {
-                    C = atoi(argv[i+1]);
-                    i++;
-                }
-            }
-            cout << "Applying adaptive mean threshold with radius " << radius << " and C " << C << endl;
-            img = threshold_adaptive_mean(img, width, height, radius, C);
-        } else if (threshold_adaptive_gauss_id.compare(argv[i]) == 0) {
-            int radius = 5;
-            int C = 10;
-            if (i+1 < argc && atoi(argv[i+1])) {
-                radius = atoi(argv[i+1]);
-                i++;
-                if (i+1 < argc && atoi(argv[i+1])) {
-                    C = atoi(argv[i+1]);
-                    i++;
-                }
-            }
-            cout << "Applying adaptive gauss threshold with radius " << radius << " and C " << C << endl;
-            img = threshold_adaptive_gauss(img, width, height, radius, C);
-        } else {
-            cout << "Could not understand the following argument: " << argv[i] << endl;
-            print_usage(argv[0]);
-            delete[] img;
-            return 0;
+    if (gray && img.channels > 1) { // Only the intensity is kept anyway
+        cout << "Converting to grayscale" << endl;
+        img = img.luma();
+    }
+    vector<routine> remaining(routines.begin() + max(done, 0), routines.end());
+    if (opts.explain) {
+        explain_plan(remaining, img.width, img.height, img.channels, cout);
+    }
+    if (cache) { // The image before the last routine is kept, a later run may only change that one
+        int last = routines.size() - 1;
+        if (done < last) {
+            run_pipeline(img, vector<routine>(routines.begin() + max(done, 0), routines.end() - 1));
+        }
+        if (done < last || done < 0) {
+            cache->store(routines, last, img);
         }
+        if (done <= last) {
+            run_pipeline(img, vector<routine>(routines.end() - 1, routines.end()));
+            cache->store(routines, last + 1, img);
+        }
+    } else {
+        run_pipeline(img, routines); // All routines are applied in one pass over the image
     }
     auto end = omp_get_wtime();
     cout << "Took " << end-start << " seconds" << endl;
-    write_image(out_filename, img, width, height);
-    delete[] img;
-    return 0;
+    write_image(out_filename, img, opts.format);
+    return finish_profile(opts) ? 0 : 1;
 }
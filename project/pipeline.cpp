@@ -0,0 +1,275 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <omp.h>
+#include "prettify.hpp"
+#include "pipeline.hpp"
+#include "profile.hpp"
+#include "threading.hpp"
+
+using namespace std;
+
+// Applies a chain of routines in one pass over the image: the image is split into horizontal bands, one per thread,
+// and every row of a band is pushed through all routines before the band moves on. Between two routines only the
+// rows the next one still needs are kept, in a ring per thread, so no intermediate image is ever allocated.
+// Bands overlap by the halos of the routines, those rows are computed by both neighbouring bands.
+// Routines with invalid parameters are skipped, as if they had been applied on their own.
+// The result replaces img
+void run_pipeline(image &img, const vector<routine> &routines) {
+    if (img.empty()) {
+        return;
+    }
+    int width = img.width, height = img.height, channels = img.channels;
+    vector<routine> chain;
+    for (const routine &r : routines) {
+        if (valid_routine(r, width, height)) {
+            chain.push_back(r);
+        }
+    }
+    chain = plan_routines(chain);
+    if (chain.empty()) {
+        return;
+    }
+    // A threshold chosen from the histogram needs all of its input, so the chain is split in front of it. The histogram
+    // is built from the result of the routines before it, and the pixels are compared in the sweep of the others.
+    // A deskew needs all of its input as well, it rotates the result of the routines before it as a whole.
+    for (size_t k=1; k < chain.size(); k++) {
+        if (chain[k].kind == ROUTINE_THRESHOLD_AUTO || chain[k].kind == ROUTINE_DESKEW) {
+            run_pipeline(img, vector<routine>(chain.begin(), chain.begin()+k));
+            run_pipeline(img, vector<routine>(chain.begin()+k, chain.end()));
+            return;
+        }
+    }
+    if (chain[0].kind == ROUTINE_DESKEW) {
+        deskew(img, chain[0].angle);
+        run_pipeline(img, vector<routine>(chain.begin()+1, chain.end()));
+        return;
+    }
+    if (chain[0].kind == ROUTINE_THRESHOLD_AUTO) {
+        chain[0].thresh = auto_threshold(img, chain[0].method);
+    }
+    profile_step step("pipeline");
+    image result(width, height, channels);
+    run_bands(row_buffer(img), row_buffer(result), chain, width, height, channels, 0, height-1, step);
+    img = move(result);
+}
+
+// Rewrites a chain of valid routines into one that gives exactly the same image with fewer stages. Global thresholds
+// only whiten pixels above them and leave the others as they are, which allows:
+// - thresholds above 254 to be dropped, no intensity is above them
+// - everything before a negative threshold to be dropped, it whitens every pixel whatever came before
+// - two thresholds in a row to be merged into the lower one
+// - a threshold after any other routine but a deskew to be applied to that routine's output rows in its own stage
+//   (fused_thresh)
+// Consecutive mean or gauss filters are not merged: every pass rounds to 8 bits and handles the borders on its own,
+// so the product of their kernels wouldn't give the same image.
+// Every rewrite is described in notes, if given
+vector<routine> plan_routines(const vector<routine> &chain, vector<string> *notes) {
+    vector<routine> plan;
+    auto note = [&](const string &text) {
+        if (notes != nullptr) {
+            notes->push_back(text);
+        }
+    };
+    for (const routine &r : chain) {
+        if (r.kind != ROUTINE_THRESHOLD) {
+            plan.push_back(r);
+            continue;
+        }
+        string name = routine_name(r);
+        if (r.thresh >= 255) {
+            note(name + " is dropped: no intensity is above " + to_string(r.thresh));
+        } else if (r.thresh < 0) {
+            for (const routine &cancelled : plan) {
+                note(routine_name(cancelled) + " is dropped: " + name + " whitens every pixel after it");
+            }
+            plan = {r};
+        } else if (plan.empty() || plan.back().kind == ROUTINE_DESKEW) { // A deskew isn't a stage it could be fused into
+            plan.push_back(r);
+        } else if (plan.back().kind == ROUTINE_THRESHOLD) {
+            note(routine_name(plan.back()) + " and " + name + " are merged into " + threshold_id + " "
+                 + to_string(min(plan.back().thresh, r.thresh)));
+            plan.back().thresh = min(plan.back().thresh, r.thresh);
+        } else if (plan.back().fused_thresh >= 0) {
+            note(name + " is merged into the threshold fused into " + routine_name(plan.back()));
+            plan.back().fused_thresh = min(plan.back().fused_thresh, r.thresh);
+        } else {
+            note(name + " is applied to the output rows of " + routine_name(plan.back()) + " in the same stage");
+            plan.back().fused_thresh = r.thresh;
+        }
+    }
+    return plan;
+}
+
+// Prints the plan run_pipeline would execute for the routines on an image of the given size: the sweeps over the
+// image with their stages, and the rewrites that led to them
+void explain_plan(const vector<routine> &routines, int width, int height, int channels, ostream &out) {
+    vector<routine> chain;
+    for (const routine &r : routines) {
+        if (valid_routine(r, width, height)) {
+            chain.push_back(r);
+        }
+    }
+    vector<string> notes;
+    chain = plan_routines(chain, &notes);
+    out << "Plan for " << width << "x" << height << " with " << channels << (channels == 1 ? " channel" : " channels")
+        << ":" << endl;
+    if (chain.empty()) {
+        out << "  nothing to do, the image is written as it is" << endl;
+    }
+    int sweep = 0;
+    string input = "image"; // What the next sweep, histogram or deskew works on
+    for (size_t k=0; k < chain.size(); k++) {
+        if (chain[k].kind == ROUTINE_DESKEW) {
+            out << "  " << routine_name(chain[k]) << ": the " << input << " is rotated by its skew, searched within "
+                << chain[k].angle << " degrees" << endl;
+            input = "deskewed " + input;
+            continue;
+        }
+        if (k == 0 || chain[k].kind == ROUTINE_THRESHOLD_AUTO || chain[k-1].kind == ROUTINE_DESKEW) {
+            if (chain[k].kind == ROUTINE_THRESHOLD_AUTO) {
+                out << "  histogram of the " << input << " for " << routine_name(chain[k]) << endl;
+            }
+            out << "  sweep " << ++sweep << ":" << endl;
+            input = "result of sweep " + to_string(sweep);
+        }
+        out << "    " << routine_name(chain[k]) << " (halo " << routine_halo(chain[k]) << " rows, about "
+            << (routine_memory(chain[k], width, channels) + 1023) / 1024 << " KB per thread)" << endl;
+        int factor = pyramid_factor(chain[k]);
+        if (factor > 1) {
+            out << "      on a 1/" << factor << " pyramid level, off by at most "
+                << (int) pyramid_error(chain[k], factor) << " levels away from the edges" << endl;
+        } else if (chain[k].max_error > 0 && (chain[k].kind == ROUTINE_MEAN_FILTER || chain[k].kind == ROUTINE_GAUSS_FILTER
+                   || chain[k].kind == ROUTINE_THRESHOLD_ADAPTIVE_MEAN || chain[k].kind == ROUTINE_THRESHOLD_ADAPTIVE_GAUSS)) {
+            out << "      exact, no pyramid level stays within " << chain[k].max_error << " levels" << endl;
+        }
+    }
+    if (!notes.empty()) {
+        out << "  rewrites:" << endl;
+    }
+    for (const string &text : notes) {
+        out << "    " << text << endl;
+    }
+}
+
+// Produces the rows first_row to last_row of destination by applying a chain of valid routines to the rows of source,
+// which has to hold all rows these depend on, the halos of all routines around them. The rows are split into bands,
+// one per thread, the stages start over at the start of each band.
+void run_bands(const row_buffer &source, const row_buffer &destination, const vector<routine> &chain,
+               int width, int height, int channels, int first_row, int last_row, profile_step &step) {
+    int count = chain.size();
+    vector<int> halo(count);
+    vector<int> later_halo(count+1, 0); // Rows beyond a band that stage k has to produce for the stages after it
+    for (int k=count-1; k >= 0; k--) {
+        halo[k] = routine_halo(chain[k]);
+        later_halo[k] = later_halo[k+1] + halo[k];
+    }
+    later_halo.erase(later_halo.begin());
+    bool profile = profiling();
+    int rows = last_row - first_row + 1;
+
+    // Bands get shorter with more threads, but they shouldn't be much shorter than the rows they recompute. With one
+    // band per thread and a static schedule (prettify's default, see apply_threading in main), thread t gets the rows
+    // it read the image into. For a freshly allocated image those rows are on its NUMA node; a buffer recycled by the
+    // pool keeps its pages on the node of whichever thread first touched them.
+    int bands = max(1, min(omp_get_max_threads(), rows / max(16, 4*later_halo[0])));
+    // While profiling, every band records the time and rows of each stage and the time it took on its thread
+    vector<double> stage_seconds(profile ? bands*count : 0);
+    vector<long> stage_rows(profile ? bands*count : 0);
+    vector<double> band_seconds(profile ? bands : 0);
+    vector<int> band_thread(profile ? bands : 0);
+    vector<hardware_counters> band_counters(profile ? bands : 0);
+    int team = 1;
+    int caller = profile ? profile_thread() : 0;
+    double region_start = profile ? profile_time() : 0;
+    #pragma omp parallel for schedule(runtime)
+    for (int b=0; b < bands; b++) {
+        pin_thread();
+        double band_start = 0;
+        hardware_counters band_start_counters;
+        if (profile) {
+            #pragma omp atomic write
+            team = omp_get_num_threads();
+            band_start = profile_time();
+            band_start_counters = read_hardware_counters();
+        }
+        int first = first_row + (int) ((long) rows * b / bands);
+        int last = first_row + (int) ((long) rows * (b+1) / bands) - 1;
+        vector<unique_ptr<stage>> stages;
+        vector<image> rings(count); // Input rows of stage k, produced by stage k-1
+        vector<row_buffer> inputs = {source};
+        for (int k=0; k < count; k++) {
+            stages.push_back(make_stage(chain[k], width, height, channels));
+            if (k > 0) { // Stage k needs its halo on both sides and the row above that
+                int capacity = 2*halo[k] + 2;
+                rings[k] = image(width, capacity, channels);
+                inputs.emplace_back(rings[k].row(0, 0), rings[k].stride, height, capacity);
+            }
+        }
+        inputs.push_back(destination);
+        vector<int> next(count); // Next row each stage produces
+        for (int k=0; k < count; k++) {
+            next[k] = max(0, first - later_halo[k]);
+        }
+        // Produces the rows of stage k up to until, pulling the rows it needs from the stages before it
+        auto produce = [&](auto &self, int k, int until) -> void {
+            for (; next[k] <= until; next[k]++) {
+                int row = next[k];
+                if (k > 0) {
+                    self(self, k-1, min(row + halo[k], height-1));
+                }
+                if (profile) {
+                    double start = omp_get_wtime();
+                    stages[k]->process(inputs[k], row, inputs[k+1]);
+                    stage_seconds[b*count + k] += omp_get_wtime() - start;
+                    stage_rows[b*count + k]++;
+                } else {
+                    stages[k]->process(inputs[k], row, inputs[k+1]);
+                }
+            }
+        };
+        produce(produce, count-1, last);
+        if (profile) {
+            band_seconds[b] = profile_time() - band_start;
+            band_thread[b] = profile_thread();
+            band_counters[b] = read_hardware_counters() - band_start_counters;
+            vector<pair<string, double>> args = {{"first_row", (double) first}, {"last_row", (double) last}};
+            for (int k=0; k < count; k++) {
+                args.push_back({routine_name(chain[k]) + " seconds", stage_seconds[b*count + k]});
+            }
+            add_trace_event("band " + to_string(b), "band", band_thread[b], band_start, band_seconds[b], args);
+        }
+    }
+    if (profile) {
+        // Threads are busy with their bands and idle for the rest of the region. Each stage is attributed the share
+        // of the region's wall time that the threads spent in it, and moves one input and one output row per row.
+        double region_seconds = profile_time() - region_start;
+        double busy = 0, stage_total = 0;
+        for (int b=0; b < bands; b++) {
+            busy += band_seconds[b];
+            if (band_thread[b] != caller) { // The step itself counts the calling thread
+                step.add_counters(band_counters[b]);
+            }
+            for (int k=0; k < count; k++) {
+                stage_total += stage_seconds[b*count + k];
+            }
+        }
+        step.add_thread_time(busy, max(0.0, team * region_seconds - busy));
+        step.add_bytes_moved(2.0 * width * rows * channels);
+        for (int k=0; k < count; k++) {
+            profile_totals totals;
+            totals.name = routine_name(chain[k]);
+            totals.depth = profile_depth();
+            totals.count = 1;
+            long produced = 0;
+            for (int b=0; b < bands; b++) {
+                totals.busy += stage_seconds[b*count + k];
+                produced += stage_rows[b*count + k];
+            }
+            totals.seconds = stage_total > 0 ? region_seconds * totals.busy / stage_total : 0;
+            totals.bytes_moved = 2.0 * produced * width * channels;
+            add_profile_totals(totals);
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <string>
+#include <ostream>
+#include "prettify.hpp"
+
+using namespace std;
+
+enum routine_kind { ROUTINE_MEAN_FILTER, ROUTINE_GAUSS_FILTER, ROUTINE_MEDIAN_FILTER, ROUTINE_THRESHOLD, ROUTINE_THRESHOLD_ADAPTIVE_MEAN, ROUTINE_THRESHOLD_ADAPTIVE_GAUSS,
+                    ROUTINE_THRESHOLD_SAUVOLA, ROUTINE_THRESHOLD_BRADLEY, ROUTINE_THRESHOLD_AUTO, ROUTINE_DESKEW };
+
+// One routine of a chain with its parameters, not all of them are used by every kind
+struct routine {
+    routine_kind kind;
+    int radius = 1;
+    int thresh = 100; // Threshold of ROUTINE_THRESHOLD, and of ROUTINE_THRESHOLD_AUTO once run_pipeline chose it
+    int C = 10; // Offset of the adaptive thresholds
+    int k = sauvola_default_k; // Percent of ROUTINE_THRESHOLD_SAUVOLA and ROUTINE_THRESHOLD_BRADLEY
+    median_algorithm algorithm = MEDIAN_AUTO;
+    threshold_method method = THRESHOLD_OTSU; // Of ROUTINE_THRESHOLD_AUTO
+    border_policy border = BORDER_IGNORE; // Of the filters and the adaptive mean and gauss thresholds
+    int max_error = 0; // Levels the mean or gauss may be off by when computed on a pyramid level, 0 for exact results
+    int angle = deskew_default_angle; // Degrees ROUTINE_DESKEW searches for the skew in either direction
+    int fused_thresh = -1; // Global threshold plan_routines merged into the routine, applied to its output; -1 for none
+};
+
+// Rows of the planes of an image kept for a stage: either the whole image or a ring of the most recent rows
+// Rows outside of the image don't exist, row() gives nullptr for them
+class row_buffer {
+public:
+    row_buffer(image &img)
+        : data(img.row(0, 0)), stride(img.stride), height(img.height), capacity(0), plane_rows(img.height) {}
+    row_buffer(unsigned char *data, size_t stride, int height, int capacity)
+        : data(data), stride(stride), height(height), capacity(capacity), plane_rows(capacity) {}
+    unsigned char* row(int c, int y) const {
+        if (y < 0 || y >= height) {
+            return nullptr;
+        }
+        return data + ((size_t) c*plane_rows + (capacity ? y % capacity : y)) * stride;
+    }
+private:
+    unsigned char *data;
+    size_t stride;
+    int height;
+    int capacity; // 0 if all rows are kept
+    int plane_rows; // Rows stored per plane
+};
+
+// A routine working on a stream of rows: output rows are requested from top to bottom, and for row y all input
+// rows from y-halo-1 to y+halo are available. Stages keep state between consecutive rows, whenever a row
+// doesn't follow the last one (at the start of a band) they have to start over.
+// A stage writes the row of every channel of out.
+class stage {
+public:
+    virtual ~stage() {}
+    virtual int halo() const = 0;
+    virtual void process(const row_buffer &in, int row, const row_buffer &out) = 0;
+};
+
+bool valid_routine(const routine &r, int width, int height);
+int routine_halo(const routine &r);
+string routine_name(const routine &r);
+unique_ptr<stage> make_stage(const routine &r, int width, int height, int channels);
+vector<routine> plan_routines(const vector<routine> &chain, vector<string> *notes=nullptr);
+void explain_plan(const vector<routine> &routines, int width, int height, int channels, ostream &out);
+void run_pipeline(image &img, const vector<routine> &routines);
+class profile_step;
+void run_bands(const row_buffer &source, const row_buffer &destination, const vector<routine> &chain,
+               int width, int height, int channels, int first_row, int last_row, profile_step &step);
+size_t routine_memory(const routine &r, int width, int channels);
+double pyramid_error(const routine &r, int factor);
+int pyramid_factor(const routine &r);
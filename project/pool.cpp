@@ -0,0 +1,140 @@
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <sys/mman.h>
+#include "pool.hpp"
+
+using namespace std;
+
+const size_t small_alignment = 64; // Cache line size, also enough for aligned avx-512 loads
+const size_t huge_page_size = (size_t) 2 << 20;
+const size_t header_size = small_alignment; // In front of every buffer, holds its capacity and keeps it aligned
+
+// Capacity a new buffer for size bytes gets: large buffers fill whole huge pages together with their header
+static size_t block_capacity(size_t size) {
+    size = max(size, small_alignment);
+    if (size + header_size >= huge_page_size) {
+        return (size + header_size + huge_page_size - 1) / huge_page_size * huge_page_size - header_size;
+    }
+    return (size + small_alignment - 1) / small_alignment * small_alignment;
+}
+
+static size_t& stored_capacity(unsigned char *data) {
+    return *(size_t*) (data - header_size);
+}
+
+// Large buffers are mapped directly, aligned to a huge page so that the kernel can back them with huge pages
+static unsigned char* system_allocate(size_t capacity) {
+    size_t total = capacity + header_size;
+    if (total < huge_page_size) {
+        unsigned char *start = (unsigned char*) aligned_alloc(small_alignment, total);
+        if (start == nullptr) {
+            throw bad_alloc();
+        }
+        stored_capacity(start + header_size) = capacity;
+        return start + header_size;
+    }
+    size_t mapped = total + huge_page_size; // Room to move the start to a huge page boundary
+    void *mapping = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throw bad_alloc();
+    }
+    unsigned char *start = (unsigned char*) mapping;
+    unsigned char *data = (unsigned char*) (((size_t) start + huge_page_size - 1) / huge_page_size * huge_page_size);
+    if (data > start) { // Give back the unused parts before and after the aligned block
+        munmap(start, data - start);
+    }
+    if (data + total < start + mapped) {
+        munmap(data + total, start + mapped - (data + total));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(data, total, MADV_HUGEPAGE);
+#endif
+    stored_capacity(data + header_size) = capacity;
+    return data + header_size;
+}
+
+static void system_free(unsigned char *data, size_t capacity) {
+    if (capacity + header_size < huge_page_size) {
+        free(data - header_size);
+    } else {
+        munmap(data - header_size, capacity + header_size);
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    trim();
+}
+
+// Returns a buffer of at least size bytes, the smallest released one that fits or a new one
+// Released buffers more than twice as large as needed aren't used, so that small requests don't take up large buffers
+unsigned char* buffer_pool::acquire(size_t size) {
+    size_t capacity = block_capacity(size);
+    {
+        lock_guard<mutex> guard(lock);
+        int best = -1;
+        for (size_t k=0; k < free_blocks.size(); k++) {
+            size_t c = free_blocks[k].capacity;
+            if (c >= capacity && c <= 2*capacity && (best < 0 || c < free_blocks[best].capacity)) {
+                best = k;
+            }
+        }
+        if (best >= 0) {
+            block found = free_blocks[best];
+            free_blocks[best] = free_blocks.back();
+            free_blocks.pop_back();
+            cached -= found.capacity;
+            return found.data;
+        }
+        allocations++;
+        allocated_bytes += capacity;
+    }
+    return system_allocate(capacity); // Outside of the lock, mapping memory can take a while
+}
+
+// Hands a buffer that acquire returned back to the pool, which keeps it for the next acquire unless it already caches
+// too much. The list of cached buffers only grows while the pool warms up, so releasing doesn't allocate either.
+void buffer_pool::release(unsigned char *buffer) {
+    if (buffer == nullptr) {
+        return;
+    }
+    size_t capacity = stored_capacity(buffer);
+    {
+        lock_guard<mutex> guard(lock);
+        if (cached + capacity <= cache_limit) {
+            free_blocks.push_back({buffer, capacity});
+            cached += capacity;
+            return;
+        }
+    }
+    system_free(buffer, capacity);
+}
+
+// Gives all cached buffers back to the system
+void buffer_pool::trim() {
+    lock_guard<mutex> guard(lock);
+    for (block &b : free_blocks) {
+        system_free(b.data, b.capacity);
+    }
+    free_blocks.clear();
+    cached = 0;
+}
+
+// Number of buffers that had to be allocated from the system so far
+size_t buffer_pool::system_allocations() const {
+    lock_guard<mutex> guard(lock);
+    return allocations;
+}
+
+// Bytes of all buffers that had to be allocated from the system so far
+size_t buffer_pool::system_bytes() const {
+    lock_guard<mutex> guard(lock);
+    return allocated_bytes;
+}
+
+// The pool all images and pooled arrays use
+// It is never destroyed, so that images in static objects can still release their buffers at exit
+buffer_pool& default_pool() {
+    static buffer_pool *pool = new buffer_pool();
+    return *pool;
+}
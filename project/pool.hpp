@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <utility>
+using namespace std;
+
+// Keeps released buffers to hand them out again, so that processing many images of the same size only allocates
+// memory for the first one. Buffers are aligned to 64 bytes, large ones start 64 bytes into a mapping aligned to 2 MiB
+// and backed by transparent huge pages where the kernel supports them. The capacity of a buffer is stored in the 64
+// bytes in front of it, so handing buffers out and taking them back doesn't allocate anything once the pool is warm.
+// All functions may be called from several threads at once.
+class buffer_pool {
+public:
+    buffer_pool(size_t cache_limit = (size_t) 1 << 30) : cache_limit(cache_limit) {}
+    ~buffer_pool();
+    unsigned char* acquire(size_t size);
+    void release(unsigned char *buffer);
+    void trim();
+    size_t system_allocations() const;
+    size_t system_bytes() const;
+private:
+    struct block {
+        unsigned char *data;
+        size_t capacity;
+    };
+    size_t cache_limit; // Bytes of released buffers kept at most, buffers beyond that are given back to the system
+    size_t cached = 0;
+    size_t allocations = 0;
+    size_t allocated_bytes = 0; // Capacity of all buffers ever allocated from the system
+    vector<block> free_blocks;
+    mutable mutex lock;
+};
+
+buffer_pool& default_pool();
+
+// Array of n trivially copyable values in a buffer of the default pool, the values are not initialized
+template <typename T>
+class pooled_array {
+public:
+    pooled_array() {}
+    explicit pooled_array(size_t n) : n(n), values((T*) default_pool().acquire(n * sizeof(T))) {}
+    pooled_array(pooled_array &&other) : n(other.n), values(other.values) {
+        other.values = nullptr;
+        other.n = 0;
+    }
+    pooled_array& operator=(pooled_array &&other) {
+        swap(n, other.n);
+        swap(values, other.values);
+        return *this;
+    }
+    pooled_array(const pooled_array&) = delete;
+    pooled_array& operator=(const pooled_array&) = delete;
+    ~pooled_array() {
+        if (values) {
+            default_pool().release((unsigned char*) values);
+        }
+    }
+    T* data() const { return values; }
+    T& operator[](size_t k) const { return values[k]; }
+    size_t size() const { return n; }
+    T* begin() const { return values; }
+    T* end() const { return values + n; }
+private:
+    size_t n = 0;
+    T *values = nullptr;
+};
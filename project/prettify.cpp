@@ -2,7 +2,30 @@
 #include <fstream>
 #include <cmath>
 #include <cstring>
+#include <climits>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "prettify.hpp"
+#include "convolve.hpp"
+#include "pipeline.hpp"
+#include "pool.hpp"
+#include "profile.hpp"
+#include "compress.hpp"
 
 using namespace std;
 
@@ -12,107 +35,931 @@ const string median_filter_id = "median";
 const string threshold_id = "threshold";
 const string threshold_adaptive_mean_id = "threshold_mean";
 const string threshold_adaptive_gauss_id = "threshold_gauss";
+const string threshold_sauvola_id = "threshold_sauvola";
+const string threshold_bradley_id = "threshold_bradley";
+const string threshold_auto_id = "threshold_auto";
+const string deskew_id = "deskew";
+const string otsu_id = "otsu";
+const string triangle_id = "triangle";
+const string border_ignore_id = "ignore"; // Names of the border policies of the filters
+const string border_replicate_id = "replicate";
+const string border_reflect_id = "reflect";
 
-inline unsigned int pxl(int width, int height, int row, int column) { // Translates pixel coordinates from 2d to 1d
-    return row*width*3 + column*3; // We go i rows down, and j pixels to the right, times three for rgb channels
-}
-
-// reads ppm p3 image at filename, returns pointer to data and width, height
-unsigned char* read_image(char filename[], unsigned char *img, int *width, int *height) {
-    ifstream img_file;
-    img_file.open(filename, ios::in);
-    string format;
-    img_file >> format;
-    if (format != "P3") {
-        cerr << "Error: Input file has to be P3 (ASCII-encoded) .ppm file." << endl;
-        img_file.close();
-        return nullptr;
-    }
-    int maxVal;
-    img_file >> *width >> *height >> maxVal;
-    size_t size = (*width) * (*height) * 3; // times 3 for each rgb channel
-    img = new unsigned char[size];
-    unsigned int currentVal; // Intermediary value to read the numbers properly (char would read single chars)
-    cout << "Reading image " << filename << " with width " << *width << " and height " << *height << endl;
-    for (int i=0; i < size; i++) {
-        img_file >> currentVal;
-        img[i] = (char) currentVal; 
-    }
-    img_file.close();
+const string format_p3_id = "p3"; // Names of the output formats the user can choose
+const string format_p5_id = "p5";
+const string format_p6_id = "p6";
+const string format_pam_id = "pam";
+const string format_pbm_id = "pbm";
+const string format_png_id = "png";
+const string format_tiff_id = "tiff";
+
+static bool verbose = true; // Report the files that are read and written
+
+// Skips whitespace and comments in a netpbm header, returns false if the end of the file was reached
+static bool skip_header_space(const unsigned char *&pos, const unsigned char *end) {
+    while (pos < end) {
+        if (*pos == '#') { // Comments run until the end of the line
+            while (pos < end && *pos != '\n') {
+                pos++;
+            }
+        } else if (isspace(*pos)) {
+            pos++;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the next unsigned integer of a netpbm header, returns -1 if there is none
+static long read_header_number(const unsigned char *&pos, const unsigned char *end) {
+    if (!skip_header_space(pos, end) || !isdigit(*pos)) {
+        return -1;
+    }
+    long val = 0;
+    while (pos < end && isdigit(*pos) && val <= INT_MAX) {
+        val = val*10 + (*pos - '0');
+        pos++;
+    }
+    return val;
+}
+
+// Reads the next whitespace-separated word of a PAM header
+static string read_header_word(const unsigned char *&pos, const unsigned char *end) {
+    string word;
+    if (!skip_header_space(pos, end)) {
+        return word;
+    }
+    while (pos < end && !isspace(*pos)) {
+        word += *pos;
+        pos++;
+    }
+    return word;
+}
+
+// Parses the header of a PAM (P7) file, pos has to point behind the magic number
+static bool read_pam_header(const unsigned char *&pos, const unsigned char *end, long *width, long *height, long *depth, long *maxVal) {
+    *width = *height = *depth = *maxVal = -1;
+    while (true) {
+        string key = read_header_word(pos, end);
+        if (key == "ENDHDR") {
+            break;
+        } else if (key == "WIDTH") {
+            *width = read_header_number(pos, end);
+        } else if (key == "HEIGHT") {
+            *height = read_header_number(pos, end);
+        } else if (key == "DEPTH") {
+            *depth = read_header_number(pos, end);
+        } else if (key == "MAXVAL") {
+            *maxVal = read_header_number(pos, end);
+        } else if (key == "TUPLTYPE") {
+            read_header_word(pos, end); // The depth already tells us everything we need
+        } else {
+            return false;
+        }
+    }
+    if (pos < end && *pos == '\n') { // ENDHDR is followed by exactly one newline
+        pos++;
+    }
+    return *width > 0 && *height > 0 && *depth >= 1 && *depth <= 4 && *maxVal > 0;
+}
+
+// Converts one row of a binary raster with the given depth (channels per pixel) to channels planes
+static void unpack_row(const unsigned char *raster_row, int width, long depth, long maxVal, unsigned char *const *planes, int channels) {
+    int bytes = maxVal > 255 ? 2 : 1; // Samples above 255 are stored as 16 bit big endian
+    for (int c=0; c < channels; c++) {
+        unsigned char *out = planes[c];
+        for (int j=0; j < width; j++) {
+            const unsigned char *s = raster_row + ((size_t) j*depth + c)*bytes;
+            unsigned long val = bytes == 2 ? (s[0] << 8) | s[1] : s[0];
+            out[j] = maxVal == 255 ? val : (unsigned char) ((val*255 + maxVal/2) / maxVal);
+        }
+    }
+}
+
+// Converts a binary raster with the given depth (channels per pixel) to an image
+// Alpha channels (depth 2 and 4) are dropped, grayscale stays a single plane
+static image unpack_binary(const unsigned char *raster, int width, int height, long depth, long maxVal) {
+    if (depth == 3 && maxVal == 255) { // Raster is already rgb, it only has to be split into planes
+        return image::from_rgb(raster, width, height);
+    }
+    size_t row_size = (size_t) width * depth * (maxVal > 255 ? 2 : 1);
+    image img(width, height, depth >= 3 ? 3 : 1);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i < height; i++) {
+        unsigned char *planes[3];
+        for (int c=0; c < img.channels; c++) {
+            planes[c] = img.row(c, i);
+        }
+        unpack_row(raster + i*row_size, width, depth, maxVal, planes, img.channels);
+    }
     return img;
 }
 
-//writes data from img to ppm p3 image at filename with given width and height
-void write_image(char filename[], unsigned char *img, int width, int height) {
-    ofstream img_file;
-    img_file.open(filename, ios::out);
-    char format[3] = "P3";
-    img_file << format << endl
-        << width << " "
-        << height << endl
-        << 255 << endl; // max value for each rgb channel
-    size_t size = width * height * 3;
-    unsigned int currentVal;
-    cout << "Writing image " << filename << endl;
+// Parses the decimal digits at pos, len has to be at least 1
+static inline unsigned long parse_decimal(const unsigned char *pos, int len) {
+    switch (len) { // Nearly all values have one to three digits
+        case 1:
+            return pos[0]-'0';
+        case 2:
+            return (pos[0]-'0')*10 + (pos[1]-'0');
+        case 3:
+            return (pos[0]-'0')*100 + (pos[1]-'0')*10 + (pos[2]-'0');
+        default:
+            unsigned long val = 0;
+            for (int k=0; k < len && val <= 65535; k++) {
+                val = val*10 + (pos[k]-'0');
+            }
+            return val;
+    }
+}
+
+// Stores a parsed sample, scaling it to 0-255 if the file uses another max value
+static inline unsigned char scale_sample(unsigned long val, long maxVal) {
+    if (maxVal == 255) {
+        return (unsigned char) val;
+    }
+    return (unsigned char) ((min(val, (unsigned long) maxVal)*255 + maxVal/2) / maxVal);
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#define P3_BLOCK 32 // Bytes classified at once
+// Returns a bit mask of the bytes in the block at pos that are decimal digits, and one of the bytes that are '#'
+static inline void classify_block(const unsigned char *pos, uint32_t *digits, uint32_t *hashes) {
+#ifdef __AVX2__
+    __m256i block = _mm256_loadu_si256((const __m256i*) pos);
+    __m256i offset = _mm256_sub_epi8(block, _mm256_set1_epi8('0')); // Digits become 0-9, everything else wraps above
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(9)), offset);
+    *digits = _mm256_movemask_epi8(is_digit);
+    *hashes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('#')));
+#else
+    uint32_t mask[2], hash[2];
+    for (int half=0; half < 2; half++) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (pos + 16*half));
+        __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8('0'));
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(9)), offset);
+        mask[half] = _mm_movemask_epi8(is_digit);
+        hash[half] = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('#')));
+    }
+    *digits = mask[0] | (mask[1] << 16);
+    *hashes = hash[0] | (hash[1] << 16);
+#endif
+}
+#endif
+
+// Parses count whitespace-separated ASCII samples of a P3 raster into img, skipping comments, and moves pos behind them
+// Every byte that isn't a digit separates samples; returns false if the raster is truncated
+static bool parse_p3_raster(const unsigned char *&pos, const unsigned char *end, unsigned char *img, size_t count, long maxVal) {
+    size_t n = 0;
+#ifdef P3_BLOCK
+    while (n < count && end - pos >= P3_BLOCK) {
+        uint32_t digits, hashes;
+        classify_block(pos, &digits, &hashes);
+        int block_end = P3_BLOCK; // Tokens are only taken if they end before this byte
+        if (hashes) { // Comments are rare, so tokens before one are parsed and the comment is skipped separately
+            block_end = __builtin_ctz(hashes);
+            digits &= (1u << block_end) - 1;
+        }
+        int next = block_end; // Where the next block starts
+        while (digits && n < count) {
+            int start = __builtin_ctz(digits);
+            int len = __builtin_ctz(~(digits >> start)); // Number of consecutive digit bits
+            if (start + len >= P3_BLOCK) { // The number might continue in the next block
+                next = start;
+                break;
+            }
+            img[n++] = scale_sample(parse_decimal(pos + start, len), maxVal);
+            digits &= ~0u << (start + len); // start + len < 32, so the shift is defined
+            if (n == count) { // The rest of the block belongs to the samples after these
+                next = start + len;
+            }
+        }
+        if (next == 0 && block_end == P3_BLOCK) { // A number fills the whole block, which no valid sample can do
+            return false;
+        }
+        pos += next;
+        if (next == block_end && block_end < P3_BLOCK) { // Skip the comment up to the end of its line
+            const unsigned char *newline = (const unsigned char*) memchr(pos, '\n', end - pos);
+            pos = newline == nullptr ? end : newline;
+        }
+    }
+#endif
+    while (n < count) { // Remaining bytes at the end of the file
+        long val = read_header_number(pos, end);
+        if (val < 0) {
+            return false;
+        }
+        img[n++] = scale_sample(val, maxVal);
+    }
+    return true;
+}
+
+// Checks the magic number at the start of a file, and moves pos behind it
+static bool parse_magic(const unsigned char *&pos, const unsigned char *end, char *magic) {
+    if (end - pos < 2 || pos[0] != 'P' || (pos[1] != '3' && pos[1] != '5' && pos[1] != '6' && pos[1] != '7')) {
+        return false;
+    }
+    *magic = pos[1];
+    pos += 2;
+    return true;
+}
+
+// Parses the header behind the magic number, pos ends up at the first byte of the raster
+// Returns false if the header is malformed or the image is wider or higher than an int can count
+// The number of pixels may exceed an int, everything that depends on it is computed with 64 bit sizes
+static bool parse_header(const unsigned char *&pos, const unsigned char *end, char magic, long *w, long *h, long *depth, long *maxVal) {
+    bool valid;
+    if (magic == '7') {
+        valid = read_pam_header(pos, end, w, h, depth, maxVal);
+    } else {
+        *w = read_header_number(pos, end);
+        *h = read_header_number(pos, end);
+        *maxVal = read_header_number(pos, end);
+        *depth = magic == '5' ? 1 : 3;
+        valid = *w > 0 && *h > 0 && *maxVal > 0 && pos < end && isspace(*pos);
+        pos++; // Exactly one whitespace separates the header from the raster
+    }
+    return valid && *maxVal <= 65535 && *w <= INT_MAX && *h <= INT_MAX;
+}
+
+// Reads only the header of the image at filename to find its size, returns false if that fails
+bool read_image_size(char filename[], int *width, int *height) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    unsigned char header[1 << 16]; // Far more than any header without huge comments needs
+    ssize_t size = read(fd, header, sizeof(header));
+    close(fd);
+    if (size <= 0) {
+        return false;
+    }
+    const unsigned char *pos = header;
+    const unsigned char *end = header + size;
+    char magic;
+    long w, h, depth, maxVal;
+    if (!parse_magic(pos, end, &magic) || !parse_header(pos, end, magic, &w, &h, &depth, &maxVal)) {
+        return false;
+    }
+    *width = w;
+    *height = h;
+    return true;
+}
+
+// Whether read_image and write_image report the files they work on
+void set_verbose(bool enabled) {
+    verbose = enabled;
+}
+
+// reads ppm (P3, P6), pgm (P5) or pam (P7) image at filename, returns an empty image if that fails
+// Files are memory-mapped, binary rasters are split into planes without any parsing
+// Grayscale files, and ppm files whose channels are all equal, give an image with a single plane
+image read_image(char filename[]) {
+    profile_step step("read_image");
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Could not open " << filename << "." << endl;
+        return image();
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 2) {
+        cerr << "Error: Input file is empty." << endl;
+        close(fd);
+        return image();
+    }
+    size_t file_size = file_stat.st_size;
+    void *mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid without the descriptor
+    if (mapping == MAP_FAILED) {
+        cerr << "Error: Could not map " << filename << " into memory." << endl;
+        return image();
+    }
+    madvise(mapping, file_size, MADV_SEQUENTIAL);
+    step.add_bytes_moved(file_size);
+    image img = decode_image((const unsigned char*) mapping, file_size, filename);
+    munmap(mapping, file_size);
+    return img;
+}
+
+// Decodes the contents of a ppm, pgm or pam file that is already in memory, like read_image does
+// name is only used in the messages, returns an empty image if the data can't be decoded
+image decode_image(const unsigned char *data, size_t size, const char *name) {
+    const unsigned char *pos = data;
+    const unsigned char *end = pos + size;
+    char magic;
+    long w, h, depth, maxVal;
+    if (size < 2 || !parse_magic(pos, end, &magic)) {
+        cerr << "Error: Input file has to be a P3 or P6 .ppm, P5 .pgm or P7 .pam file." << endl;
+        return image();
+    }
+    bool valid = parse_header(pos, end, magic, &w, &h, &depth, &maxVal);
+    size_t pixels = (size_t) w * h;
+    size_t raster_size = pixels * depth * (maxVal > 255 ? 2 : 1);
+    if (magic == '3') { // ASCII samples take at least two bytes each
+        raster_size = pixels * 3 * 2 - 1;
+    }
+    if (!valid || raster_size > (size_t) (end-pos)) {
+        cerr << "Error: Header of " << name << " is malformed or the file is truncated." << endl;
+        return image();
+    }
+    if (verbose) {
+        cout << "Reading image " << name << " with width " << w << " and height " << h << endl;
+    }
+    image img;
+    if (magic == '3') {
+        pooled_array<unsigned char> rgb(pixels*3);
+        valid = parse_p3_raster(pos, end, rgb.data(), pixels*3, maxVal);
+        if (valid) {
+            img = image::from_rgb(rgb.data(), w, h);
+        }
+    } else {
+        img = unpack_binary(pos, w, h, depth, maxVal);
+    }
+    if (!valid) {
+        cerr << "Error: " << name << " contains fewer samples than its header announces." << endl;
+        return image();
+    }
+    return img;
+}
+
+raster_reader::~raster_reader() {
+    if (mapping != nullptr) {
+        munmap(mapping, file_size);
+    }
+}
+
+// Maps filename into memory and parses its header, reports why if that fails
+bool raster_reader::open(char filename[]) {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Could not open " << filename << "." << endl;
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 2) {
+        cerr << "Error: Input file is empty." << endl;
+        ::close(fd);
+        return false;
+    }
+    file_size = file_stat.st_size;
+    void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        cerr << "Error: Could not map " << filename << " into memory." << endl;
+        return false;
+    }
+    mapping = mapped;
+    pos = released = (const unsigned char*) mapping;
+    end = pos + file_size;
+    long w, h;
+    if (!parse_magic(pos, end, &magic)) {
+        cerr << "Error: Input file has to be a P3 or P6 .ppm, P5 .pgm or P7 .pam file." << endl;
+        return false;
+    }
+    bool valid = parse_header(pos, end, magic, &w, &h, &depth, &maxVal);
+    row_size = (size_t) w * depth * (maxVal > 255 ? 2 : 1);
+    size_t raster_size = magic == '3' ? (size_t) w * h * 3 * 2 - 1 : row_size * h; // ASCII samples take at least two bytes
+    if (!valid || raster_size > (size_t) (end-pos)) {
+        cerr << "Error: Header of " << filename << " is malformed or the file is truncated." << endl;
+        return false;
+    }
+    width = w;
+    height = h;
+    channels = depth >= 3 ? 3 : 1;
+    madvise(mapping, file_size, MADV_SEQUENTIAL);
+    if (magic == '3') {
+        samples = pooled_array<unsigned char>((size_t) width * 3);
+    }
+    if (channels == 3) {
+        color = image(width, 1, 3);
+    }
+    return true;
+}
+
+// Planes read_image gives for the file: one for grayscale files and binary rgb files whose channels are all equal, three
+// for other color files. 0 for a color P3 file, whose samples can only be compared once they are all parsed. Only valid
+// before the first row is read.
+int raster_reader::image_planes() const {
+    if (channels == 1) {
+        return 1;
+    }
+    if (magic == '3') {
+        return 0;
+    }
+    if (depth == 3 && maxVal == 255) { // Checked like image::from_rgb, on the mapped raster
+        return image::rgb_is_gray(pos, (size_t) width * height) ? 1 : 3;
+    }
+    return 3;
+}
+
+// Reads the next row into planes: one per channel of the file, or a single one for the intensities of a color file
+// Returns false if the file ends early
+bool raster_reader::read_row(unsigned char *const *planes, int planes_count) {
+    if (next_row >= height) {
+        return false;
+    }
+    unsigned char *color_planes[3];
+    unsigned char *const *targets = planes;
+    if (planes_count < channels) { // Only the intensity is kept
+        for (int c=0; c < 3; c++) {
+            color_planes[c] = color.row(c, 0);
+        }
+        targets = color_planes;
+    }
+    if (magic == '3') {
+        if (!parse_p3_raster(pos, end, samples.data(), (size_t) width * 3, maxVal)) {
+            return false;
+        }
+        for (int c=0; c < channels; c++) {
+            unsigned char *out = targets[c];
+            for (int j=0; j < width; j++) {
+                out[j] = samples[(size_t) j*3 + c];
+            }
+        }
+    } else {
+        unpack_row(pos, width, depth, maxVal, targets, channels);
+        pos += row_size;
+    }
+    if (planes_count < channels) {
+        color.luma_row(0, planes[0]);
+    }
+    next_row++;
+    // Rows that were read are given back, so that the file doesn't stay in memory however large it is
+    const size_t release_size = (size_t) 4 << 20;
+    if ((size_t) (pos - released) >= release_size) {
+        const unsigned char *release_end = released + (pos - released) / 4096 * 4096;
+        madvise((void*) released, release_end - released, MADV_DONTNEED);
+        released = release_end;
+    }
+    return true;
+}
+
+// Writes all of data to fd, returns false on failure
+static bool write_all(int fd, const unsigned char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Text of each sample value followed by a space, padded to four bytes so it can be copied without branching
+struct p3_sample_text {
+    char text[4];
+    unsigned char len;
+};
+
+static const p3_sample_text* p3_sample_table() {
+    static p3_sample_text table[256];
+    static bool initialized = [] {
+        for (int val=0; val < 256; val++) {
+            int len = snprintf(table[val].text, 4, "%d", val);
+            table[val].text[len] = ' '; // snprintf wrote a terminator here, the space replaces it
+            table[val].len = len + 1;
+        }
+        return true;
+    }();
+    (void) initialized;
+    return table;
+}
+
+// Formats the rows of an image into a large buffer that is flushed with bulk writes
+// format_row writes row i to out, at most row_size bytes, and returns the end of what it wrote
+template <typename formatter>
+static bool write_rows(int fd, int height, size_t row_size, formatter format_row) {
+    const size_t buffer_size = 1 << 20;
+    pooled_array<char> buffer(min(max(buffer_size, row_size), row_size * height)); // Small images don't need the whole buffer
+    char *out = buffer.data();
     for (int i=0; i < height; i++) { // Over all rows
-        for (int j=0; j < width; j++) { // Over pixels in a row
-            for (int c=0; c < 3; c++) { // Over rgb channels
-                currentVal = (unsigned) img[pxl(width, height, i, j) + c];
-                img_file << currentVal << " ";
+        if ((size_t) (out - buffer.data()) + row_size > buffer.size()) {
+            if (!write_all(fd, (const unsigned char*) buffer.data(), out - buffer.data())) {
+                return false;
             }
+            out = buffer.data();
         }
-        img_file << endl;
+        out = format_row(i, out);
     }
-    img_file.close();
+    return write_all(fd, (const unsigned char*) buffer.data(), out - buffer.data());
 }
 
-// Convolutional filter, takes the mean over a square around each pixel
-// radius:  determines the size of the surrounding square in which the mean is calculated
-unsigned char* mean_filter(unsigned char *img, int width, int height, int radius=1) {
-    if (radius > (width/2)-1 || radius > (height/2)-1) {
-        cerr << "Error: Radius too large for image." << endl;
-        return img;
+raster_writer::raster_writer() {}
+
+raster_writer::~raster_writer() {
+    close();
+}
+
+// Header of a file of the given format and size, the netpbm formats but pbm store 8 bit samples
+static string header_text(int width, int height, image_format format) {
+    if (format == FORMAT_PBM) {
+        return "P4\n" + to_string(width) + " " + to_string(height) + "\n";
+    } else if (format == FORMAT_P3) {
+        return "P3\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+    } else if (format == FORMAT_P6) {
+        return "P6\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+    } else if (format == FORMAT_P5) {
+        return "P5\n" + to_string(width) + " " + to_string(height) + "\n255\n";
     }
-    if (radius < 1)  {
-        cerr << "Error: Radius has to be at least 1." << endl;
-        return img;
+    return "P7\nWIDTH " + to_string(width) + "\nHEIGHT " + to_string(height)
+         + "\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n";
+}
+
+// Creates filename and writes the header for an image of the given size
+bool raster_writer::open(char filename[], int width, int height, image_format format, int channels) {
+    int file = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        failed = true;
+        return false;
     }
-    size_t size = width*height*3;
-    unsigned char *tmp_img = new unsigned char[size];
+    return open(file, width, height, format, true, channels);
+}
 
-#pragma omp parallel for
-    for (int i=0; i < height; i++) {
-        for (int j=0; j < width; j++) {
-            for (int c=0; c < 3; c++) {
-                unsigned int sum = 0;
-                for (int x=-radius; x <= radius; x++) {
-                    if (j+x < width && j+x >= 0) { // Edge cases are ignored, with large radii this causes shadows
-                        sum += img[pxl(width, height, i, j+x) + c];
-                    }
-                }
-                tmp_img[pxl(width, height, i, j) + c] = (unsigned char) (sum / (radius*2+1));
+// Writes the header to a descriptor that is already open, which is closed by close() only if owned
+// Channels only matter for png, which stores grayscale images with one sample per pixel
+bool raster_writer::open(int descriptor, int width, int height, image_format format, bool owned, int channels) {
+    this->width = width;
+    this->height = height;
+    this->format = format;
+    fd = descriptor;
+    owns_fd = owned;
+    encoder = make_chunk_encoder(fd, width, height, channels, format);
+    if (encoder) {
+        failed = !encoder->start();
+        return !failed;
+    }
+    string header = header_text(width, height, format);
+    failed = !write_all(fd, (const unsigned char*) header.data(), header.size());
+    written = header.size();
+    return !failed;
+}
+
+// Appends count rows of img, starting at row first, to the file
+// Rows are interleaved (or converted to intensities for P5, to bits for pbm) into large buffers, P3 samples are
+// formatted with a table. The compressed formats are left to their encoder.
+bool raster_writer::write_rows(const image &img, int first, int count) {
+    if (failed) {
+        return false;
+    }
+    if (encoder) {
+        failed = !encoder->write_rows(img, first, count);
+        return !failed;
+    }
+    int width = this->width;
+    size_t row_size = formatted_row_size(width, format);
+    size_t total = 0;
+    auto count_bytes = [&](char *start, char *end) { // Bytes of each row, to report what was written
+        total += end - start;
+        return end;
+    };
+    bool ok;
+    if (format == FORMAT_P3) {
+        const p3_sample_text *table = p3_sample_table();
+        pooled_array<unsigned char> rgb((size_t) width * 3);
+        ok = ::write_rows(fd, count, row_size, [&](int i, char *out) {
+            char *start = out;
+            img.rgb_row(first + i, rgb.data());
+            for (size_t k=0; k < (size_t) width*3; k++) { // Over all samples of the row
+                const p3_sample_text &sample = table[rgb[k]];
+                memcpy(out, sample.text, 4);
+                out += sample.len;
             }
+            *out++ = '\n';
+            return count_bytes(start, out);
+        });
+    } else if (format == FORMAT_P5) {
+        ok = ::write_rows(fd, count, row_size, [&](int i, char *out) { // Same intensity as used by the thresholds
+            img.luma_row(first + i, (unsigned char*) out);
+            return count_bytes(out, out + width);
+        });
+    } else if (format == FORMAT_PBM) {
+        pooled_array<unsigned char> intensity(width);
+        ok = ::write_rows(fd, count, row_size, [&](int i, char *out) {
+            img.luma_row(first + i, intensity.data());
+            pack_bilevel_row(intensity.data(), (unsigned char*) out, width);
+            return count_bytes(out, out + row_size);
+        });
+    } else {
+        ok = ::write_rows(fd, count, row_size, [&](int i, char *out) {
+            img.rgb_row(first + i, (unsigned char*) out);
+            return count_bytes(out, out + row_size);
+        });
+    }
+    written += total;
+    failed = !ok;
+    return ok;
+}
+
+size_t raster_writer::bytes_written() const {
+    return encoder ? encoder->bytes_written() : written;
+}
+
+// Completes and closes the file, returns false if anything could not be written
+bool raster_writer::close() {
+    if (encoder) {
+        failed = !encoder->finish() || failed;
+        written = encoder->bytes_written();
+        encoder.reset();
+    }
+    if (fd >= 0 && owns_fd) {
+        ::close(fd);
+    }
+    fd = -1;
+    return !failed;
+}
+
+// Most bytes a row of an image takes in a format: every P3 sample may be "255 ", followed by a newline
+// The compressed formats keep a group of rows of a fixed size instead, see chunk_encoder_memory
+size_t raster_writer::formatted_row_size(int width, image_format format) {
+    if (format == FORMAT_P3) {
+        return (size_t) width * 3 * 4 + 1;
+    } else if (format == FORMAT_PBM) {
+        return ((size_t) width + 7) / 8;
+    } else if (format == FORMAT_PNG || format == FORMAT_TIFF) {
+        return 0;
+    }
+    return format == FORMAT_P5 ? (size_t) width : (size_t) width * 3;
+}
+
+//writes img to image at filename in the given format
+void write_image(char filename[], const image &img, image_format format) {
+    profile_step step("write_image");
+    if (verbose) {
+        cout << "Writing image " << filename << endl;
+    }
+    raster_writer writer;
+    bool written = writer.open(filename, img.width, img.height, format, img.channels)
+                && writer.write_rows(img, 0, img.height);
+    written = writer.close() && written;
+    if (!written) {
+        cerr << "Error: Could not write " << filename << "." << endl;
+    } else {
+        step.add_bytes_moved(writer.bytes_written());
+    }
+}
+
+bool parse_border(const char *text, border_policy *border) {
+    if (border_ignore_id.compare(text) == 0) {
+        *border = BORDER_IGNORE;
+    } else if (border_replicate_id.compare(text) == 0) {
+        *border = BORDER_REPLICATE;
+    } else if (border_reflect_id.compare(text) == 0) {
+        *border = BORDER_REFLECT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_format(const char *text, image_format *format) {
+    if (format_p3_id.compare(text) == 0) {
+        *format = FORMAT_P3;
+    } else if (format_p5_id.compare(text) == 0) {
+        *format = FORMAT_P5;
+    } else if (format_p6_id.compare(text) == 0) {
+        *format = FORMAT_P6;
+    } else if (format_pam_id.compare(text) == 0) {
+        *format = FORMAT_PAM;
+    } else if (format_pbm_id.compare(text) == 0) {
+        *format = FORMAT_PBM;
+    } else if (format_png_id.compare(text) == 0) {
+        *format = FORMAT_PNG;
+    } else if (format_tiff_id.compare(text) == 0) {
+        *format = FORMAT_TIFF;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Whether a format only stores the intensity, so that color images can be converted before they are processed
+bool gray_format(image_format format) {
+    return format == FORMAT_P5 || format == FORMAT_PBM || format == FORMAT_TIFF;
+}
+
+string format_extension(image_format format) {
+    switch (format) {
+    case FORMAT_P5:
+        return ".pgm";
+    case FORMAT_PAM:
+        return ".pam";
+    case FORMAT_PBM:
+        return ".pbm";
+    case FORMAT_PNG:
+        return ".png";
+    case FORMAT_TIFF:
+        return ".tif";
+    default:
+        return ".ppm";
+    }
+}
+
+// Chooses the output format from a file extension: .pgm is P5, .pam is P7, .pbm is P4, .png is png, .tif and .tiff
+// are group 4 tiff, everything else P3
+image_format format_from_filename(char filename[]) {
+    string name(filename);
+    size_t dot = name.rfind('.');
+    string extension = dot == string::npos ? "" : name.substr(dot);
+    if (extension == ".pgm") {
+        return FORMAT_P5;
+    } else if (extension == ".pam") {
+        return FORMAT_PAM;
+    } else if (extension == ".pbm") {
+        return FORMAT_PBM;
+    } else if (extension == ".png") {
+        return FORMAT_PNG;
+    } else if (extension == ".tif" || extension == ".tiff") {
+        return FORMAT_TIFF;
+    }
+    return FORMAT_P3;
+}
+
+// Divides the sum of a window by its size, with a multiplication if that gives the same results
+struct window_divisor {
+    unsigned int window;
+    float inverse;
+    bool exact = true;
+    unsigned char operator()(unsigned int s) const {
+        return exact ? (unsigned char) ((s + 0.5f) * inverse) : (unsigned char) (s / window);
+    }
+};
+
+// Averages each sample of a row with its neighbours up to radius samples to the left and right, using prefix sums
+// The row is extended by radius samples on both ends, which the border policy fills in (with zeros if it ignores
+// them), so that every window is the difference of two prefix sums and only the prefix scan deals with the edges.
+// The parameters are all copies or locals, so the compiler knows that writing out can't change them and vectorizes
+static void mean_samples(const unsigned char *row, unsigned char *out, unsigned int *prefix, int width, int radius,
+                         border_policy border, window_divisor divide) {
+    auto outside = [&](int x) {
+        int pos = border_index(x, width, border);
+        return pos < 0 ? 0 : row[pos];
+    };
+    prefix[0] = 0;
+    for (int x=-radius; x < 0; x++) {
+        prefix[x+radius+1] = prefix[x+radius] + outside(x);
+    }
+    unsigned int *inside = prefix + radius; // inside[j] is the sum of everything left of sample j
+    for (int j=0; j < width; j++) {
+        inside[j+1] = inside[j] + row[j];
+    }
+    for (int x=width; x < width+radius; x++) {
+        inside[x+1] = inside[x] + outside(x);
+    }
+    for (int j=0; j < width; j++) {
+        out[j] = divide(inside[j+radius+1] - inside[j-radius]);
+    }
+}
+
+// Same as mean_samples for a radius known at compile time: the window of every sample is summed directly, which
+// unrolls and vectorizes, while the running sum of the prefixes has to go from one sample to the next. Dividing by
+// the constant window size is a multiplication as well, and always exact.
+template <int radius>
+static void mean_samples_fixed(const unsigned char *row, unsigned char *out, int width, border_policy border) {
+    const unsigned int window = 2*radius+1;
+    auto mean_edge = [&](int j) {
+        unsigned int sum = 0;
+        for (int x=j-radius; x <= j+radius; x++) {
+            int pos = border_index(x, width, border);
+            if (pos >= 0) {
+                sum += row[pos];
+            }
+        }
+        out[j] = sum / window;
+    };
+    for (int j=0; j < min(radius, width); j++) {
+        mean_edge(j);
+    }
+    for (int j=radius; j < width-radius; j++) {
+        unsigned int sum = 0;
+#pragma GCC unroll 16
+        for (int x=-radius; x <= radius; x++) {
+            sum += row[j+x];
         }
+        out[j] = sum / window;
     }
-    unsigned char *new_img = new unsigned char[size];
+    for (int j=max(width-radius, radius); j < width; j++) {
+        mean_edge(j);
+    }
+}
 
-#pragma omp parallel for
+static void add_row(unsigned int *sum, const unsigned char *row, int width) {
     for (int j=0; j < width; j++) {
-        for (int i=0; i < height; i++) {
-            for (int c=0; c < 3; c++) {
-                unsigned int sum = 0;
-                for (int y=-radius; y <= radius; y++) {
-                    if (i+y < height && i+y >= 0) {
-                        sum += tmp_img[pxl(width, height, i+y, j) + c];
+        sum[j] += row[j];
+    }
+}
+
+static void subtract_row(unsigned int *sum, const unsigned char *row, int width) {
+    for (int j=0; j < width; j++) {
+        sum[j] -= row[j];
+    }
+}
+
+// Divides the column sums of a row by the window size
+static void divide_rows(const unsigned int *sum, unsigned char *out, int width, window_divisor divide) {
+    for (int j=0; j < width; j++) {
+        out[j] = divide(sum[j]);
+    }
+}
+
+// Convolutional filter, takes the mean over a square around each pixel
+// The cost per pixel doesn't depend on the radius: the horizontal pass takes differences of prefix sums of the row,
+// the vertical pass keeps a running sum of the window for all columns at once and updates them with entire rows:
+// the row that enters is added and the one that leaves is subtracted. Up to specialized_radius the horizontal pass
+// sums the windows directly, which is faster for so few samples.
+// Out-of-image pixels count as black unless the border policy replaces them, so we always divide by the full window
+class mean_stage : public stage {
+public:
+    mean_stage(int width, int height, int channels, int radius, border_policy border)
+        : width(width), height(height), channels(channels), radius(radius), window(radius*2+1), border(border),
+          horizontal(width, (2*radius+2) * channels, 1), sum((size_t) width * channels), prefix(width + 2*radius + 1) {
+        divisor.window = window;
+        divisor.inverse = 1.0f / window;
+        for (unsigned int s=0; s <= 255*window; s++) { // Multiplying with the inverse vectorizes, integer division doesn't
+            divisor.exact &= (unsigned int) ((s + 0.5f) * divisor.inverse) == s / window;
+        }
+    }
+    int halo() const { return radius; }
+    // Rows outside the image are replaced by rows inside it, which the window also covers, so their horizontal
+    // means are still in the ring
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        for (int c=0; c < channels; c++) {
+            unsigned int *column_sum = &sum[(size_t) c*width];
+            if (row != last_row+1) { // Start over with the whole window
+                fill(column_sum, column_sum + width, 0);
+                for (int y=max(row-radius, 0); y <= min(row+radius, height-1); y++) {
+                    mean_row(in.row(c, y), horizontal_row(c, y));
+                }
+                for (int y=row-radius; y <= row+radius; y++) {
+                    int source = border_index(y, height, border);
+                    if (source >= 0) {
+                        add_row(column_sum, horizontal_row(c, source), width);
                     }
                 }
-                new_img[pxl(width, height, i, j) + c] = (unsigned char) (sum / (radius*2+1));
+            } else {
+                if (row+radius < height) {
+                    mean_row(in.row(c, row+radius), horizontal_row(c, row+radius));
+                }
+                int entering = border_index(row+radius, height, border);
+                int leaving = border_index(row-radius-1, height, border);
+                if (entering >= 0) {
+                    add_row(column_sum, horizontal_row(c, entering), width);
+                }
+                if (leaving >= 0) {
+                    subtract_row(column_sum, horizontal_row(c, leaving), width);
+                }
             }
+            divide_rows(column_sum, out.row(c, row), width, divisor);
         }
+        last_row = row;
     }
-    delete[] img;
-    delete[] tmp_img;
-    return new_img;
+private:
+    int width, height, channels, radius;
+    unsigned int window;
+    border_policy border;
+    image horizontal; // Ring of the horizontally averaged rows of the window and the row above it, for every channel
+    pooled_array<unsigned int> sum; // Running sums of all samples of a row
+    pooled_array<unsigned int> prefix; // Prefix sums of the row the horizontal pass works on, extended at both ends
+    int last_row = INT_MIN/2;
+    window_divisor divisor;
+
+    void mean_row(const unsigned char *row, unsigned char *out) {
+        if (specialized_kernels()) {
+            switch (radius) {
+                case 1:
+                    return mean_samples_fixed<1>(row, out, width, border);
+                case 2:
+                    return mean_samples_fixed<2>(row, out, width, border);
+                case 3:
+                    return mean_samples_fixed<3>(row, out, width, border);
+                case 4:
+                    return mean_samples_fixed<4>(row, out, width, border);
+                case 5:
+                    return mean_samples_fixed<5>(row, out, width, border);
+            }
+        }
+        mean_samples(row, out, prefix.data(), width, radius, border, divisor);
+    }
+    unsigned char* horizontal_row(int c, int y) {
+        return horizontal.row(0, c*(2*radius+2) + y % (2*radius+2));
+    }
+};
+
+// Convolutional filter, takes the mean over a square around each pixel
+// radius:  determines the size of the surrounding square in which the mean is calculated
+// border:  what is taken for the pixels of the square outside the image
+// max_error: levels the result may be off by if it's computed on a downsampled image (see pyramid_factor), 0 for exact
+void mean_filter(image &img, int radius, border_policy border, int max_error) {
+    routine r;
+    r.kind = ROUTINE_MEAN_FILTER;
+    r.radius = radius;
+    r.border = border;
+    r.max_error = max_error;
+    run_pipeline(img, {r});
 }
 
 
@@ -121,244 +968,1132 @@ inline float gauss(float mu, float sigma, float x) {
     return (1.0 / (sqrt(2.0*M_PI)*sigma)) * exp(-(x*x)/(2.0*sigma*sigma));
 }
 
-// Convolutional filter, takes the gaussian-weighted mean over a square around each pixel
-// radius:   determines the size of the surrounding square in which the weighted mean is calculated
-unsigned char* gauss_filter(unsigned char *img, int width, int height, int radius=1) {
-    if (radius < 1)  {
-        cerr << "Error: Radius has to be at least 1." << endl;
-        return img;
-    }
-    if (radius > (width/2)-1 || radius > (height/2)-1) {
-        cerr << "Error: Radius too large for image." << endl;
-        return img;
+// Returns the normalized 1d-kernel of the gauss filter for radius in fixed point (see convolve.hpp)
+// Kernels are computed once per radius and cached, the returned reference stays valid
+const vector<int16_t>& gauss_kernel(int radius) {
+    static unordered_map<int, vector<int16_t>> cache;
+    static mutex cache_mutex;
+    lock_guard<mutex> lock(cache_mutex);
+    auto cached = cache.find(radius);
+    if (cached != cache.end()) {
+        return cached->second;
     }
     float sigma = ((float) radius) / 3.0; // this gives us 99% of the mass under the gaussian
-    float kernel[2*radius+1];
+    vector<float> weights(2*radius+1);
     float weight = 0;
     for (int x=-radius; x <= radius; x++) { // Initialize a 1d-kernel of normally distributed weights
-        float tmp = gauss(0, sigma, x);
-        kernel[x+radius] = tmp;
-        weight += tmp;
-    }
-    size_t size = width*height*3;
-    unsigned char *tmp_img = new unsigned char[size];
-    
-#pragma omp parallel for
-    for (int i=0; i < height; i++) {
-        for (int j=0; j < width; j++) {
-            for (int c=0; c < 3; c++) {
-                unsigned int sum = 0;
-                for (int x=-radius; x <= radius; x++) {
-                    if (j+x < width && j+x >= 0) { // Edge cases are ignored, with large radii this causes shadows
-                        sum += img[pxl(width, height, i, j+x) + c] * kernel[x+radius];
-                    }
+        weights[x+radius] = gauss(0, sigma, x);
+        weight += weights[x+radius];
+    }
+    vector<int16_t> kernel(2*radius+1);
+    int total = 0;
+    for (int x=-radius; x <= radius; x++) {
+        kernel[x+radius] = lround(weights[x+radius] / weight * (1 << kernel_shift));
+        total += kernel[x+radius];
+    }
+    kernel[radius] += (1 << kernel_shift) - total; // Rounding errors go to the center, so the weights sum up to exactly one
+    return cache.emplace(radius, move(kernel)).first->second; // unordered_map never moves its elements
+}
+
+// Convolutional filter, takes the gaussian-weighted mean over a square around each pixel
+// Weights are in fixed point and sums are rounded to the nearest value, the simd kernels give the same results as scalar code.
+// Each input row is convolved horizontally once and kept in a ring, the vertical pass weights whole rows at once.
+// Rows outside the image are left out or replaced by rows of the window, as the border policy says.
+class gauss_stage : public stage {
+public:
+    gauss_stage(int width, int height, int channels, int radius, border_policy border)
+        : width(width), height(height), channels(channels), radius(radius), border(border),
+          kernel(gauss_kernel(radius)), horizontal(width, (2*radius+1) * channels, 1) {}
+    int halo() const { return radius; }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        int first_new = row == last_row+1 ? row+radius : row-radius; // Rows that weren't convolved yet
+        for (int c=0; c < channels; c++) {
+            for (int y=max(first_new, 0); y <= min(row+radius, height-1); y++) {
+                convolve_row(in.row(c, y), horizontal_row(c, y), width, 1, kernel.data(), radius, border);
+            }
+            rows.clear();
+            weights.clear();
+            for (int y=-radius; y <= radius; y++) {
+                int source = border_index(row+y, height, border);
+                if (source >= 0) {
+                    rows.push_back(horizontal_row(c, source));
+                    weights.push_back(kernel[y+radius]);
                 }
-                tmp_img[pxl(width, height, i, j) + c] = (unsigned char) (sum / weight);
             }
+            weighted_sum(rows.data(), weights.data(), rows.size(), out.row(c, row), width);
         }
+        last_row = row;
     }
-    unsigned char *new_img = new unsigned char[size];
+private:
+    int width, height, channels, radius;
+    border_policy border;
+    const vector<int16_t> &kernel;
+    image horizontal; // Ring of the horizontally convolved rows of the window, for every channel
+    vector<const unsigned char*> rows;
+    vector<int16_t> weights;
+    int last_row = INT_MIN/2;
 
-#pragma omp parallel for
-    for (int j=0; j < width; j++) {
-        for (int i=0; i < height; i++) {
-            for (int c=0; c < 3; c++) {
-                unsigned int sum = 0;
-                for (int y=-radius; y <= radius; y++) {
-                    if (i+y < height && i+y >= 0) {
-                        sum += tmp_img[pxl(width, height, i+y, j) + c] * kernel[y+radius];
-                    }
+    unsigned char* horizontal_row(int c, int y) {
+        return horizontal.row(0, c*(2*radius+1) + y % (2*radius+1));
+    }
+};
+
+// Convolutional filter, takes the gaussian-weighted mean over a square around each pixel
+// radius:   determines the size of the surrounding square in which the weighted mean is calculated
+// border:   what is taken for the pixels of the square outside the image
+// max_error: levels the result may be off by if it's computed on a downsampled image (see pyramid_factor), 0 for exact
+void gauss_filter(image &img, int radius, border_policy border, int max_error) {
+    routine r;
+    r.kind = ROUTINE_GAUSS_FILTER;
+    r.radius = radius;
+    r.border = border;
+    r.max_error = max_error;
+    run_pipeline(img, {r});
+}
+
+
+// Block of a pyramid level an output position is interpolated from, and its weight in 1/(2*factor): the centers of
+// the blocks are at (X+0.5)*factor-0.5, the output is between the centers of block and block+1
+static void pyramid_position(int x, int factor, int *block, int *weight) {
+    int n = 2*x + 1 - factor; // 2*factor times the position in blocks, relative to the center of block 0
+    *block = n >= 0 ? n / (2*factor) : -((2*factor - 1 - n) / (2*factor));
+    *weight = n - *block * 2*factor;
+}
+
+static bool gauss_background(const routine &r) {
+    return r.kind == ROUTINE_GAUSS_FILTER || r.kind == ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+}
+
+// Most intensity levels a pixel of the mean or gauss of a routine can differ by if it is computed on a pyramid level
+// downsampled by factor: every block of factor x factor pixels is averaged, the level is filtered with radius/factor
+// and the result upsampled bilinearly. Both are linear and separable, so no input differs by more than 255 times
+// half the distance of the 1d kernels that give an output pixel (the largest for any position within its block),
+// plus the rounding of the intermediate results. The bound holds for pixels whose windows are inside the image.
+double pyramid_error(const routine &r, int factor) {
+    static map<tuple<bool, int, int>, double> cache;
+    static mutex cache_mutex;
+    bool gauss = gauss_background(r);
+    int radius = r.radius, inner = r.radius / factor;
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto cached = cache.find(make_tuple(gauss, radius, factor));
+        if (cached != cache.end()) {
+            return cached->second;
+        }
+    }
+    auto kernel = [&](int radius) {
+        vector<double> weights(2*radius+1, 1.0 / (2*radius+1));
+        if (gauss) {
+            const vector<int16_t> &fixed = gauss_kernel(radius);
+            for (int x=0; x <= 2*radius; x++) {
+                weights[x] = fixed[x] / (double) (1 << kernel_shift);
+            }
+        }
+        return weights;
+    };
+    vector<double> exact = kernel(radius), level = kernel(inner);
+    int reach = (inner + 2) * factor + radius; // Farthest offset either kernel has a weight at
+    vector<double> weights(2*reach+1);
+    double worst = 0;
+    for (int x=0; x < factor; x++) {
+        fill(weights.begin(), weights.end(), 0.0);
+        int block, weight;
+        pyramid_position(x, factor, &block, &weight);
+        for (int k=0; k < 2; k++) { // The blocks that are interpolated
+            double share = (k == 0 ? 2*factor - weight : weight) / (2.0 * factor);
+            for (int t=-inner; t <= inner; t++) {
+                for (int i=(block+k+t) * factor; i < (block+k+t+1) * factor; i++) {
+                    weights[i - x + reach] += share * level[t+inner] / factor;
                 }
-                new_img[pxl(width, height, i, j) + c] = (unsigned char) (sum / weight);
             }
         }
+        for (int d=-radius; d <= radius; d++) {
+            weights[d + reach] -= exact[d + radius];
+        }
+        double distance = 0;
+        for (double w : weights) {
+            distance += abs(w);
+        }
+        worst = max(worst, distance / 2);
     }
-    delete[] img;
-    delete[] tmp_img;
-    return new_img;
+    double bound = 255 * worst + (gauss ? 2 : 3); // The mean truncates its results, the gauss rounds them
+    lock_guard<mutex> lock(cache_mutex);
+    cache[make_tuple(gauss, radius, factor)] = bound;
+    return bound;
 }
 
+// Largest power of two the mean or gauss of a routine can be computed on an image downsampled by, within the error
+// the routine allows; 1 if it has to be computed exactly. The level keeps a radius of at least 1.
+int pyramid_factor(const routine &r) {
+    bool smoothing = r.kind == ROUTINE_MEAN_FILTER || r.kind == ROUTINE_GAUSS_FILTER
+                  || r.kind == ROUTINE_THRESHOLD_ADAPTIVE_MEAN || r.kind == ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+    int best = 1;
+    if (!smoothing || r.max_error <= 0) {
+        return best;
+    }
+    for (int factor=2; r.radius / factor >= 1; factor *= 2) {
+        if (pyramid_error(r, factor) <= r.max_error) {
+            best = factor;
+        }
+    }
+    return best;
+}
 
-// Nonlinear filter that takes the median over a square around each pixel
-// radius:  determines the size of the surrounding square in which the mean is calculated
-unsigned char* median_filter(unsigned char *img, int width, int height, int radius=1) {
-    if (radius > (width/2)-1 || radius > (height/2)-1) {
-        cerr << "Error: Radius too large for image." << endl;
-        return img;
+// Mean or gauss filter computed on a level of an image pyramid: blocks of factor x factor pixels are averaged into a
+// level, which the mean or gauss stage filters with radius/factor, and the filtered level is upsampled bilinearly.
+// Per pixel that is about factor^3 times less work than the exact filter for the same radius, see pyramid_error for
+// how far the result can be off. Blocks are averaged over the pixels inside the image, or with the pixels outside
+// as black if the border policy ignores them, like the exact filters count them.
+class pyramid_stage : public stage {
+public:
+    pyramid_stage(int width, int height, int channels, int radius, int factor, bool gauss, border_policy border)
+        : width(width), height(height), channels(channels), factor(factor), border(border),
+          level_width((width + factor - 1) / factor), level_height((height + factor - 1) / factor),
+          inner_radius(radius / factor), shift(0),
+          level(level_width, 2*inner_radius + 2, channels), filtered(level_width, 2, channels),
+          column_sum(width), widened((size_t) 2 * channels * width), left(width), right(width), weight(width) {
+        if (gauss) {
+            inner.reset(new gauss_stage(level_width, level_height, channels, inner_radius, border));
+        } else {
+            inner.reset(new mean_stage(level_width, level_height, channels, inner_radius, border));
+        }
+        while ((1 << shift) < 4*factor*factor) {
+            shift++;
+        }
+        for (int x=0; x < width; x++) { // Interpolation of every column, at the edges the outer block is repeated
+            int block, w;
+            pyramid_position(x, factor, &block, &w);
+            left[x] = min(max(block, 0), level_width-1);
+            right[x] = min(max(block+1, 0), level_width-1);
+            weight[x] = w;
+        }
     }
-    if (radius < 1)  {
-        cerr << "Error: Radius has to be at least 1." << endl;
-        return img;
+    // The level rows around the two that are interpolated, and the blocks they average
+    int halo() const { return (inner_radius + 3) * factor; }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        row_buffer level_rows(level.row(0, 0), level.stride, level_height, 2*inner_radius + 2);
+        row_buffer filtered_rows(filtered.row(0, 0), filtered.stride, level_height, 2);
+        int block, w;
+        pyramid_position(row, factor, &block, &w);
+        int upper = min(max(block, 0), level_height-1), lower = min(max(block+1, 0), level_height-1);
+        if (row != last_row+1) { // Start over with the rows the first filtered row needs
+            next_filtered = upper;
+            next_level = max(upper - inner_radius - 1, 0);
+        }
+        for (; next_filtered <= lower; next_filtered++) {
+            for (; next_level <= min(next_filtered + inner_radius, level_height-1); next_level++) {
+                downsample(in, next_level, level_rows);
+            }
+            inner->process(level_rows, next_filtered, filtered_rows);
+            for (int c=0; c < channels; c++) {
+                widen(filtered_rows.row(c, next_filtered), widened_row(c, next_filtered));
+            }
+        }
+        unsigned int a = 2*factor - w, b = w, half = 1u << (shift-1);
+        for (int c=0; c < channels; c++) {
+            const uint16_t *above = widened_row(c, upper), *below = widened_row(c, lower);
+            unsigned char *result = out.row(c, row);
+            for (int x=0; x < width; x++) {
+                result[x] = (a * above[x] + b * below[x] + half) >> shift;
+            }
+        }
+        last_row = row;
+    }
+private:
+    int width, height, channels, factor;
+    border_policy border;
+    int level_width, level_height, inner_radius;
+    int shift; // 4*factor*factor is 1 << shift
+    unique_ptr<stage> inner;
+    image level; // Ring of the rows of the level the inner stage needs
+    image filtered; // The two filtered rows of the level that are interpolated
+    pooled_array<unsigned int> column_sum;
+    pooled_array<uint16_t> widened; // The filtered rows interpolated horizontally, 2*factor times too large
+    pooled_array<int> left, right, weight;
+    int next_filtered = 0, next_level = 0;
+    int last_row = INT_MIN/2;
+
+    uint16_t* widened_row(int c, int Y) {
+        return widened.data() + ((size_t) 2*c + Y % 2) * width;
+    }
+    // Interpolates a filtered row of the level between the centers of its blocks, each filtered row is used for
+    // factor output rows or more
+    void widen(const unsigned char *row, uint16_t *out) {
+        for (int x=0; x < width; x++) {
+            out[x] = (2*factor - weight[x]) * row[left[x]] + weight[x] * row[right[x]];
+        }
+    }
+    // Averages the blocks of row Y of the level
+    void downsample(const row_buffer &in, int Y, const row_buffer &out) {
+        int first = Y * factor, rows = min(factor, height - first);
+        int full_blocks = rows == factor ? width / factor : 0;
+        int block_shift = (shift - 2) / 2 * 2; // factor*factor is 1 << block_shift
+        for (int c=0; c < channels; c++) {
+            fill(column_sum.data(), column_sum.data() + width, 0);
+            for (int y=first; y < first + rows; y++) {
+                add_row(column_sum.data(), in.row(c, y), width);
+            }
+            unsigned char *result = out.row(c, Y);
+            for (int X=0; X < full_blocks; X++) {
+                unsigned int sum = 0;
+                for (int x=X*factor; x < X*factor + factor; x++) {
+                    sum += column_sum[x];
+                }
+                result[X] = (sum + (1u << block_shift >> 1)) >> block_shift;
+            }
+            for (int X=full_blocks; X < level_width; X++) { // Blocks at the right and bottom edge
+                int columns = min(factor, width - X*factor);
+                unsigned int sum = 0;
+                for (int x=X*factor; x < X*factor + columns; x++) {
+                    sum += column_sum[x];
+                }
+                unsigned int count = border == BORDER_IGNORE ? factor*factor : rows * columns;
+                result[X] = (sum + count/2) / count;
+            }
+        }
     }
+};
 
-    size_t size = width*height*3;
-    unsigned char *new_img = new unsigned char[size];
+// Median of one row of a channel, adding and removing a whole column of the window to a histogram per pixel
+// Pixels the border policy leaves out count as white: the median walk stops at 255 if less than half of the window is
+// inside. rows is scratch space for the 2*radius+1 rows of the window.
+static void median_row_sliding(const row_buffer &in, int c, int i, unsigned char *out, int width, int height, int radius,
+                               border_policy border, const unsigned char **rows) {
     int n = (2*radius+1)*(2*radius+1);
-#pragma omp parallel for collapse (2)
-    for (int c=0; c < 3; c++) {
-        for (int i=0; i < height; i++) {
-            int hist[256] = {0};
-            for (int y=-radius; y <= radius; y++) { // Initialize first histogram
-                for (int x=0; x <= (radius-1); x++) { // The column x=radius will get filled in the first iteration, so we don't touch it here
-                    if (i+y < height && i+y >= 0) { // Ignore edges (happens in the first few and last few rows)
-                        hist[img[pxl(width, height, i+y, x) + c]]++;
-                    }
+    int hist[256] = {0};
+    int count = 0; // Rows of the window inside the image or replacing those outside of it
+    for (int y=-radius; y <= radius; y++) {
+        const unsigned char *row = in.row(c, border_index(i+y, height, border));
+        if (row != nullptr) {
+            rows[count++] = row;
+        }
+    }
+    int median = 0;
+    int pxls_below_median = 0;
+    auto update_column = [&](int x, int sign) { // Adds or removes column x of the window rows
+        if (x < 0) { // Left out by the border policy
+            return;
+        }
+        for (int y=0; y < count; y++) {
+            int val = rows[y][x];
+            hist[val] += sign;
+            if (val < median) {
+                pxls_below_median += sign;
+            }
+        }
+    };
+    for (int x=-radius-1; x <= (radius-1); x++) { // Window of the pixel left of the row, the first iteration moves it on
+        update_column(border_index(x, width, border), 1);
+    }
+    auto slide = [&](int j, int leaving, int entering) {
+        // UPDATE HISTOGRAM: the left column of the last window leaves, the right column of the current window enters
+        update_column(leaving, -1);
+        update_column(entering, 1);
+        // COMPUTE MEDIAN FROM HISTOGRAM:
+        if (pxls_below_median > n/2)  { // Median in this window is smaller than in the last
+            for (int bin=median-1; bin >= 0; bin--) { // Go down through the histogram
+                pxls_below_median -= hist[bin]; // Subtracting the number of pixels of each bin
+                if (pxls_below_median <= n/2) { // Until half the pixels are below the current bin
+                    median = bin; // Then that bin is the median
+                    break;
                 }
             }
-            int median = 0;
-            int pxls_below_median = 0;
-            for (int j=0; j < width; j++) { // Going over the pixels in one row
-                // UPDATE HISTOGRAM:
-                if (j-radius-1 >= 0) { // Make sure we're not in an edge case
-                    for (int y=-radius; y <= radius; y++) {
-                        if (i+y < height && i+y >= 0) {
-                            int val = img[pxl(width, height, i+y, j-radius-1) + c]; // Take the left column of the last window
-                            hist[val]--; // and remove it from the histogram
-                            if (val < median) {
-                                pxls_below_median--;
-                            }
-                        }
-                    }
+        } else { // Median in this window is greater than in the last
+            int bin = median;
+            while (bin < 255 && pxls_below_median + hist[bin] <= n/2) { // Until half the pixels are below the current bin, we go up through the histogram
+                pxls_below_median += hist[bin]; // Adding the number of pixels of each bin
+                bin++;
+            }
+            median = bin;
+        }
+        out[j] = median;
+    };
+    // Only windows at the ends of the row have columns outside of it
+    int j = 0;
+    for (; j < min(radius+1, width); j++) {
+        slide(j, border_index(j-radius-1, width, border), border_index(j+radius, width, border));
+    }
+    for (; j < width-radius; j++) {
+        slide(j, j-radius-1, j+radius);
+    }
+    for (; j < width; j++) {
+        slide(j, border_index(j-radius-1, width, border), border_index(j+radius, width, border));
+    }
+}
+
+// The sorting network only exists for radius 1, other radii fall back to the histograms
+static bool median_uses_network(int radius, median_algorithm algorithm) {
+    return radius == 1 && (algorithm == MEDIAN_AUTO || algorithm == MEDIAN_NETWORK);
+}
+
+static inline unsigned char median3(unsigned char a, unsigned char b, unsigned char c) {
+    return max(min(a, b), min(max(a, b), c));
+}
+
+// Median of one row for radius 1, with a sorting network instead of a histogram: the three samples of every column
+// are sorted once per row, and the median of a window is the median of the largest of its column minima, the median
+// of its column medians and the smallest of its column maxima. Rows above and below the image have to be white rows
+// or the rows the border policy replaces them with, columns is scratch space for 3*(width+2) samples.
+// Only minima and maxima, so both loops vectorize.
+static void median_row_network(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                               unsigned char *out, int width, border_policy border, unsigned char *columns) {
+    unsigned char *low = columns, *middle = columns + width+2, *high = columns + 2*(width+2);
+    for (int j=0; j < width; j++) {
+        unsigned char a = above[j], b = row[j], c = below[j];
+        low[j+1] = min(min(a, b), c);
+        middle[j+1] = median3(a, b, c);
+        high[j+1] = max(max(a, b), c);
+    }
+    for (int x : {-1, width}) { // Columns outside the image are white or copies of columns inside it
+        int source = border_index(x, width, border);
+        low[x+1] = source < 0 ? 255 : low[source+1];
+        middle[x+1] = source < 0 ? 255 : middle[source+1];
+        high[x+1] = source < 0 ? 255 : high[source+1];
+    }
+    for (int j=0; j < width; j++) {
+        out[j] = median3(max(max(low[j], low[j+1]), low[j+2]),
+                         median3(middle[j], middle[j+1], middle[j+2]),
+                         min(min(high[j], high[j+1]), high[j+2]));
+    }
+}
+
+// Adds the histogram of the column entering a window and subtracts the one of the column leaving it
+template <typename count, int bins>
+static inline void slide_histogram(count *hist, const uint16_t *entering, const uint16_t *leaving) {
+    for (int bin=0; bin < bins; bin++) {
+        hist[bin] += entering[bin] - leaving[bin];
+    }
+}
+
+
+// Median in constant time per pixel (Perreault and Hebert): every column keeps a histogram of its 2*radius+1
+// pixels in the window rows, so moving down a row only updates each column by two pixels, and moving right
+// adds and subtracts whole column histograms. Histograms have 256 fine and 16 coarse bins, the coarse ones find
+// the 16 fine bins that contain the median, and only those fine bins are brought up to date, which they mostly
+// already are since neighbouring pixels have similar medians. Gives the same result as median_row_sliding.
+// Window histograms count up to (2*radius+1)^2 pixels, so they use 16 bit bins as long as that fits
+// Rows and columns outside the image are white, or the histograms of those the border policy replaces them with.
+template <typename count>
+class median_constant {
+public:
+    median_constant(int width, int height, int channels, int radius, border_policy border)
+        : width(width), height(height), channels(channels), radius(radius), window(2*radius+1), border(border),
+          column_fine((size_t) channels*width*256), column_coarse((size_t) channels*width*16), white_fine(512, 0), white_coarse(32, 0),
+          last_row(channels, INT_MIN/2) {
+        white_fine[255] = white_coarse[15] = window;
+    }
+    // Filters the row of channel c, channels are independent and each has its own column histograms
+    void process(const row_buffer &in, int c, int row, unsigned char *out) {
+        fine_base = &column_fine[(size_t) c*width*256];
+        coarse_base = &column_coarse[(size_t) c*width*16];
+        if (row != last_row[c]+1) { // Column histograms of the window of the row above
+            fill(fine_base, fine_base + (size_t) width*256, 0);
+            fill(coarse_base, coarse_base + (size_t) width*16, 0);
+            for (int y=row-radius-1; y < row+radius; y++) {
+                const unsigned char *samples = in.row(c, border_index(y, height, border));
+                for (int j=0; j < width; j++) {
+                    add_sample(j, samples ? samples[j] : 255, 1);
                 }
-                if (j+radius < width) { // Make sure we're not in an edge case
-                    for (int y=-radius; y <= radius; y++) {
-                        if (i+y < height && i+y >= 0) {
-                            int val = img[pxl(width, height, i+y, j+radius) + c]; // Take the right column of the current window
-                            hist[val]++; // and add it to the histogram
-                            if (val < median) {
-                                pxls_below_median++;
-                            }
-                        }
-                    }
+            }
+        }
+        last_row[c] = row;
+        const unsigned char *leaving = in.row(c, border_index(row-radius-1, height, border));
+        const unsigned char *entering = in.row(c, border_index(row+radius, height, border));
+        const count half = window*window/2; // The median is the first value with more than half of the window at or below it
+        // Columns are moved down in tiles just ahead of the medians that need them, so their histograms are still in cache
+        const int tile_width = 128;
+        int moved = 0; // Columns moved down to this row so far
+        auto move_columns = [&](int until) {
+            for (; moved < min(until, width); moved++) { // Move the column histograms down by one row
+                add_sample(moved, leaving ? leaving[moved] : 255, -1);
+                add_sample(moved, entering ? entering[moved] : 255, 1);
+            }
+        };
+        move_columns(radius+2); // Reflected columns left of the row may be up to radius+1
+        count fine[256];
+        count coarse[16] = {};
+        int synced[16]; // Column whose window each 16-bin segment of fine was last brought up to date for
+        fill(synced, synced + 16, INT_MIN/2);
+        for (int x=-radius-1; x < radius; x++) { // Window of the pixel left of the row
+            slide_histogram<count, 16>(coarse, coarse_at(x), white_coarse.data() + 16);
+        }
+        for (int tile=0; tile < width; tile += tile_width) {
+            int tile_end = min(tile + tile_width, width);
+            move_columns(tile_end + radius);
+            for (int j=tile; j < tile_end; j++) {
+                // UPDATE HISTOGRAM: the right column of the window enters, the left column of the last window leaves
+                // Only the coarse bins are updated for every pixel, fine bins only where the median is looked for
+                slide_histogram<count, 16>(coarse, coarse_at(j+radius), coarse_at(j-radius-1));
+                // COMPUTE MEDIAN FROM HISTOGRAM: first the coarse bin, then the fine bin within it
+                int below = 0;
+                int bucket = 0;
+                while (below + coarse[bucket] <= half) {
+                    below += coarse[bucket];
+                    bucket++;
                 }
-                // COMPUTE MEDIAN FROM HISTOGRAM:
-                if (pxls_below_median > n/2)  { // Median in this window is smaller than in the last
-                    for (int bin=median-1; bin > 0; bin--) { // Go down through the histogram
-                        pxls_below_median -= hist[bin]; // Subtracting the number of pixels of each bin
-                        if (pxls_below_median <= n/2) { // Until half the pixels are below the current bin
-                            median = bin; // Then that bin is the median
-                            break;
-                        }
+                count *segment = fine + bucket*16;
+                if (j - synced[bucket] >= window) { // No column of the old window is left, so start over
+                    fill(segment, segment + 16, 0);
+                    for (int x=j-radius; x <= j+radius; x++) {
+                        slide_histogram<count, 16>(segment, fine_at(x) + bucket*16, white_fine.data() + 256);
                     }
-                } else { // Median in this window is greater than in the last
-                    int bin = median;
-                    while (pxls_below_median + hist[bin] <= n/2) { // Until half the pixels are below the current bin, we go up through the histogram
-                        pxls_below_median += hist[bin]; // Adding the number of pixels of each bin
-                        bin++;
+                } else {
+                    for (int x=synced[bucket]+1; x <= j; x++) {
+                        slide_histogram<count, 16>(segment, fine_at(x+radius) + bucket*16, fine_at(x-radius-1) + bucket*16);
                     }
-                    median = bin;
                 }
-                new_img[pxl(width, height, i, j) + c] = median;
+                synced[bucket] = j;
+                int bin = 0;
+                while (below + segment[bin] <= half) {
+                    below += segment[bin];
+                    bin++;
+                }
+                out[j] = bucket*16 + bin;
+            }
+        }
+    }
+private:
+    int width, height, channels, radius, window;
+    border_policy border;
+    pooled_array<uint16_t> column_fine, column_coarse; // Histograms of every column and channel
+    uint16_t *fine_base, *coarse_base; // Histograms of the columns of the current channel
+    vector<uint16_t> white_fine, white_coarse; // Histograms of a white column outside the image, followed by empty ones
+    vector<int> last_row; // Per channel
+
+    // Histograms of the column at j, columns outside the image are white unless the border policy replaces them
+    const uint16_t* fine_at(int j) const {
+        if (j < 0 || j >= width) {
+            int source = border_index(j, width, border);
+            return source < 0 ? white_fine.data() : fine_base + (size_t) source*256;
+        }
+        return fine_base + (size_t) j*256;
+    }
+    const uint16_t* coarse_at(int j) const {
+        if (j < 0 || j >= width) {
+            int source = border_index(j, width, border);
+            return source < 0 ? white_coarse.data() : coarse_base + (size_t) source*16;
+        }
+        return coarse_base + (size_t) j*16;
+    }
+    void add_sample(int j, int val, int sign) {
+        fine_base[(size_t) j*256 + val] += sign;
+        coarse_base[(size_t) j*16 + val/16] += sign;
+    }
+};
+
+// Nonlinear filter that takes the median over a square around each pixel
+// Radius 1 uses the sorting network, the constant-time algorithm is used from median_constant_radius on, where it
+// gets faster than the sliding one
+class median_stage : public stage {
+public:
+    median_stage(int width, int height, int channels, int radius, median_algorithm algorithm, border_policy border)
+        : width(width), height(height), channels(channels), radius(radius), border(border), window_rows(2*radius+1) {
+        if (median_uses_network(radius, algorithm)) {
+            columns.reset(new pooled_array<unsigned char>(3 * ((size_t) width+2)));
+            white.assign(width, 255);
+        } else if (algorithm == MEDIAN_CONSTANT || (algorithm == MEDIAN_AUTO && radius >= median_constant_radius)) {
+            if ((2*radius+1)*(2*radius+1) <= UINT16_MAX) {
+                constant16.reset(new median_constant<uint16_t>(width, height, channels, radius, border));
+            } else {
+                constant32.reset(new median_constant<uint32_t>(width, height, channels, radius, border));
+            }
+        }
+    }
+    int halo() const { return radius; }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        for (int c=0; c < channels; c++) {
+            if (columns) {
+                const unsigned char *above = in.row(c, border_index(row-1, height, border));
+                const unsigned char *below = in.row(c, border_index(row+1, height, border));
+                median_row_network(above ? above : white.data(), in.row(c, row), below ? below : white.data(),
+                                   out.row(c, row), width, border, columns->data());
+            } else if (constant16) {
+                constant16->process(in, c, row, out.row(c, row));
+            } else if (constant32) {
+                constant32->process(in, c, row, out.row(c, row));
+            } else {
+                median_row_sliding(in, c, row, out.row(c, row), width, height, radius, border, window_rows.data());
             }
         }
     }
-    delete[] img;
-    return new_img;
+private:
+    int width, height, channels, radius;
+    border_policy border;
+    vector<const unsigned char*> window_rows; // Scratch space of the sliding algorithm
+    unique_ptr<median_constant<uint16_t>> constant16;
+    unique_ptr<median_constant<uint32_t>> constant32;
+    unique_ptr<pooled_array<unsigned char>> columns; // Sorted columns of the sorting network
+    vector<unsigned char> white; // Stands in for the rows outside the image
+};
+
+// Nonlinear filter that takes the median over a square around each pixel
+// radius:  determines the size of the surrounding square in which the mean is calculated
+// algorithm:  MEDIAN_AUTO uses the sorting network for radius 1 and the constant-time filter for radii where it is faster
+// border:  what is taken for the pixels of the square outside the image
+void median_filter(image &img, int radius, median_algorithm algorithm, border_policy border) {
+    routine r;
+    r.kind = ROUTINE_MEDIAN_FILTER;
+    r.radius = radius;
+    r.algorithm = algorithm;
+    r.border = border;
+    run_pipeline(img, {r});
 }
 
 
+// Makes the pixels of a row white where white(j, intensity) is true and keeps the others
+// The intensity of a pixel is the mean of its channels
+// white is passed by value, so the compiler knows that writing result doesn't change anything it reads
+template <typename predicate>
+static void threshold_row(const unsigned char *const *samples, unsigned char *const *result, int channels, int width, predicate white) {
+    if (channels == 1) {
+        const unsigned char *gray = samples[0];
+        unsigned char *out = result[0];
+        for (int j=0; j < width; j++) {
+            out[j] = white(j, gray[j]) ? 255 : gray[j];
+        }
+        return;
+    }
+    const unsigned char *r = samples[0], *g = samples[1], *b = samples[2];
+    unsigned char *out_r = result[0], *out_g = result[1], *out_b = result[2];
+    for (int j=0; j < width; j++) { // Go over all pixels
+        bool is_white = white(j, (unsigned char) ((r[j] + g[j] + b[j]) / 3));
+        out_r[j] = is_white ? 255 : r[j];
+        out_g[j] = is_white ? 255 : g[j];
+        out_b[j] = is_white ? 255 : b[j];
+    }
+}
+
+// Nonlinear filter that makes a pixel white if it isn't darker than a specified threshold
+class threshold_stage : public stage {
+public:
+    threshold_stage(int width, int channels, int thresh) : width(width), channels(channels), thresh(thresh) {}
+    int halo() const { return 0; }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        const unsigned char *samples[3];
+        unsigned char *result[3];
+        for (int c=0; c < channels; c++) {
+            samples[c] = in.row(c, row);
+            result[c] = out.row(c, row);
+        }
+        int thresh = this->thresh;
+        threshold_row(samples, result, channels, width, [=](int, unsigned char pixel_intensity) {
+            return pixel_intensity > thresh;
+        });
+    }
+private:
+    int width, channels, thresh;
+};
+
+// A stage followed by a global threshold, which is applied to each of its output rows while they're still in the cache
+// instead of in a stage of its own (see plan_routines)
+class fused_threshold_stage : public stage {
+public:
+    fused_threshold_stage(unique_ptr<stage> routine_stage, int width, int channels, int thresh)
+        : routine_stage(move(routine_stage)), width(width), channels(channels), thresh(thresh) {}
+    int halo() const { return routine_stage->halo(); }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        routine_stage->process(in, row, out);
+        const unsigned char *samples[3];
+        unsigned char *result[3];
+        for (int c=0; c < channels; c++) {
+            samples[c] = result[c] = out.row(c, row);
+        }
+        int thresh = this->thresh;
+        threshold_row(samples, result, channels, width, [=](int, unsigned char pixel_intensity) {
+            return pixel_intensity > thresh;
+        });
+    }
+private:
+    unique_ptr<stage> routine_stage;
+    int width, channels, thresh;
+};
+
 // Nonlinear filter that makes a pixel white if it isn't darker than a specified threshold
 // thresh:  determines the threshold
-unsigned char* threshold(unsigned char *img, int width, int height, int thresh) {
-    size_t size = width*height*3;
-    unsigned char *new_img = new unsigned char[size];
+void threshold(image &img, int thresh) {
+    routine r;
+    r.kind = ROUTINE_THRESHOLD;
+    r.thresh = thresh;
+    run_pipeline(img, {r});
+}
 
-#pragma omp parallel for
-    for (int p=0; p < size; p+=3) { // Go over all pixels
-        unsigned int sum = 0;
-        for (int c=0; c < 3; c++) {
-            sum += img[p+c];
+
+// Counts the intensities of all pixels, the same intensities the thresholds compare
+// Every thread counts its rows into a histogram of its own, which are summed up at the end
+static void intensity_histogram(const image &img, uint64_t *histogram) {
+    fill(histogram, histogram + 256, 0);
+    int width = img.width, height = img.height, channels = img.channels;
+    #pragma omp parallel
+    {
+        uint64_t local[256] = {};
+        #pragma omp for schedule(static)
+        for (int i=0; i < height; i++) {
+            if (channels == 1) {
+                const unsigned char *gray = img.row(0, i);
+                for (int j=0; j < width; j++) {
+                    local[gray[j]]++;
+                }
+            } else {
+                const unsigned char *r = img.row(0, i), *g = img.row(1, i), *b = img.row(2, i);
+                for (int j=0; j < width; j++) {
+                    local[(r[j] + g[j] + b[j]) / 3]++;
+                }
+            }
         }
-        unsigned char pixel_intensity = (unsigned char) (sum / 3);
-        if (pixel_intensity > thresh) {
-            new_img[p] = 255;
-            new_img[p+1] = 255;
-            new_img[p+2] = 255;
-        } else {
-            new_img[p] = img[p];
-            new_img[p+1] = img[p+1];
-            new_img[p+2] = img[p+2];
+        #pragma omp critical
+        for (int v=0; v < 256; v++) {
+            histogram[v] += local[v];
+        }
+    }
+}
+
+// Otsu's method: the threshold that maximizes the variance between the pixels up to it and the ones above it
+static int otsu_threshold(const uint64_t *histogram) {
+    double total = 0, total_sum = 0;
+    for (int v=0; v < 256; v++) {
+        total += histogram[v];
+        total_sum += (double) v * histogram[v];
+    }
+    double below = 0, below_sum = 0, best_variance = -1;
+    int best = 0;
+    for (int t=0; t < 255; t++) {
+        below += histogram[t];
+        below_sum += (double) t * histogram[t];
+        double above = total - below;
+        if (below == 0 || above == 0) {
+            continue;
+        }
+        double difference = below_sum / below - (total_sum - below_sum) / above;
+        double variance = below * above * difference * difference;
+        if (variance > best_variance) {
+            best_variance = variance;
+            best = t;
+        }
+    }
+    return best;
+}
+
+// Triangle method: a line is drawn from the peak of the histogram to its far end on the side with the longer tail,
+// the threshold is the value whose count lies farthest below that line. Suits pages where the text is a small
+// peak or no peak at all next to the background.
+static int triangle_threshold(const uint64_t *histogram) {
+    int first = 0, last = 255, peak = 0;
+    while (first < 255 && histogram[first] == 0) {
+        first++;
+    }
+    while (last > 0 && histogram[last] == 0) {
+        last--;
+    }
+    for (int v=first; v <= last; v++) {
+        if (histogram[v] > histogram[peak]) {
+            peak = v;
         }
     }
-    delete[] img;
-    return new_img;
+    if (first >= last) {
+        return first;
+    }
+    bool dark_tail = peak - first >= last - peak;
+    int end = dark_tail ? first : last;
+    double height = histogram[peak], span = abs(peak - end);
+    double best_distance = -1;
+    int best = end;
+    for (int v=min(end, peak); v <= max(end, peak); v++) {
+        // Distance to the line from (end, 0) to (peak, height), up to a common factor
+        double distance = height * abs(v - end) / span - histogram[v];
+        if (distance > best_distance) {
+            best_distance = distance;
+            best = v;
+        }
+    }
+    return best;
+}
+
+// Picks a global threshold from a histogram of intensities
+int histogram_threshold(const uint64_t *histogram, threshold_method method) {
+    return method == THRESHOLD_TRIANGLE ? triangle_threshold(histogram) : otsu_threshold(histogram);
+}
+
+// Picks a global threshold for img from the histogram of its intensities
+int auto_threshold(const image &img, threshold_method method) {
+    profile_step step("histogram");
+    step.add_bytes_moved((double) img.width * img.height * img.channels);
+    uint64_t histogram[256];
+    intensity_histogram(img, histogram);
+    return histogram_threshold(histogram, method);
 }
 
+// Nonlinear filter that makes a pixel white if it isn't darker than a threshold chosen from the histogram of the image
+// Building the histogram takes one pass that only reads the image, the pixels are compared in the pipeline's sweep
+// method:  Otsu's method or the triangle method
+void threshold_auto(image &img, threshold_method method) {
+    routine r;
+    r.kind = ROUTINE_THRESHOLD_AUTO;
+    r.method = method;
+    run_pipeline(img, {r});
+}
+
+// Nonlinear filter that makes a pixel white if its not significantly darker than the (weighted) mean of its surrounding pixels
+// The mean comes from a mean or gauss stage over the same input rows
+class threshold_adaptive_stage : public stage {
+public:
+    threshold_adaptive_stage(int width, int channels, unique_ptr<stage> background, int C)
+        : width(width), channels(channels), background(move(background)), C(C), mean_row(width, channels, 1) {}
+    int halo() const { return background->halo(); }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        row_buffer tmp(mean_row.row(0, 0), mean_row.stride, INT_MAX, 1);
+        background->process(in, row, tmp); // Compute mean for each pixel
+        const unsigned char *samples[3], *mean[3] = {};
+        unsigned char *result[3];
+        for (int c=0; c < channels; c++) {
+            samples[c] = in.row(c, row);
+            mean[c] = tmp.row(c, row);
+            result[c] = out.row(c, row);
+        }
+        int C = this->C, channels = this->channels;
+        const unsigned char *mean_r = mean[0], *mean_g = mean[channels == 3 ? 1 : 0], *mean_b = mean[channels == 3 ? 2 : 0];
+        threshold_row(samples, result, channels, width, [=](int j, unsigned char pixel_intensity) {
+            unsigned char mean_intensity = channels == 1 ? mean_r[j] : (mean_r[j] + mean_g[j] + mean_b[j]) / 3;
+            return pixel_intensity > mean_intensity-C;
+        });
+    }
+private:
+    int width, channels;
+    unique_ptr<stage> background;
+    int C;
+    image mean_row;
+};
 
 // Nonlinear filter that makes a pixel white if its not significantly darker than the mean of its surrounding pixels
 // radius:  determines the size of the surrounding square in which the mean is calculated
 // C:       determines how much darker than the mean a pixel has to be
-unsigned char* threshold_adaptive_mean(unsigned char *img, int width, int height, int radius=5, int C=10) {
-    if (radius < 1) {
-        cerr << "Error: Radius has to be at least 1" << endl;
-        return img;
+// border:  what the mean takes for the pixels of the square outside the image
+// max_error: levels the result may be off by if it's computed on a downsampled image (see pyramid_factor), 0 for exact
+void threshold_adaptive_mean(image &img, int radius, int C, border_policy border, int max_error) {
+    routine r;
+    r.kind = ROUTINE_THRESHOLD_ADAPTIVE_MEAN;
+    r.radius = radius;
+    r.C = C;
+    r.border = border;
+    r.max_error = max_error;
+    run_pipeline(img, {r});
+}
+
+// Nonlinear filter that makes a pixel white if its not significantly darker than the gaussian-weighted mean of its surrounding pixels
+// radius:  determines the size of the surrounding square in which the mean is calculated
+// C:       determines how much darker than the mean a pixel has to be
+// border:  what the mean takes for the pixels of the square outside the image
+// max_error: levels the result may be off by if it's computed on a downsampled image (see pyramid_factor), 0 for exact
+void threshold_adaptive_gauss(image &img, int radius, int C, border_policy border, int max_error) {
+    routine r;
+    r.kind = ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+    r.radius = radius;
+    r.C = C;
+    r.border = border;
+    r.max_error = max_error;
+    run_pipeline(img, {r});
+}
+
+
+// Sums of the first j entries of values, for j from 0 to width
+template <typename sum_type, typename value_type>
+static void prefix_sums(const value_type *values, sum_type *prefix, int width) {
+    prefix[0] = 0;
+    for (int j=0; j < width; j++) {
+        prefix[j+1] = prefix[j] + values[j];
     }
-    if (radius > (width/2)-1 || radius > (height/2)-1) {
-        cerr << "Error: Radius too large for image." << endl;
-        return img;
-    }
-
-    size_t size = width*height*3;
-    unsigned char *copy = new unsigned char[size];
-    unsigned char *tmp = new unsigned char[size];
-    memcpy(copy, img, size); // Need both img and temp later, but mean_filter deletes img, so we copy
-    tmp = mean_filter(img, width, height, radius); // Compute mean for each pixel
-    unsigned char *new_img = new unsigned char[size];
-
-#pragma omp parallel for
-    for (int p=0; p < size; p+=3) { // Go over all pixels
-        unsigned char mean_intensity = (tmp[p] + tmp[p+1] + tmp[p+2]) / 3;
-        unsigned char pixel_intensity = (copy[p] + copy[p+1] + copy[p+2]) / 3;
-        if (pixel_intensity > mean_intensity-C) {
-            new_img[p] = 255;
-            new_img[p+1] = 255;
-            new_img[p+2] = 255;
+}
+
+// Thresholds of the samples from begin to end of a row from the prefix sums and squared prefix sums of its windows
+// sauvola: mean * (1 + k * (deviation / 128 - 1)), otherwise (bradley): mean * (1 - k)
+template <bool sauvola>
+static void local_thresholds(const uint64_t *sum, const uint64_t *squares, double *limit, int begin, int end,
+                             int width, int radius, int rows, double k) {
+    for (int j=begin; j < end; j++) {
+        int lo = max(j-radius, 0), hi = min(j+radius+1, width);
+        double n = (double) (hi-lo) * rows;
+        double mean = (sum[hi] - sum[lo]) / n;
+        if (sauvola) {
+            double variance = (squares[hi] - squares[lo]) / n - mean*mean;
+            limit[j] = mean * (1 + k * (sqrt(max(variance, 0.0)) / 128 - 1));
         } else {
-            new_img[p] = copy[p];
-            new_img[p+1] = copy[p+1];
-            new_img[p+2] = copy[p+2];
+            limit[j] = mean * (1 - k);
         }
     }
-    delete[] copy;
-    delete[] tmp;
-    return new_img;
 }
 
-// Nonlinear filter that makes a pixel white if its not significantly darker than the gaussian-weighted mean of its surrounding pixels
+// Thresholds of a whole row, windows are clipped to the image
+// In the interior of the row every window is complete, the loop without clipping vectorizes
+template <bool sauvola>
+static void local_thresholds(const uint64_t *sum, const uint64_t *squares, double *limit, int width, int radius,
+                             int rows, double k) {
+    int interior_begin = min(radius, width), interior_end = max(width-radius, interior_begin);
+    local_thresholds<sauvola>(sum, squares, limit, 0, interior_begin, width, radius, rows, k);
+    double n = (double) (2*radius+1) * rows;
+    for (int j=interior_begin; j < interior_end; j++) {
+        double mean = (sum[j+radius+1] - sum[j-radius]) / n;
+        if (sauvola) {
+            double variance = (squares[j+radius+1] - squares[j-radius]) / n - mean*mean;
+            limit[j] = mean * (1 + k * (sqrt(max(variance, 0.0)) / 128 - 1));
+        } else {
+            limit[j] = mean * (1 - k);
+        }
+    }
+    local_thresholds<sauvola>(sum, squares, limit, interior_end, width, width, radius, rows, k);
+}
+
+// Nonlinear filter that makes a pixel white if it isn't darker than a threshold derived from the statistics of the
+// square around it: Sauvola's threshold uses the mean and standard deviation, so that pale text on an unevenly lit page
+// keeps its contrast; Bradley's only takes a percentage off the mean.
+// The sums of intensities and squared intensities of each window come from a rolling integral image: running column
+// sums over the rows of the window, updated with the row that enters and the one that leaves, and prefix sums over
+// these columns. The cost per pixel doesn't depend on the radius. Windows are clipped to the image.
+class threshold_local_stage : public stage {
+public:
+    threshold_local_stage(int width, int height, int channels, int radius, int k, bool sauvola)
+        : width(width), height(height), channels(channels), radius(radius), k(k / 100.0), sauvola(sauvola),
+          intensities(width, channels == 1 ? 1 : 2*radius+2, 1), sum(width), squares(width), sum_prefix(width+1),
+          squares_prefix(width+1), limit(width) {}
+    int halo() const { return radius; }
+    void process(const row_buffer &in, int row, const row_buffer &out) {
+        if (row != last_row+1) { // Start over with the whole window
+            fill(sum.begin(), sum.end(), 0);
+            fill(squares.begin(), squares.end(), 0);
+            for (int y=max(row-radius, 0); y <= min(row+radius, height-1); y++) {
+                add_column_sums(sum.data(), squares.data(), intensity_row(in, y, true), width);
+            }
+        } else {
+            if (row+radius < height) {
+                add_column_sums(sum.data(), squares.data(), intensity_row(in, row+radius, true), width);
+            }
+            if (row-radius-1 >= 0) {
+                subtract_column_sums(sum.data(), squares.data(), intensity_row(in, row-radius-1, false), width);
+            }
+        }
+        last_row = row;
+        int rows = min(row+radius, height-1) - max(row-radius, 0) + 1;
+        prefix_sums(sum.data(), sum_prefix.data(), width);
+        if (sauvola) {
+            prefix_sums(squares.data(), squares_prefix.data(), width);
+        }
+        if (sauvola) {
+            local_thresholds<true>(sum_prefix.data(), squares_prefix.data(), limit.data(), width, radius, rows, k);
+        } else {
+            local_thresholds<false>(sum_prefix.data(), squares_prefix.data(), limit.data(), width, radius, rows, k);
+        }
+        const unsigned char *samples[3];
+        unsigned char *result[3];
+        for (int c=0; c < channels; c++) {
+            samples[c] = in.row(c, row);
+            result[c] = out.row(c, row);
+        }
+        const double *limit = this->limit.data();
+        threshold_row(samples, result, channels, width, [=](int j, unsigned char pixel_intensity) {
+            return pixel_intensity > limit[j];
+        });
+    }
+private:
+    int width, height, channels, radius;
+    double k;
+    bool sauvola;
+    image intensities; // Ring of the intensities of the window's rows and the row above it, unused for grayscale
+    pooled_array<uint32_t> sum; // Running sums of the intensities of each column over the rows of the window
+    pooled_array<uint64_t> squares;
+    pooled_array<uint64_t> sum_prefix, squares_prefix;
+    pooled_array<double> limit;
+    int last_row = INT_MIN/2;
+
+    static void add_column_sums(uint32_t *sum, uint64_t *squares, const unsigned char *row, int width) {
+        for (int j=0; j < width; j++) {
+            sum[j] += row[j];
+            squares[j] += row[j] * row[j];
+        }
+    }
+    static void subtract_column_sums(uint32_t *sum, uint64_t *squares, const unsigned char *row, int width) {
+        for (int j=0; j < width; j++) {
+            sum[j] -= row[j];
+            squares[j] -= row[j] * row[j];
+        }
+    }
+    // Intensities of row y of the input, computed when it enters the window and looked up when it leaves
+    const unsigned char* intensity_row(const row_buffer &in, int y, bool entering) {
+        if (channels == 1) {
+            return in.row(0, y);
+        }
+        unsigned char *gray = intensities.row(0, y % (2*radius+2));
+        if (entering) {
+            const unsigned char *r = in.row(0, y), *g = in.row(1, y), *b = in.row(2, y);
+            for (int j=0; j < width; j++) {
+                gray[j] = (r[j] + g[j] + b[j]) / 3;
+            }
+        }
+        return gray;
+    }
+};
+
+// Nonlinear filter that makes a pixel white unless it is darker than mean * (1 + k * (deviation / 128 - 1)),
+// with the mean and standard deviation of the intensities in the square around it
+// radius:  determines the size of the surrounding square
+// k:       in percent, determines how much a high contrast raises the threshold
+void threshold_sauvola(image &img, int radius, int k) {
+    routine r;
+    r.kind = ROUTINE_THRESHOLD_SAUVOLA;
+    r.radius = radius;
+    r.k = k;
+    run_pipeline(img, {r});
+}
+
+// Nonlinear filter that makes a pixel white unless it is more than t percent darker than the mean of the square around it
 // radius:  determines the size of the surrounding square in which the mean is calculated
-// C:       determines how much darker than the mean a pixel has to be
-unsigned char* threshold_adaptive_gauss(unsigned char *img, int width, int height, int radius=5, int C=10) {
-    if (radius < 1)  {
+// t:       in percent, determines how much darker than the mean a pixel has to be
+void threshold_bradley(image &img, int radius, int t) {
+    routine r;
+    r.kind = ROUTINE_THRESHOLD_BRADLEY;
+    r.radius = radius;
+    r.k = t;
+    run_pipeline(img, {r});
+}
+
+
+// Checks the parameters of a routine for an image, reports why it can't be applied
+bool valid_routine(const routine &r, int width, int height) {
+    if (r.kind == ROUTINE_THRESHOLD || r.kind == ROUTINE_THRESHOLD_AUTO) {
+        return true;
+    }
+    if (r.kind == ROUTINE_DESKEW) {
+        if (r.angle < 1 || r.angle > 45) {
+            cerr << "Error: The angle of " << deskew_id << " has to be between 1 and 45 degrees." << endl;
+            return false;
+        }
+        return true;
+    }
+    if (r.radius < 1)  {
         cerr << "Error: Radius has to be at least 1." << endl;
-        return img;
+        return false;
     }
-    if (radius > (width/2)-1 || radius > (height/2)-1) {
+    if (r.radius > (width/2)-1 || r.radius > (height/2)-1) {
         cerr << "Error: Radius too large for image." << endl;
-        return img;
-    }
-
-    size_t size = width*height*3;
-    unsigned char *copy = new unsigned char[size];
-    unsigned char *tmp = new unsigned char[size];
-    memcpy(copy, img, size); // Need both img and temp later, but mean_filter deletes img, so we copy
-    tmp = gauss_filter(img, width, height, radius); // Compute gaussian-weighted mean for each pixel
-    unsigned char *new_img = new unsigned char[size];
-
-#pragma omp parallel for
-    for (int p=0; p < size; p+=3) { // Go over all pixels
-        unsigned char mean_intensity = (tmp[p] + tmp[p+1] + tmp[p+2]) / 3;
-        unsigned char pixel_intensity = (copy[p] + copy[p+1] + copy[p+2]) / 3;
-        if (pixel_intensity > mean_intensity-C) {
-            new_img[p] = 255;
-            new_img[p+1] = 255;
-            new_img[p+2] = 255;
-        } else {
-            new_img[p] = copy[p];
-            new_img[p+1] = copy[p+1];
-            new_img[p+2] = copy[p+2];
+        return false;
+    }
+    return true;
+}
+
+// Rows above and below an output row that a routine needs
+int routine_halo(const routine &r) {
+    if (r.kind == ROUTINE_THRESHOLD || r.kind == ROUTINE_THRESHOLD_AUTO || r.kind == ROUTINE_DESKEW) {
+        return 0;
+    }
+    int factor = pyramid_factor(r);
+    return factor > 1 ? (r.radius / factor + 3) * factor : r.radius; // See pyramid_stage::halo
+}
+
+// Bytes a stage of the routine allocates for an image width, roughly: the rings of rows it keeps and its histograms
+size_t routine_memory(const routine &r, int width, int channels) {
+    size_t row = ((size_t) width + 63) / 64 * 64 * channels;
+    size_t window_rows = 2 * (size_t) r.radius + 2;
+    int factor = pyramid_factor(r);
+    if (factor > 1) { // The stage on the level, its rings of level rows, and the sums and tables of the columns
+        routine level = r;
+        level.radius = r.radius / factor;
+        level.max_error = 0;
+        int level_width = (width + factor - 1) / factor;
+        size_t level_row = ((size_t) level_width + 63) / 64 * 64 * channels;
+        return routine_memory(level, level_width, channels) + (2 * (size_t) level.radius + 4) * level_row
+             + (size_t) width * 16;
+    }
+    switch (r.kind) {
+    case ROUTINE_MEAN_FILTER:
+    case ROUTINE_GAUSS_FILTER:
+    case ROUTINE_THRESHOLD_ADAPTIVE_MEAN:
+    case ROUTINE_THRESHOLD_ADAPTIVE_GAUSS:
+        return window_rows * row + (size_t) width * channels * 8;
+    case ROUTINE_MEDIAN_FILTER: {
+        bool constant = r.algorithm == MEDIAN_CONSTANT || (r.algorithm == MEDIAN_AUTO && r.radius >= median_constant_radius);
+        size_t bin = (2*r.radius+1)*(2*r.radius+1) <= UINT16_MAX ? 2 : 4;
+        if (median_uses_network(r.radius, r.algorithm)) {
+            return (size_t) width * 4;
         }
+        return constant ? (size_t) width * channels * (256+16) * bin : (size_t) 256 * 4;
+    }
+    case ROUTINE_THRESHOLD_SAUVOLA:
+    case ROUTINE_THRESHOLD_BRADLEY:
+        return (channels == 1 ? 0 : window_rows * row / channels) + (size_t) width * 44;
+    default:
+        return 0;
+    }
+}
+
+// Name of a routine as the user invokes it, followed by its parameters and a threshold fused into it
+string routine_name(const routine &r) {
+    if (r.fused_thresh >= 0) {
+        routine alone = r;
+        alone.fused_thresh = -1;
+        return routine_name(alone) + " + " + threshold_id + " " + to_string(r.fused_thresh);
+    }
+    switch (r.kind) {
+    case ROUTINE_MEAN_FILTER:
+        return mean_filter_id + " " + to_string(r.radius);
+    case ROUTINE_GAUSS_FILTER:
+        return gauss_filter_id + " " + to_string(r.radius);
+    case ROUTINE_MEDIAN_FILTER:
+        return median_filter_id + " " + to_string(r.radius);
+    case ROUTINE_THRESHOLD:
+        return threshold_id + " " + to_string(r.thresh);
+    case ROUTINE_THRESHOLD_ADAPTIVE_MEAN:
+        return threshold_adaptive_mean_id + " " + to_string(r.radius) + " " + to_string(r.C);
+    case ROUTINE_THRESHOLD_ADAPTIVE_GAUSS:
+        return threshold_adaptive_gauss_id + " " + to_string(r.radius) + " " + to_string(r.C);
+    case ROUTINE_THRESHOLD_AUTO:
+        return threshold_auto_id + " " + (r.method == THRESHOLD_TRIANGLE ? triangle_id : otsu_id);
+    case ROUTINE_THRESHOLD_SAUVOLA:
+        return threshold_sauvola_id + " " + to_string(r.radius) + " " + to_string(r.k);
+    case ROUTINE_DESKEW:
+        return deskew_id + " " + to_string(r.angle);
+    default:
+        return threshold_bradley_id + " " + to_string(r.radius) + " " + to_string(r.k);
+    }
+}
+
+// Stage of the mean or gauss filter of a routine, on a pyramid level if the error the routine allows is large enough
+static unique_ptr<stage> smoothing_stage(const routine &r, int width, int height, int channels) {
+    int factor = pyramid_factor(r);
+    if (factor > 1) {
+        return unique_ptr<stage>(new pyramid_stage(width, height, channels, r.radius, factor, gauss_background(r), r.border));
+    } else if (gauss_background(r)) {
+        return unique_ptr<stage>(new gauss_stage(width, height, channels, r.radius, r.border));
     }
-    delete[] copy;
-    delete[] tmp;
-    return new_img;
-}
\ No newline at end of file
+    return unique_ptr<stage>(new mean_stage(width, height, channels, r.radius, r.border));
+}
+
+// Creates the stage that applies a routine, and the threshold fused into it, to the rows of an image
+unique_ptr<stage> make_stage(const routine &r, int width, int height, int channels) {
+    unique_ptr<stage> routine_stage;
+    switch (r.kind) {
+        case ROUTINE_MEAN_FILTER:
+        case ROUTINE_GAUSS_FILTER:
+            routine_stage = smoothing_stage(r, width, height, channels);
+            break;
+        case ROUTINE_MEDIAN_FILTER:
+            routine_stage.reset(new median_stage(width, height, channels, r.radius, r.algorithm, r.border));
+            break;
+        case ROUTINE_THRESHOLD:
+        case ROUTINE_THRESHOLD_AUTO: // run_pipeline has chosen its threshold
+            routine_stage.reset(new threshold_stage(width, channels, r.thresh));
+            break;
+        case ROUTINE_THRESHOLD_ADAPTIVE_MEAN:
+        case ROUTINE_THRESHOLD_ADAPTIVE_GAUSS:
+            routine_stage.reset(new threshold_adaptive_stage(width, channels, smoothing_stage(r, width, height, channels), r.C));
+            break;
+        case ROUTINE_THRESHOLD_SAUVOLA:
+            routine_stage.reset(new threshold_local_stage(width, height, channels, r.radius, r.k, true));
+            break;
+        case ROUTINE_THRESHOLD_BRADLEY:
+            routine_stage.reset(new threshold_local_stage(width, height, channels, r.radius, r.k, false));
+            break;
+        case ROUTINE_DESKEW: // Rotates the whole image, run_pipeline applies it between the sweeps
+            return nullptr;
+    }
+    if (r.fused_thresh >= 0) {
+        return unique_ptr<stage>(new fused_threshold_stage(move(routine_stage), width, channels, r.fused_thresh));
+    }
+    return routine_stage;
+}
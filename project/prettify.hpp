@@ -1,4 +1,9 @@
+#pragma once
 #include <string>
+#include <cstdint>
+#include <memory>
+#include "image.hpp"
+#include "convolve.hpp"
 using namespace std;
 
 extern const string mean_filter_id; // Names of the routines the user can invoke
@@ -7,12 +12,108 @@ extern const string median_filter_id;
 extern const string threshold_id;
 extern const string threshold_adaptive_mean_id;
 extern const string threshold_adaptive_gauss_id;
+extern const string threshold_sauvola_id;
+extern const string threshold_bradley_id;
+extern const string threshold_auto_id;
+extern const string deskew_id;
+extern const string otsu_id; // Names of the methods threshold_auto can use
+extern const string triangle_id;
+extern const string border_ignore_id; // Names of the border policies of the filters
+extern const string border_replicate_id;
+extern const string border_reflect_id;
+bool parse_border(const char *text, border_policy *border);
 
-unsigned char* read_image(char filename[], unsigned char *img, int *width, int *height);
-void write_image(char filename[], unsigned char *img, int width, int height);
-unsigned char* mean_filter(unsigned char *img, int width, int height, int radius);
-unsigned char* gauss_filter(unsigned char *img, int width, int height, int radius);
-unsigned char* median_filter(unsigned char *img, int width, int height, int radius);
-unsigned char* threshold(unsigned char *img, int width, int height, int thresh);
-unsigned char* threshold_adaptive_mean(unsigned char *img, int width, int height, int radius, int C);
-unsigned char* threshold_adaptive_gauss(unsigned char *img, int width, int height, int radius, int C);
\ No newline at end of file
+// Encodings write_image can produce. Pbm and tiff (CCITT group 4) store one bit per pixel, black below
+// bilevel_threshold, for binarized pages; png and tiff are compressed, see compress.hpp.
+enum image_format { FORMAT_P3, FORMAT_P5, FORMAT_P6, FORMAT_PAM, FORMAT_PBM, FORMAT_PNG, FORMAT_TIFF };
+const int bilevel_threshold = 128;
+extern const string format_p3_id; // Names of the output formats the user can choose
+extern const string format_p5_id;
+extern const string format_p6_id;
+extern const string format_pam_id;
+extern const string format_pbm_id;
+extern const string format_png_id;
+extern const string format_tiff_id;
+bool parse_format(const char *text, image_format *format);
+bool gray_format(image_format format);
+string format_extension(image_format format);
+
+image read_image(char filename[]);
+image decode_image(const unsigned char *data, size_t size, const char *name);
+bool read_image_size(char filename[], int *width, int *height);
+void set_verbose(bool enabled);
+void write_image(char filename[], const image &img, image_format format=FORMAT_P3);
+
+// Reads an image file one row after the other, for images that are processed in strips
+class raster_reader {
+public:
+    int width = 0;
+    int height = 0;
+    int channels = 0; // Planes the pixels of the file have: 1 for grayscale, 3 for color, alpha is dropped
+
+    raster_reader() {}
+    raster_reader(const raster_reader&) = delete;
+    raster_reader& operator=(const raster_reader&) = delete;
+    ~raster_reader();
+    bool open(char filename[]);
+    bool read_row(unsigned char *const *planes, int planes_count);
+    int image_planes() const;
+private:
+    void *mapping = nullptr;
+    size_t file_size = 0;
+    const unsigned char *pos = nullptr, *end = nullptr;
+    const unsigned char *released = nullptr; // Start of the part of the mapping that wasn't given back yet
+    char magic = 0;
+    long depth = 0, maxVal = 0;
+    size_t row_size = 0; // Bytes of a row of a binary raster
+    int next_row = 0;
+    pooled_array<unsigned char> samples; // Interleaved samples of a row of a P3 file
+    image color; // A row of a color file that is converted to intensities
+};
+
+class chunk_encoder;
+
+// Writes an image file a strip of rows at a time, write_image writes all rows at once
+class raster_writer {
+public:
+    raster_writer();
+    raster_writer(const raster_writer&) = delete;
+    raster_writer& operator=(const raster_writer&) = delete;
+    ~raster_writer();
+    bool open(char filename[], int width, int height, image_format format, int channels=3);
+    bool open(int descriptor, int width, int height, image_format format, bool owned=false, int channels=3);
+    bool write_rows(const image &img, int first, int count);
+    bool close();
+    size_t bytes_written() const;
+    static size_t formatted_row_size(int width, image_format format);
+private:
+    int fd = -1;
+    bool owns_fd = false;
+    int width = 0, height = 0;
+    image_format format = FORMAT_P3;
+    bool failed = false;
+    size_t written = 0;
+    unique_ptr<chunk_encoder> encoder; // For the compressed formats
+};
+image_format format_from_filename(char filename[]);
+void mean_filter(image &img, int radius, border_policy border=BORDER_IGNORE, int max_error=0);
+void gauss_filter(image &img, int radius, border_policy border=BORDER_IGNORE, int max_error=0);
+enum median_algorithm { MEDIAN_AUTO, MEDIAN_SLIDING, MEDIAN_CONSTANT, MEDIAN_NETWORK }; // How median_filter finds medians
+const int median_constant_radius = 4; // Smallest radius MEDIAN_AUTO uses the constant-time algorithm for
+
+void median_filter(image &img, int radius, median_algorithm algorithm=MEDIAN_AUTO, border_policy border=BORDER_IGNORE);
+void threshold(image &img, int thresh);
+enum threshold_method { THRESHOLD_OTSU, THRESHOLD_TRIANGLE }; // How threshold_auto picks the threshold from the histogram
+int histogram_threshold(const uint64_t *histogram, threshold_method method);
+int auto_threshold(const image &img, threshold_method method);
+void threshold_auto(image &img, threshold_method method=THRESHOLD_OTSU);
+void threshold_adaptive_mean(image &img, int radius, int C, border_policy border=BORDER_IGNORE, int max_error=0);
+void threshold_adaptive_gauss(image &img, int radius, int C, border_policy border=BORDER_IGNORE, int max_error=0);
+const int sauvola_default_k = 20; // Percent, see threshold_sauvola
+const int bradley_default_t = 15;
+void threshold_sauvola(image &img, int radius, int k=sauvola_default_k);
+void threshold_bradley(image &img, int radius, int t=bradley_default_t);
+const int deskew_default_angle = 5; // Degrees, see deskew
+double skew_angle(const image &img, int max_angle=deskew_default_angle);
+void rotate(image &img, double degrees);
+void deskew(image &img, int max_angle=deskew_default_angle);
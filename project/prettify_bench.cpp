@@ -0,0 +1,681 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <omp.h>
+#include <sys/stat.h>
+#include "prettify.hpp"
+#include "pipeline.hpp"
+#include "convolve.hpp"
+#include "threading.hpp"
+#include "stream.hpp"
+
+using namespace std;
+
+// Benchmarks for the routines of prettify, run from the build directory like the tests
+// Usage: prettify_bench [--json file] [--quick] [--bind none|close|spread] [suites], with suites being any of: io mean wide
+// median specialized planes routines formats scaling pyramid overlap deskew
+// Every measurement is repeated and reported with its standard deviation, --json also writes all of them to file
+// so that runs of different versions can be compared. --quick only uses the smallest resolution.
+
+// The iostream-based P3 reader prettify used before, kept as a baseline
+unsigned char* legacy_read_p3(char filename[], int *width, int *height) {
+    ifstream img_file;
+    img_file.open(filename, ios::in);
+    string format;
+    img_file >> format;
+    int maxVal;
+    img_file >> *width >> *height >> maxVal;
+    size_t size = (size_t) (*width) * (*height) * 3;
+    unsigned char *img = new unsigned char[size];
+    unsigned int currentVal;
+    for (size_t i=0; i < size; i++) {
+        img_file >> currentVal;
+        img[i] = (char) currentVal;
+    }
+    img_file.close();
+    return img;
+}
+
+// The iostream-based P3 writer prettify used before, kept as a baseline
+void legacy_write_p3(char filename[], unsigned char *img, int width, int height) {
+    ofstream img_file;
+    img_file.open(filename, ios::out);
+    img_file << "P3" << endl << width << " " << height << endl << 255 << endl;
+    for (int i=0; i < height; i++) {
+        for (int j=0; j < width*3; j++) {
+            img_file << (unsigned) img[(size_t) i*width*3 + j] << " ";
+        }
+        img_file << endl;
+    }
+    img_file.close();
+}
+
+// Creates a grayscale scan-like image: a noisy white page with dark lines of "text" and a shadow at the left edge
+image synthetic_scan(int width, int height) {
+    image img(width, height, 1);
+    unsigned int seed = 12345;
+    for (int i=0; i < height; i++) {
+        for (int j=0; j < width; j++) {
+            seed = seed * 1103515245 + 12345;
+            int val = 235 + (seed >> 16) % 20; // Paper with slight noise
+            if (j < width/10) { // Shadow of the book binding
+                val = val * (j + width/10) / (width/5);
+            }
+            if ((i/12) % 3 == 1 && (j/7) % 5 != 0 && (seed >> 8) % 3 != 0) { // Lines of letters
+                val = 30 + (seed >> 20) % 40;
+            }
+            img.row(0, i)[j] = val;
+        }
+    }
+    return img;
+}
+
+size_t file_size(char filename[]) {
+    struct stat file_stat;
+    if (stat(filename, &file_stat) != 0) {
+        return 0;
+    }
+    return file_stat.st_size;
+}
+
+// Seconds per run of a measurement, over all its runs
+struct timing {
+    double mean = 0;
+    double stddev = 0;
+    int runs = 0;
+};
+
+const int min_runs = 5; // Runs of every measurement at least, to estimate its variance
+
+timing summarize(const vector<double> &seconds) {
+    timing t;
+    t.runs = seconds.size();
+    for (double s : seconds) {
+        t.mean += s;
+    }
+    t.mean /= t.runs;
+    for (double s : seconds) {
+        t.stddev += (s - t.mean) * (s - t.mean);
+    }
+    t.stddev = t.runs > 1 ? sqrt(t.stddev / (t.runs - 1)) : 0;
+    return t;
+}
+
+// Runs f at least min_runs times and until at least min_time seconds have passed
+template <typename F>
+timing time_per_run(F f, double min_time=0.5) {
+    vector<double> seconds;
+    double elapsed = 0;
+    do {
+        auto start = omp_get_wtime();
+        f();
+        seconds.push_back(omp_get_wtime() - start);
+        elapsed += seconds.back();
+    } while (elapsed < min_time || (int) seconds.size() < min_runs);
+    return summarize(seconds);
+}
+
+// Applies a routine to fresh copies of img at least min_runs times and until at least min_time seconds were spent in it
+// The routines replace the image they're given, so copying it is part of each run but not of the measured time
+template <typename F>
+timing time_routine(const image &img, F routine, double min_time=0.5) {
+    vector<double> seconds;
+    double elapsed = 0;
+    do {
+        image copy = img.clone();
+        auto start = omp_get_wtime();
+        routine(copy);
+        seconds.push_back(omp_get_wtime() - start);
+        elapsed += seconds.back();
+    } while (elapsed < min_time || (int) seconds.size() < min_runs);
+    return summarize(seconds);
+}
+
+// One measurement for the json report
+struct result {
+    string suite;
+    string name;
+    string variant;
+    int width, height;
+    int radius; // 0 where it doesn't apply
+    int threads;
+    double bytes; // Bytes processed per run, 0 where throughput is counted in pixels only
+    timing t;
+};
+
+vector<result> results;
+bool quick = false;
+
+void record(const string &suite, const string &name, const string &variant, int width, int height, int radius,
+            double bytes, const timing &t) {
+    results.push_back({suite, name, variant, width, height, radius, omp_get_max_threads(), bytes, t});
+}
+
+// Throughput of a measurement in MPixel/s, with the standard deviation derived from the one of the run time
+void print_pixel_rate(double pixels, const timing &t) {
+    double rate = pixels / t.mean / 1e6;
+    cout << fixed << setprecision(1) << setw(9) << rate << " +- " << setw(5) << rate * t.stddev / t.mean << " MPixel/s";
+}
+
+// Writes all recorded measurements as json
+bool write_json(const string &filename) {
+    ofstream out(filename);
+    if (!out) {
+        return false;
+    }
+    const char *level_names[] = {"scalar", "avx2", "avx512"};
+    out << "{\n  \"max_threads\": " << omp_get_max_threads() << ",\n  \"simd\": \"" << level_names[current_simd_level()]
+        << "\",\n  \"results\": [";
+    out << setprecision(9);
+    for (size_t k=0; k < results.size(); k++) {
+        const result &r = results[k];
+        double pixels = (double) r.width * r.height;
+        out << (k ? "," : "") << "\n    {\"suite\": \"" << r.suite << "\", \"name\": \"" << r.name
+            << "\", \"variant\": \"" << r.variant << "\", \"width\": " << r.width << ", \"height\": " << r.height
+            << ", \"radius\": " << r.radius << ", \"threads\": " << r.threads << ", \"runs\": " << r.t.runs
+            << ", \"mean_seconds\": " << r.t.mean << ", \"stddev_seconds\": " << r.t.stddev
+            << ", \"mpixel_per_second\": " << pixels / r.t.mean / 1e6;
+        if (r.bytes > 0) {
+            out << ", \"mb_per_second\": " << r.bytes / r.t.mean / 1e6;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return (bool) out;
+}
+
+void print_throughput(const string &name, const string &variant, size_t bytes, const timing &t) {
+    double rate = bytes / t.mean / 1e6;
+    cout << "  " << left << setw(28) << name << setw(10) << variant
+         << right << fixed << setprecision(1) << setw(10) << rate << " +- " << setw(5) << rate * t.stddev / t.mean
+         << " MB/s" << endl;
+}
+
+// Compares reading and writing P3 through iostream with the current implementation
+void bench_io() {
+    cout << "P3 read/write throughput (MB of P3 text per second)" << endl;
+    char synthetic_filename[] = "bench_synthetic.ppm";
+    char out_filename[] = "bench_out.ppm";
+    set_verbose(false); // read_image and write_image report what they do, which we don't want to time
+    write_image(synthetic_filename, synthetic_scan(2480, 3508)); // A4 at 300 dpi
+    char small_filename[] = "../test/in.ppm";
+    vector<pair<string, char*>> inputs = {{"in.ppm (10x10)", small_filename}, {"synthetic (2480x3508)", synthetic_filename}};
+
+    for (auto &input : inputs) {
+        size_t bytes = file_size(input.second);
+        int width, height;
+        unsigned char *legacy_img = nullptr;
+        timing legacy_read = time_per_run([&] {
+            delete[] legacy_img;
+            legacy_img = legacy_read_p3(input.second, &width, &height);
+        });
+        image img;
+        timing current_read = time_per_run([&] { img = read_image(input.second); });
+        timing legacy_write = time_per_run([&] { legacy_write_p3(out_filename, legacy_img, width, height); });
+        timing current_write = time_per_run([&] { write_image(out_filename, img); });
+        delete[] legacy_img;
+        print_throughput(input.first + " read", "iostream", bytes, legacy_read);
+        print_throughput(input.first + " read", "current", bytes, current_read);
+        print_throughput(input.first + " write", "iostream", bytes, legacy_write);
+        print_throughput(input.first + " write", "current", bytes, current_write);
+        record("io", "read_p3", "iostream", width, height, 0, bytes, legacy_read);
+        record("io", "read_p3", "current", width, height, 0, bytes, current_read);
+        record("io", "write_p3", "iostream", width, height, 0, bytes, legacy_write);
+        record("io", "write_p3", "current", width, height, 0, bytes, current_write);
+    }
+    set_verbose(true);
+    remove(synthetic_filename);
+    remove(out_filename);
+}
+
+// Shows that the cost of mean_filter doesn't depend on its radius
+void bench_mean_radius() {
+    cout << "mean_filter over radius (2480x3508)" << endl;
+    int width = 2480, height = 3508;
+    image img = synthetic_scan(width, height);
+    for (int radius=1; radius <= 64; radius++) {
+        timing t = time_routine(img, [&](image &copy) { mean_filter(copy, radius); }, 0.2);
+        cout << "  radius " << setw(2) << radius << fixed << setprecision(2) << setw(10) << t.mean*1e3 << " ms";
+        print_pixel_rate((double) width * height, t);
+        cout << endl;
+        record("mean", "mean_filter", "gray", width, height, radius, 0, t);
+    }
+}
+
+// Mean and gauss filter on wide images, where the vertical pass has to cope with long rows
+void bench_wide() {
+    cout << "mean_filter and gauss_filter on wide images (radius 2)" << endl;
+    int widths[] = {4096, 8192, 16384};
+    int height = 1024;
+    for (int width : widths) {
+        image img = synthetic_scan(width, height);
+        timing mean = time_routine(img, [&](image &copy) { mean_filter(copy, 2); });
+        timing gauss = time_routine(img, [&](image &copy) { gauss_filter(copy, 2); });
+        cout << "  " << setw(5) << width << "x" << height << "  mean ";
+        print_pixel_rate((double) width * height, mean);
+        cout << "  gauss ";
+        print_pixel_rate((double) width * height, gauss);
+        cout << endl;
+        record("wide", "mean_filter", "gray", width, height, 2, 0, mean);
+        record("wide", "gauss_filter", "gray", width, height, 2, 0, gauss);
+    }
+}
+
+// Compares both median algorithms over the radius, to find where the constant-time one gets faster
+void bench_median_radius() {
+    cout << "median_filter over radius (1240x1754), MPixel/s" << endl;
+    int width = 1240, height = 1754;
+    image img = synthetic_scan(width, height);
+    for (int radius=1; radius <= 16; radius++) {
+        timing sliding = time_routine(img, [&](image &copy) { median_filter(copy, radius, MEDIAN_SLIDING); }, 0.2);
+        timing constant = time_routine(img, [&](image &copy) { median_filter(copy, radius, MEDIAN_CONSTANT); }, 0.2);
+        cout << "  radius " << setw(2) << radius << fixed << setprecision(1)
+             << "  sliding " << setw(7) << width * height / sliding.mean / 1e6
+             << "  constant " << setw(7) << width * height / constant.mean / 1e6 << endl;
+        record("median", "median_filter", "sliding", width, height, radius, 0, sliding);
+        record("median", "median_filter", "constant", width, height, radius, 0, constant);
+    }
+}
+
+// The kernels specialized for radii up to specialized_radius against the generic ones, and the sorting network of
+// the median against its histograms
+void bench_specialized() {
+    cout << "specialized and generic kernels over radius (2480x3508), MPixel/s" << endl;
+    int width = 2480, height = 3508;
+    image img = synthetic_scan(width, height);
+    for (int radius=1; radius <= specialized_radius; radius++) {
+        set_specialized_kernels(true);
+        timing mean = time_routine(img, [&](image &copy) { mean_filter(copy, radius); }, 0.2);
+        timing gauss = time_routine(img, [&](image &copy) { gauss_filter(copy, radius); }, 0.2);
+        set_specialized_kernels(false);
+        timing mean_generic = time_routine(img, [&](image &copy) { mean_filter(copy, radius); }, 0.2);
+        timing gauss_generic = time_routine(img, [&](image &copy) { gauss_filter(copy, radius); }, 0.2);
+        cout << "  radius " << radius << fixed << setprecision(1)
+             << "  mean " << setw(7) << width * height / mean.mean / 1e6
+             << " (generic " << setw(7) << width * height / mean_generic.mean / 1e6 << ")"
+             << "  gauss " << setw(7) << width * height / gauss.mean / 1e6
+             << " (generic " << setw(7) << width * height / gauss_generic.mean / 1e6 << ")" << endl;
+        record("specialized", "mean_filter", "specialized", width, height, radius, 0, mean);
+        record("specialized", "mean_filter", "generic", width, height, radius, 0, mean_generic);
+        record("specialized", "gauss_filter", "specialized", width, height, radius, 0, gauss);
+        record("specialized", "gauss_filter", "generic", width, height, radius, 0, gauss_generic);
+    }
+    set_specialized_kernels(true);
+    timing network = time_routine(img, [&](image &copy) { median_filter(copy, 1, MEDIAN_NETWORK); }, 0.2);
+    timing sliding = time_routine(img, [&](image &copy) { median_filter(copy, 1, MEDIAN_SLIDING); }, 0.2);
+    cout << "  radius 1  median " << setw(7) << width * height / network.mean / 1e6
+         << " (sliding " << setw(7) << width * height / sliding.mean / 1e6 << ")" << endl;
+    record("specialized", "median_filter", "network", width, height, 1, 0, network);
+    record("specialized", "median_filter", "sliding", width, height, 1, 0, sliding);
+}
+
+// A typical document chain on the same page stored as three rgb planes and as a single grayscale plane
+void bench_planes() {
+    cout << "median 1, threshold_mean 4 10, gauss 1 on rgb and grayscale (2480x3508)" << endl;
+    int width = 2480, height = 3508;
+    vector<routine> routines(3);
+    routines[0].kind = ROUTINE_MEDIAN_FILTER;
+    routines[1].kind = ROUTINE_THRESHOLD_ADAPTIVE_MEAN;
+    routines[1].radius = 4;
+    routines[2].kind = ROUTINE_GAUSS_FILTER;
+    image gray = synthetic_scan(width, height);
+    image rgb = gray.to_rgb();
+    timing rgb_time = time_routine(rgb, [&](image &copy) { run_pipeline(copy, routines); });
+    timing gray_time = time_routine(gray, [&](image &copy) { run_pipeline(copy, routines); });
+    cout << "  rgb  " << fixed << setprecision(1) << setw(8) << rgb_time.mean*1e3 << " +- " << rgb_time.stddev*1e3
+         << " ms" << endl
+         << "  gray " << setw(8) << gray_time.mean*1e3 << " +- " << gray_time.stddev*1e3 << " ms" << endl;
+    record("planes", "document_chain", "rgb", width, height, 0, 0, rgb_time);
+    record("planes", "document_chain", "gray", width, height, 0, 0, gray_time);
+}
+
+// Page sizes of scans: A5 at 150 dpi, A4 at 150 dpi and A4 at 300 dpi
+vector<pair<int, int>> scan_resolutions() {
+    vector<pair<int, int>> resolutions = {{874, 1240}, {1240, 1754}, {2480, 3508}};
+    if (quick) {
+        resolutions.resize(1);
+    }
+    return resolutions;
+}
+
+// Thread counts from one up to what OpenMP would use, doubling each time
+vector<int> thread_counts() {
+    vector<int> counts;
+    int max_threads = omp_get_max_threads();
+    for (int threads=1; threads < max_threads; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(max_threads);
+    return counts;
+}
+
+// Every routine on every resolution, radius and thread count
+void bench_routines() {
+    cout << "all routines over resolution, radius and threads (grayscale scans)" << endl;
+    struct named_routine {
+        string name;
+        bool has_radius;
+        function<void(image&, int)> apply;
+    };
+    vector<named_routine> routines = {
+        {"mean_filter", true, [](image &img, int radius) { mean_filter(img, radius); }},
+        {"gauss_filter", true, [](image &img, int radius) { gauss_filter(img, radius); }},
+        {"median_filter", true, [](image &img, int radius) { median_filter(img, radius); }},
+        {"threshold", false, [](image &img, int) { threshold(img, 128); }},
+        {"threshold_auto", false, [](image &img, int) { threshold_auto(img); }},
+        {"threshold_mean", true, [](image &img, int radius) { threshold_adaptive_mean(img, radius, 10); }},
+        {"threshold_gauss", true, [](image &img, int radius) { threshold_adaptive_gauss(img, radius, 10); }},
+        {"threshold_sauvola", true, [](image &img, int radius) { threshold_sauvola(img, radius); }},
+        {"threshold_bradley", true, [](image &img, int radius) { threshold_bradley(img, radius); }},
+    };
+    vector<int> radii = {1, 2, 4, 8};
+    int max_threads = omp_get_max_threads();
+    for (auto resolution : scan_resolutions()) {
+        int width = resolution.first, height = resolution.second;
+        image img = synthetic_scan(width, height);
+        for (int threads : thread_counts()) {
+            omp_set_num_threads(threads);
+            for (auto &r : routines) {
+                for (int radius : radii) {
+                    if (!r.has_radius && radius != radii[0]) {
+                        break;
+                    }
+                    timing t = time_routine(img, [&](image &copy) { r.apply(copy, radius); }, 0.1);
+                    cout << "  " << setw(4) << width << "x" << left << setw(4) << height << right
+                         << "  threads " << setw(2) << threads << "  " << left << setw(18) << r.name << right;
+                    if (r.has_radius) {
+                        cout << "radius " << radius;
+                    } else {
+                        cout << "        ";
+                    }
+                    print_pixel_rate((double) width * height, t);
+                    cout << endl;
+                    record("routines", r.name, "gray", width, height, r.has_radius ? radius : 0, 0, t);
+                    results.back().threads = threads;
+                }
+            }
+        }
+    }
+    omp_set_num_threads(max_threads);
+}
+
+// A typical chain on a full page with every thread count from one up to what OpenMP would use, for every schedule of
+// the bands, as speedup and parallel efficiency over a single thread
+void bench_scaling() {
+    cout << "scaling of median 2, threshold_mean 4 10, gauss 1 over threads and schedules" << endl;
+    vector<routine> chain(3);
+    chain[0].kind = ROUTINE_MEDIAN_FILTER;
+    chain[0].radius = 2;
+    chain[1].kind = ROUTINE_THRESHOLD_ADAPTIVE_MEAN;
+    chain[1].radius = 4;
+    chain[2].kind = ROUTINE_GAUSS_FILTER;
+    struct named_schedule {
+        string name;
+        omp_sched_t kind;
+    };
+    vector<named_schedule> schedules = {{"static", omp_sched_static}, {"dynamic", omp_sched_dynamic},
+                                        {"guided", omp_sched_guided}};
+    omp_sched_t old_kind;
+    int old_chunk;
+    omp_get_schedule(&old_kind, &old_chunk);
+    int max_threads = omp_get_max_threads();
+    int width = scan_resolutions().back().first, height = scan_resolutions().back().second;
+    image gray = synthetic_scan(width, height);
+    image rgb = gray.to_rgb();
+    for (const image *img : {&gray, &rgb}) {
+        string variant = img->channels == 3 ? "rgb" : "gray";
+        for (auto &s : schedules) {
+            omp_set_schedule(s.kind, 0);
+            double single = 0;
+            for (int threads=1; threads <= max_threads; threads++) {
+                omp_set_num_threads(threads);
+                set_thread_binding(current_binding()); // Places for the new number of threads
+                bind_threads();
+                timing t = time_routine(*img, [&](image &copy) { run_pipeline(copy, chain); }, 0.2);
+                if (threads == 1) {
+                    single = t.mean;
+                }
+                cout << "  " << width << "x" << height << " " << left << setw(5) << variant << setw(8) << s.name
+                     << right << "threads " << setw(3) << threads << fixed << setprecision(3) << setw(9) << t.mean
+                     << " s  speedup " << setprecision(2) << setw(6) << single / t.mean << "  efficiency "
+                     << setprecision(0) << setw(4) << 100 * single / t.mean / threads << " %" << endl;
+                record("scaling", "chain", variant + " " + s.name, width, height, 0, 0, t);
+            }
+        }
+    }
+    omp_set_num_threads(max_threads);
+    omp_set_schedule(old_kind, old_chunk);
+}
+
+// Reading and writing every output format, rgb and grayscale. Pbm, png and tiff can't be read back; they are
+// measured by the samples they hold rather than by the bytes of their files, which depend on the compression.
+void bench_formats() {
+    cout << "read_image and write_image for every format (MB of file, or of samples for pbm, png and tiff, per second)"
+         << endl;
+    char filename[] = "bench_format.img";
+    struct named_format {
+        string name;
+        image_format format;
+    };
+    vector<named_format> formats = {{"p3", FORMAT_P3}, {"p5", FORMAT_P5}, {"p6", FORMAT_P6}, {"pam", FORMAT_PAM},
+                                    {"pbm", FORMAT_PBM}, {"png", FORMAT_PNG}, {"tiff", FORMAT_TIFF}};
+    set_verbose(false);
+    for (auto resolution : scan_resolutions()) {
+        int width = resolution.first, height = resolution.second;
+        image gray = synthetic_scan(width, height);
+        image rgb = gray.to_rgb();
+        for (auto &f : formats) {
+            for (const image *img : {&rgb, &gray}) {
+                if (img->channels == 3 && gray_format(f.format)) {
+                    continue; // Only holds the intensity
+                }
+                string variant = img->channels == 3 ? "rgb" : "gray";
+                timing write = time_per_run([&] { write_image(filename, *img, f.format); }, 0.2);
+                size_t bytes = file_size(filename);
+                string name = to_string(width) + "x" + to_string(height) + " " + f.name + " " + variant;
+                if (f.format == FORMAT_PBM || f.format == FORMAT_PNG || f.format == FORMAT_TIFF) {
+                    size_t samples = (size_t) width * height * img->channels;
+                    print_throughput(name + " write", "", samples, write);
+                    cout << "    " << bytes << " bytes, " << setprecision(1) << (double) samples / bytes << ":1" << endl;
+                    record("formats", "write_" + f.name, variant, width, height, 0, samples, write);
+                    continue;
+                }
+                image read;
+                timing read_time = time_per_run([&] { read = read_image(filename); }, 0.2);
+                print_throughput(name + " read", "", bytes, read_time);
+                print_throughput(name + " write", "", bytes, write);
+                record("formats", "read_" + f.name, variant, width, height, 0, bytes, read_time);
+                record("formats", "write_" + f.name, variant, width, height, 0, bytes, write);
+            }
+        }
+    }
+    set_verbose(true);
+    remove(filename);
+}
+
+// Mean and gauss filters with large radii, exact and on a pyramid level within 8 levels, with the largest difference
+// that was measured between the two away from the edges and the bound it has to stay within
+void bench_pyramid() {
+    cout << "mean and gauss filters exact and approximated within 8 levels over radius (grayscale scans)" << endl;
+    const int max_error = 8;
+    for (auto resolution : scan_resolutions()) {
+        int width = resolution.first, height = resolution.second;
+        image img = synthetic_scan(width, height);
+        for (bool gauss : {false, true}) {
+            string name = gauss ? "gauss_filter" : "mean_filter";
+            for (int radius : {15, 30, 60, 120}) {
+                routine r;
+                r.kind = gauss ? ROUTINE_GAUSS_FILTER : ROUTINE_MEAN_FILTER;
+                r.radius = radius;
+                r.max_error = max_error;
+                int factor = pyramid_factor(r);
+                auto apply = [&](image &copy, int allowed) {
+                    if (gauss) {
+                        gauss_filter(copy, radius, BORDER_IGNORE, allowed);
+                    } else {
+                        mean_filter(copy, radius, BORDER_IGNORE, allowed);
+                    }
+                };
+                timing exact_time = time_routine(img, [&](image &copy) { apply(copy, 0); }, 0.1);
+                timing approximate_time = time_routine(img, [&](image &copy) { apply(copy, max_error); }, 0.1);
+                image exact = img.clone(), approximate = img.clone();
+                apply(exact, 0);
+                apply(approximate, max_error);
+                int margin = radius + 2*factor, worst = 0;
+                for (int i=margin; i < height - margin; i++) {
+                    for (int j=margin; j < width - margin; j++) {
+                        worst = max(worst, abs(exact.row(0, i)[j] - approximate.row(0, i)[j]));
+                    }
+                }
+                cout << "  " << setw(4) << width << "x" << left << setw(4) << height << right << "  " << left << setw(13)
+                     << name << right << "radius " << setw(3) << radius << "  exact";
+                print_pixel_rate((double) width * height, exact_time);
+                cout << "  1/" << factor << " level";
+                print_pixel_rate((double) width * height, approximate_time);
+                double bound = factor > 1 ? pyramid_error(r, factor) : 0;
+                cout << "  off by " << worst << " (bound " << setprecision(1) << bound << ")" << endl;
+                record("pyramid", name, "exact", width, height, radius, 0, exact_time);
+                record("pyramid", name, "approximate", width, height, radius, 0, approximate_time);
+            }
+        }
+    }
+}
+
+// A page read, processed and written one step after the other, and with overlap_image, which decodes and encodes on
+// threads of their own while the routines run, for the formats that take longest to parse and to encode
+void bench_overlap() {
+    cout << "read, routines and write one after the other and overlapped (median 1, threshold_mean 8 10, gauss 1)"
+         << endl;
+    vector<routine> chain(3);
+    chain[0].kind = ROUTINE_MEDIAN_FILTER;
+    chain[1].kind = ROUTINE_THRESHOLD_ADAPTIVE_MEAN;
+    chain[1].radius = 8;
+    chain[2].kind = ROUTINE_GAUSS_FILTER;
+    char in_filename[] = "bench_overlap_in.img";
+    char out_filename[] = "bench_overlap_out.img";
+    struct named_format {
+        string name;
+        image_format in, out;
+    };
+    vector<named_format> formats = {{"p5 to p5", FORMAT_P5, FORMAT_P5}, {"p6 to png", FORMAT_P6, FORMAT_PNG},
+                                    {"p5 to tiff", FORMAT_P5, FORMAT_TIFF}};
+    set_verbose(false);
+    for (auto resolution : scan_resolutions()) {
+        int width = resolution.first, height = resolution.second;
+        image page = synthetic_scan(width, height);
+        for (auto &f : formats) {
+            write_image(in_filename, f.in == FORMAT_P6 ? page.to_rgb() : page.clone(), f.in);
+            timing sequential = time_per_run([&] {
+                image img = read_image(in_filename);
+                run_pipeline(img, chain);
+                write_image(out_filename, img, f.out);
+            }, 0.2);
+            timing overlapped = time_per_run([&] { overlap_image(in_filename, out_filename, chain, f.out, 1); }, 0.2);
+            string name = to_string(width) + "x" + to_string(height) + " " + f.name;
+            cout << "  " << left << setw(24) << name << right << "sequential";
+            print_pixel_rate((double) width * height, sequential);
+            cout << "  overlapped";
+            print_pixel_rate((double) width * height, overlapped);
+            cout << endl;
+            record("overlap", f.name, "sequential", width, height, 0, 0, sequential);
+            record("overlap", f.name, "overlapped", width, height, 0, 0, overlapped);
+        }
+    }
+    set_verbose(true);
+    remove(in_filename);
+    remove(out_filename);
+}
+
+// Finding the skew of a page turned by 2 degrees, and rotating it back with the scalar and the vector kernel
+void bench_deskew() {
+    cout << "skew angle search and rotation over resolution (grayscale scans turned by 2 degrees)" << endl;
+    simd_level vector_level = current_simd_level();
+    for (auto resolution : scan_resolutions()) {
+        int width = resolution.first, height = resolution.second;
+        image page = synthetic_scan(width, height);
+        rotate(page, -2);
+        double angle = 0;
+        timing search = time_per_run([&] { angle = skew_angle(page); }, 0.2);
+        set_simd_level(SIMD_SCALAR);
+        timing scalar = time_routine(page, [&](image &copy) { rotate(copy, angle); }, 0.2);
+        set_simd_level(vector_level);
+        timing vectorized = time_routine(page, [&](image &copy) { rotate(copy, angle); }, 0.2);
+        cout << "  " << setw(4) << width << "x" << left << setw(4) << height << right << "  found " << fixed
+             << setprecision(2) << setw(5) << angle << " degrees";
+        print_pixel_rate((double) width * height, search);
+        cout << "  rotate scalar";
+        print_pixel_rate((double) width * height, scalar);
+        cout << "  vector";
+        print_pixel_rate((double) width * height, vectorized);
+        cout << endl;
+        record("deskew", "skew_angle", "", width, height, 0, 0, search);
+        record("deskew", "rotate", "scalar", width, height, 0, 0, scalar);
+        record("deskew", "rotate", "vector", width, height, 0, 0, vectorized);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> suites;
+    string json_filename;
+    for (int i=1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json_filename = argv[++i];
+        } else if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--bind" && i + 1 < argc) {
+            thread_binding binding;
+            if (!parse_binding(argv[++i], &binding)) {
+                cerr << "Unknown binding " << argv[i] << endl;
+                return 1;
+            }
+            set_thread_binding(binding);
+            bind_threads();
+        } else {
+            suites.push_back(arg);
+        }
+    }
+    if (suites.empty()) {
+        suites = {"io", "mean", "wide", "median", "specialized", "planes", "routines", "formats", "scaling", "pyramid", "overlap", "deskew"};
+    }
+    for (auto &suite : suites) {
+        if (suite == "io") {
+            bench_io();
+        } else if (suite == "mean") {
+            bench_mean_radius();
+        } else if (suite == "wide") {
+            bench_wide();
+        } else if (suite == "median") {
+            bench_median_radius();
+        } else if (suite == "specialized") {
+            bench_specialized();
+        } else if (suite == "planes") {
+            bench_planes();
+        } else if (suite == "routines") {
+            bench_routines();
+        } else if (suite == "formats") {
+            bench_formats();
+        } else if (suite == "scaling") {
+            bench_scaling();
+        } else if (suite == "pyramid") {
+            bench_pyramid();
+        } else if (suite == "overlap") {
+            bench_overlap();
+        } else if (suite == "deskew") {
+            bench_deskew();
+        } else {
+            cerr << "Unknown benchmark suite " << suite << endl;
+            return 1;
+        }
+    }
+    if (!json_filename.empty() && !write_json(json_filename)) {
+        cerr << "Error: Could not write " << json_filename << endl;
+        return 1;
+    }
+    return 0;
+}
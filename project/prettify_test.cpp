@@ -1,9 +1,55 @@
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <sstream>
+#include <unistd.h>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <atomic>
+#include <new>
+#include <omp.h>
+#include <dirent.h>
+#include <sys/socket.h>
 #include "prettify.hpp"
+#include "convolve.hpp"
+#include "pipeline.hpp"
+#include "pool.hpp"
+#include "batch.hpp"
+#include "profile.hpp"
+#include "stream.hpp"
+#include "threading.hpp"
+#include "api.hpp"
+#include "server.hpp"
+#include "compress.hpp"
+#include "cache.hpp"
+#include <zlib.h>
 
 using namespace std;
 
+// Every operator new of the tests and the library is counted, to check where they allocate from the heap
+static atomic<size_t> heap_allocations(0);
+
+void* operator new(size_t size) {
+    heap_allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
 #define READ_IMG 1
 #define WRITE_IMG 2
 #define MEAN_FILTER 3
@@ -11,170 +57,1551 @@ using namespace std;
 #define THRESHOLD 5
 #define THRESHOLD_ADAPTIVE_MEAN 6
 #define THRESHOLD_ADAPTIVE_GAUSS 7
+#define WRITE_IMG_P6 8
+#define WRITE_IMG_P5 9
+#define WRITE_IMG_PAM 10
+#define MEAN_FILTER_RADII 11
+#define GAUSS_FILTER_SIMD 12
+#define MEDIAN_FILTER 13
+#define PIPELINE 14
+#define GRAY_IMAGE 15
+#define BUFFER_POOL 16
+#define BATCH 17
+#define PROFILE 18
+#define THRESHOLD_SAUVOLA 19
+#define THRESHOLD_BRADLEY 20
+#define THRESHOLD_AUTO 21
+#define STREAM 22
+#define THREADING 23
+#define LIBRARY 24
+#define PLAN 25
+#define SPECIALIZED 26
+#define BORDER 27
+#define COMPRESSED_OUTPUT 28
+#define PYRAMID 29
+#define STAGE_CACHE 30
+#define OVERLAP 31
+#define DESKEW 32
+
+// Checks that two images have the same size and rgb samples that differ by at most tolerance
+// A grayscale image equals an rgb image whose channels all have its value
+bool same_image(const image &a, const image &b, int tolerance=0) {
+    if (a.empty() || b.empty() || a.width != b.width || a.height != b.height) {
+        return false;
+    }
+    vector<unsigned char> row_a(a.width*3), row_b(b.width*3);
+    for (int i=0; i < a.height; i++) {
+        a.rgb_row(i, row_a.data());
+        b.rgb_row(i, row_b.data());
+        for (int k=0; k < a.width*3; k++) {
+            if (abs(row_a[k] - row_b[k]) > tolerance) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
 int read_image_test() {
-    unsigned char *img;
-    int width, height;
     char filename[] = "../test/in.ppm";
-    img = read_image(filename, img, &width, &height);
-    if (img == nullptr) {
+    image img = read_image(filename);
+    if (img.empty()) {
         return 1;
     }
-    delete[] img;
     return 0;
 }
 
 int write_image_test() {
     char in_filename[] = "../test/in.ppm";
     char out_filename[] = "../test/out.ppm";
-    unsigned char *img, *result;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    write_image(out_filename, img, width, height);
-    result = read_image(out_filename, result, &width, &height);
-    if (img == nullptr) {
-        return 1;
-    }
-    for (int i=0; i < width*height*3; i++) {
-        if (*(img+i) != *(result+i)) {
-            delete[] img;
-            delete[] result;
-            return 1;
-        }
+    image img = read_image(in_filename);
+    if (img.empty()) {
+        return 1;
     }
-    delete[] img;
-    delete[] result;
-    return 0;
+    write_image(out_filename, img);
+    image result = read_image(out_filename);
+    return same_image(img, result) ? 0 : 1;
+}
+
+// Writes in.ppm in a binary format and checks that reading it back gives the same image
+// in.ppm is grayscale, so even the P5 round trip has to be lossless
+int write_image_binary_test(image_format format, char out_filename[]) {
+    char in_filename[] = "../test/in.ppm";
+    image img = read_image(in_filename);
+    if (img.empty()) {
+        return 1;
+    }
+    write_image(out_filename, img, format);
+    image result = read_image(out_filename);
+    return same_image(img, result) ? 0 : 1;
 }
 
 int mean_filter_test() {
     char in_filename[] = "../test/in.ppm";
     char check_filename[] = "../test/out_mean.ppm";
-    unsigned char *img, *check;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    img = mean_filter(img, width, height, 1);
-    if (img == nullptr) {
+    image img = read_image(in_filename);
+    if (img.empty()) {
         return 1;
     }
-    check = read_image(check_filename, check, &width, &height);
-    if (check == nullptr) {
-        return 1;
+    mean_filter(img, 1);
+    image check = read_image(check_filename);
+    return same_image(img, check, 2) ? 0 : 1; // 2 units of wiggle-room to allow for rounding errors
+}
+
+// Creates a random rgb image, so that results can be compared at any position
+image random_image(int width, int height, unsigned int seed) {
+    image img(width, height, 3);
+    for (int c=0; c < 3; c++) {
+        for (int i=0; i < height; i++) {
+            for (int j=0; j < width; j++) {
+                seed = seed * 1103515245 + 12345;
+                img.row(c, i)[j] = seed >> 16;
+            }
+        }
     }
-    for (int i=0; i < width*height*3; i++) {
-        if (abs(*(img+i) - *(check+i)) > 2) { // 2 units of wiggle-room to allow for rounding errors
-            delete[] img;
-            delete[] check;
+    return img;
+}
+
+// Mean filter that sums up the whole window for each pixel, to check the running sums of mean_filter against
+image brute_force_mean_filter(const image &img, int radius) {
+    int width = img.width, height = img.height;
+    image tmp_img(width, height, img.channels);
+    image new_img(width, height, img.channels);
+    for (int c=0; c < img.channels; c++) {
+        for (int i=0; i < height; i++) {
+            for (int j=0; j < width; j++) {
+                unsigned int sum = 0;
+                for (int x=-radius; x <= radius; x++) {
+                    if (j+x < width && j+x >= 0) {
+                        sum += img.row(c, i)[j+x];
+                    }
+                }
+                tmp_img.row(c, i)[j] = sum / (radius*2+1);
+            }
+        }
+        for (int i=0; i < height; i++) {
+            for (int j=0; j < width; j++) {
+                unsigned int sum = 0;
+                for (int y=-radius; y <= radius; y++) {
+                    if (i+y < height && i+y >= 0) {
+                        sum += tmp_img.row(c, i+y)[j];
+                    }
+                }
+                new_img.row(c, i)[j] = sum / (radius*2+1);
+            }
+        }
+    }
+    return new_img;
+}
+
+// Checks that mean_filter gives exactly the same result as summing up every window, for small and large radii
+int mean_filter_radii_test() {
+    int width = 61, height = 47;
+    int radii[] = {1, 2, 3, 7, 22};
+    for (int radius : radii) {
+        image img = random_image(width, height, radius);
+        image check = brute_force_mean_filter(img, radius);
+        mean_filter(img, radius);
+        if (!same_image(img, check)) {
             return 1;
         }
     }
-    delete[] img;
-    delete[] check;
     return 0;
 }
 
 int gauss_filter_test() {
     char in_filename[] = "../test/in.ppm";
     char check_filename[] = "../test/out_gauss.ppm";
-    unsigned char *img, *check;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    img = gauss_filter(img, width, height, 1);
-    if (img == nullptr) {
+    image img = read_image(in_filename);
+    if (img.empty()) {
         return 1;
     }
-    check = read_image(check_filename, check, &width, &height);
-    if (check == nullptr) {
-        return 1;
+    gauss_filter(img, 1);
+    image check = read_image(check_filename);
+    return same_image(img, check, 2) ? 0 : 1; // 2 units of wiggle-room to allow for rounding errors
+}
+
+// Checks that every simd level the cpu supports gives exactly the same result as the scalar kernels
+int gauss_filter_simd_test() {
+    int width = 83, height = 41;
+    int radii[] = {1, 2, 5, 19};
+    simd_level levels[] = {SIMD_AVX2, SIMD_AVX512};
+    for (int radius : radii) {
+        image img = random_image(width, height, radius);
+        image check = img.clone();
+        set_simd_level(SIMD_SCALAR);
+        gauss_filter(check, radius);
+        for (simd_level level : levels) {
+            if (level > detected_simd_level()) {
+                continue;
+            }
+            set_simd_level(level);
+            image result = img.clone();
+            gauss_filter(result, radius);
+            if (!same_image(result, check)) {
+                return 1;
+            }
+        }
     }
-    for (int i=0; i < width*height*3; i++) {
-        if (abs(*(img+i) - *(check+i)) > 2) { // 2 units of wiggle-room to allow for rounding errors
-            delete[] img;
-            delete[] check;
-            return 1;
+    return 0;
+}
+
+// Checks all median algorithms against sorting every window, where pixels outside the image count as white
+int median_filter_test() {
+    int width = 61, height = 47;
+    int radii[] = {1, 2, 4, 7, 22};
+    median_algorithm algorithms[] = {MEDIAN_SLIDING, MEDIAN_CONSTANT, MEDIAN_NETWORK};
+    for (int radius : radii) {
+        image img = random_image(width, height, radius);
+        for (int c=0; c < 3; c++) {
+            for (int i=0; i < height; i++) {
+                for (int j=(i+c) % 7; j < width; j += 7) { // Runs of black make sure the median can reach 0
+                    img.row(c, i)[j] = 0;
+                }
+            }
+        }
+        image check(width, height, 3);
+        vector<int> window;
+        for (int c=0; c < 3; c++) {
+            for (int i=0; i < height; i++) {
+                for (int j=0; j < width; j++) {
+                    window.clear();
+                    for (int y=-radius; y <= radius; y++) {
+                        for (int x=-radius; x <= radius; x++) {
+                            bool inside = i+y >= 0 && i+y < height && j+x >= 0 && j+x < width;
+                            window.push_back(inside ? img.row(c, i+y)[j+x] : 255);
+                        }
+                    }
+                    nth_element(window.begin(), window.begin() + window.size()/2, window.end());
+                    check.row(c, i)[j] = window[window.size()/2];
+                }
+            }
+        }
+        for (median_algorithm algorithm : algorithms) {
+            image result = img.clone();
+            median_filter(result, radius, algorithm);
+            if (!same_image(result, check)) {
+                return 1;
+            }
         }
     }
-    delete[] img;
-    delete[] check;
     return 0;
 }
 
-int threshold_test() {
-    char in_filename[] = "../test/in.ppm";
-    char check_filename[] = "../test/out_threshold.ppm";
-    unsigned char *img, *check;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    img = threshold(img, width, height, 100);
-    if (img == nullptr) {
+// A chain of routines with every kind of stage, median 5 uses the constant-time algorithm
+vector<routine> test_chain() {
+    vector<routine> routines(5);
+    routines[0].kind = ROUTINE_MEDIAN_FILTER;
+    routines[0].radius = 2;
+    routines[1].kind = ROUTINE_THRESHOLD_ADAPTIVE_MEAN;
+    routines[1].radius = 4;
+    routines[2].kind = ROUTINE_GAUSS_FILTER;
+    routines[2].radius = 1;
+    routines[3].kind = ROUTINE_MEDIAN_FILTER;
+    routines[3].radius = 5;
+    routines[4].kind = ROUTINE_THRESHOLD;
+    routines[4].thresh = 120;
+    return routines;
+}
+
+// Checks that a fused chain of routines split into many bands gives the same result as applying one routine after the other
+int pipeline_test() {
+    vector<routine> routines = test_chain();
+    image img = random_image(97, 300, 7);
+    image check = img.clone();
+    omp_set_num_threads(1);
+    for (const routine &r : routines) {
+        run_pipeline(check, {r});
+    }
+    omp_set_num_threads(7);
+    run_pipeline(img, routines);
+    return same_image(img, check) ? 0 : 1;
+}
+
+// Checks that a grayscale image, stored in a single plane, gives the same result as the same image in rgb
+int gray_image_test() {
+    image rgb = random_image(89, 113, 3);
+    image gray = rgb.luma();
+    rgb = gray.to_rgb();
+    if (gray.channels != 1 || rgb.channels != 3) {
         return 1;
     }
-    check = read_image(check_filename, check, &width, &height);
-    if (check == nullptr) {
+    vector<routine> routines = test_chain();
+    routines[4].kind = ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+    routines[4].radius = 3;
+    run_pipeline(gray, routines);
+    run_pipeline(rgb, routines);
+    return same_image(gray, rgb) ? 0 : 1;
+}
+
+// Checks that filtering a second page of the same size takes all its buffers from the pool, that images and arrays
+// from a warm pool don't touch the heap, and that a warm page only allocates the few objects that set up its chain,
+// as many for a short page as for a long one, so that no row or buffer is allocated on the heap
+int buffer_pool_test() {
+    omp_set_num_threads(1); // With several threads, bands could take each other's buffers in another order
+    vector<routine> routines = test_chain();
+    char out_filename[] = "../test/out_pool.ppm";
+    size_t warm = 0;
+    for (int page=0; page < 3; page++) {
+        image img = random_image(97, 300, page);
+        run_pipeline(img, routines);
+        write_image(out_filename, img, FORMAT_P6);
+        if (page == 0) {
+            warm = default_pool().system_allocations();
+        }
+    }
+    remove(out_filename);
+    int result = default_pool().system_allocations() == warm ? 0 : 1;
+
+    size_t before = heap_allocations;
+    for (int k=0; k < 100; k++) {
+        image img(97, 300, 3);
+        pooled_array<int16_t> scratch(1000);
+    }
+    if (heap_allocations != before) {
+        cerr << "Images from a warm pool allocate from the heap" << endl;
+        result = 1;
+    }
+    size_t page_allocations[2];
+    int heights[] = {300, 1200};
+    for (int k=0; k < 2; k++) {
+        image page = random_image(97, heights[k], k), copy = page.clone();
+        run_pipeline(copy, routines); // Warms the pool up for this size
+        copy = page.clone();
+        before = heap_allocations;
+        run_pipeline(copy, routines);
+        page_allocations[k] = heap_allocations - before;
+    }
+    if (page_allocations[0] != page_allocations[1] || page_allocations[0] > 100) {
+        cerr << "Warm pages allocate " << page_allocations[0] << " and " << page_allocations[1] << " times" << endl;
+        result = 1;
+    }
+    return result;
+}
+
+// Checks that a batch of pages gives the same results as processing each page on its own
+int batch_test() {
+    char manifest_filename[] = "../test/batch_manifest.txt";
+    char output_dir[] = "../test/batch_out";
+    vector<routine> routines = test_chain();
+    vector<string> inputs = {"../test/in.ppm"};
+    for (int page=0; page < 4; page++) { // Color pages of different sizes
+        inputs.push_back("../test/batch_in" + to_string(page) + ".ppm");
+        write_image(&inputs.back()[0], random_image(60 + 17*page, 90 - 9*page, page), FORMAT_P6);
+    }
+    ofstream manifest(manifest_filename);
+    manifest << "# Pages of the batch test" << endl;
+    for (const string &input : inputs) {
+        manifest << input << endl;
+    }
+    manifest.close();
+    batch_options opts;
+    opts.format = FORMAT_P6;
+    opts.format_set = true;
+    vector<batch_page> pages;
+    omp_set_num_threads(3);
+    if (!list_batch_pages(manifest_filename, output_dir, opts, &pages) || pages.size() != inputs.size()) {
         return 1;
     }
-    for (int i=0; i < width*height*3; i++) {
-        if (abs(*(img+i) - *(check+i)) > 2) { // 2 units of wiggle-room to allow for rounding errors
-            delete[] img;
-            delete[] check;
-            return 1;
+    batch_report report = run_batch(pages, routines, opts);
+    int result = report.failed == 0 && report.workers == 3 ? 0 : 1;
+    for (const batch_page &page : pages) {
+        string input = page.input, output = page.output;
+        image check = read_image(&input[0]);
+        run_pipeline(check, routines);
+        if (!same_image(read_image(&output[0]), check)) {
+            result = 1;
         }
+        remove(output.c_str());
     }
-    delete[] img;
-    delete[] check;
-    return 0;
+    for (size_t page=1; page < inputs.size(); page++) {
+        remove(inputs[page].c_str());
+    }
+    remove(manifest_filename);
+    rmdir(output_dir);
+    return result;
 }
 
-int threshold_adaptive_mean_test() {
+// Checks that profiling doesn't change results, and that the steps and stages of a chain show up in trace and summary
+int profile_test() {
+    char trace_filename[] = "../test/profile_trace.json";
+    vector<routine> routines = test_chain();
+    image img = random_image(83, 121, 4);
+    image check = img.clone();
+    run_pipeline(check, routines);
+    set_profiling(true);
+    omp_set_num_threads(3);
+    image gray = img.luma();
+    run_pipeline(img, routines);
+    set_profiling(false);
+    run_pipeline(gray, routines); // Not recorded
+    int result = same_image(img, check) ? 0 : 1;
+    stringstream summary;
+    print_profile_summary(summary);
+    if (!write_trace(trace_filename)) {
+        return 1;
+    }
+    ifstream trace_file(trace_filename);
+    string trace((istreambuf_iterator<char>(trace_file)), istreambuf_iterator<char>());
+    vector<string> expected = {"luma", "pipeline"};
+    for (const routine &r : routines) {
+        expected.push_back(routine_name(r));
+    }
+    for (const string &name : expected) {
+        if (summary.str().find(name) == string::npos) {
+            result = 1;
+        }
+    }
+    for (const char *name : {"\"luma\"", "\"pipeline\"", "\"band 0\"", "\"ph\": \"X\""}) {
+        if (trace.find(name) == string::npos) {
+            result = 1;
+        }
+    }
+    if (trace.find("\"pipeline\"") != trace.rfind("\"pipeline\"")) { // Only the first chain was profiled
+        result = 1;
+    }
+    remove(trace_filename);
+    return result;
+}
+
+// Sauvola or bradley threshold that sums up every window pixel by pixel, with the same formulas as the routines
+image brute_force_local_threshold(const image &img, int radius, int k, bool sauvola) {
+    int width = img.width, height = img.height, channels = img.channels;
+    image new_img = img.clone();
+    for (int i=0; i < height; i++) {
+        for (int j=0; j < width; j++) {
+            uint64_t sum = 0, squares = 0, n = 0;
+            for (int y=max(i-radius, 0); y <= min(i+radius, height-1); y++) {
+                for (int x=max(j-radius, 0); x <= min(j+radius, width-1); x++) {
+                    int intensity = channels == 1 ? img.row(0, y)[x]
+                                  : (img.row(0, y)[x] + img.row(1, y)[x] + img.row(2, y)[x]) / 3;
+                    sum += intensity;
+                    squares += intensity * intensity;
+                    n++;
+                }
+            }
+            double mean = sum / (double) n;
+            double variance = squares / (double) n - mean*mean;
+            double limit = sauvola ? mean * (1 + k / 100.0 * (sqrt(max(variance, 0.0)) / 128 - 1)) : mean * (1 - k / 100.0);
+            int intensity = channels == 1 ? img.row(0, i)[j] : (img.row(0, i)[j] + img.row(1, i)[j] + img.row(2, i)[j]) / 3;
+            if (intensity > limit) {
+                for (int c=0; c < channels; c++) {
+                    new_img.row(c, i)[j] = 255;
+                }
+            }
+        }
+    }
+    return new_img;
+}
+
+// Compares a local threshold with the brute force one on color and grayscale images, for radii up to most of the image
+int local_threshold_test(bool sauvola) {
     char in_filename[] = "../test/in.ppm";
-    char check_filename[] = "../test/out_threshold_adaptive_mean.ppm";
-    unsigned char *img, *check;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    img = threshold_adaptive_mean(img, width, height, 4, 10);
-    if (img == nullptr) {
+    vector<image> inputs;
+    inputs.push_back(read_image(in_filename));
+    inputs.push_back(random_image(61, 97, 5));
+    inputs.push_back(inputs[1].luma());
+    omp_set_num_threads(3);
+    for (const image &input : inputs) {
+        for (int radius : {1, 2, 3, 7, 29}) {
+            if (radius > input.width/2 - 1 || radius > input.height/2 - 1) {
+                continue;
+            }
+            for (int k : {5, 20, 50}) {
+                image img = input.clone();
+                if (sauvola) {
+                    threshold_sauvola(img, radius, k);
+                } else {
+                    threshold_bradley(img, radius, k);
+                }
+                if (!same_image(img, brute_force_local_threshold(input, radius, k, sauvola))) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Otsu's threshold found by computing the between-class variance of every candidate from scratch
+int brute_force_otsu(const image &img) {
+    vector<double> histogram(256, 0);
+    for (int i=0; i < img.height; i++) {
+        for (int j=0; j < img.width; j++) {
+            int intensity = img.channels == 1 ? img.row(0, i)[j] : (img.row(0, i)[j] + img.row(1, i)[j] + img.row(2, i)[j]) / 3;
+            histogram[intensity]++;
+        }
+    }
+    double best_variance = -1;
+    int best = 0;
+    for (int t=0; t < 255; t++) {
+        double below = 0, below_sum = 0, above = 0, above_sum = 0;
+        for (int v=0; v < 256; v++) {
+            if (v <= t) {
+                below += histogram[v];
+                below_sum += v * histogram[v];
+            } else {
+                above += histogram[v];
+                above_sum += v * histogram[v];
+            }
+        }
+        if (below == 0 || above == 0) {
+            continue;
+        }
+        double difference = below_sum / below - above_sum / above;
+        double variance = below * above * difference * difference;
+        if (variance > best_variance * (1 + 1e-12)) { // Ties go to the smaller threshold, rounding aside
+            best_variance = variance;
+            best = t;
+        }
+    }
+    return best;
+}
+
+// Page with dark text strokes on a bright background that gets darker towards the bottom
+image bimodal_page(int width, int height) {
+    image img(width, height, 1);
+    unsigned int state = 7;
+    for (int i=0; i < height; i++) {
+        for (int j=0; j < width; j++) {
+            state = state * 1103515245 + 12345;
+            int noise = (state >> 16) % 21 - 10;
+            bool text = (i / 3) % 4 == 0 && (j / 5) % 3 != 0;
+            img.row(0, i)[j] = (text ? 50 : 220 - 40 * i / height) + noise;
+        }
+    }
+    return img;
+}
+
+// Checks the chosen thresholds against brute force and the thresholds in between bimodal peaks, and that chains
+// with an automatic threshold in the middle give the same result as applying their routines one after the other
+int threshold_auto_test() {
+    omp_set_num_threads(3);
+    image page = bimodal_page(97, 131);
+    vector<image> inputs;
+    inputs.push_back(page.to_rgb());
+    inputs.push_back(page.clone());
+    inputs.push_back(random_image(61, 97, 6));
+    for (const image &input : inputs) {
+        if (auto_threshold(input, THRESHOLD_OTSU) != brute_force_otsu(input)) {
+            return 1;
+        }
+    }
+    for (threshold_method method : {THRESHOLD_OTSU, THRESHOLD_TRIANGLE}) {
+        int thresh = auto_threshold(page, method);
+        if (thresh < 60 || thresh > 170) { // Text is at most 60, the background at least 170
+            return 1;
+        }
+        image img = page.clone(), check = page.clone();
+        threshold_auto(img, method);
+        threshold(check, thresh);
+        if (!same_image(img, check)) {
+            return 1;
+        }
+    }
+    vector<routine> chain(3);
+    chain[0].kind = ROUTINE_MEDIAN_FILTER;
+    chain[1].kind = ROUTINE_THRESHOLD_AUTO;
+    chain[2].kind = ROUTINE_GAUSS_FILTER;
+    image img = inputs[0].clone(), check = inputs[0].clone();
+    run_pipeline(img, chain);
+    median_filter(check, 1);
+    threshold_auto(check);
+    gauss_filter(check, 1);
+    return same_image(img, check) ? 0 : 1;
+}
+
+// Checks that images processed in strips give the same files as processing them as a whole, for color, grayscale
+// and P3 input, with strips much shorter than the image and ones that don't divide its height
+int stream_test() {
+    char in_p6[] = "../test/stream_in.ppm";
+    char in_p3[] = "../test/stream_in_p3.ppm";
+    char in_p5[] = "../test/stream_in.pgm";
+    char out_filename[] = "../test/stream_out.pam";
+    image page = random_image(83, 203, 7);
+    write_image(in_p6, page, FORMAT_P6);
+    write_image(in_p3, page, FORMAT_P3);
+    write_image(in_p5, page, FORMAT_P5);
+    vector<vector<routine>> chains = {test_chain(), vector<routine>(2), {}};
+    chains[1][0].kind = ROUTINE_THRESHOLD_AUTO;
+    chains[1][1].kind = ROUTINE_MEAN_FILTER;
+    chains[1][1].radius = 3;
+    omp_set_num_threads(3);
+    int result = 0;
+    for (char *input : {in_p6, in_p3, in_p5}) {
+        for (const vector<routine> &chain : chains) {
+            for (bool gray : {false, true}) {
+                int channels = gray || input == in_p5 ? 1 : 3;
+                for (int rows : {1, 37, page.height}) {
+                    size_t memory_limit = strip_memory(chain, page.width, channels, FORMAT_PAM, rows);
+                    int strip_rows = 0;
+                    if (!stream_image(input, out_filename, chain, FORMAT_PAM, gray, memory_limit, &strip_rows)
+                        || strip_rows != rows) {
+                        result = 1;
+                        continue;
+                    }
+                    image check = read_image(input);
+                    if (gray && check.channels > 1) {
+                        check = check.luma();
+                    }
+                    run_pipeline(check, chain);
+                    if (!same_image(read_image(out_filename), check)) {
+                        result = 1;
+                    }
+                }
+            }
+        }
+    }
+    if (stream_image(in_p6, out_filename, test_chain(), FORMAT_PAM, false, 1 << 10)) { // Not even the stages fit
+        result = 1;
+    }
+    remove(in_p6);
+    remove(in_p3);
+    remove(in_p5);
+    remove(out_filename);
+    return result;
+}
+
+// Checks that the options for the threads are parsed like OMP_SCHEDULE, and that pinned threads and every schedule
+// give the same result
+int threading_test() {
+    thread_binding binding;
+    omp_sched_t kind;
+    int chunk;
+    if (!parse_binding("spread", &binding) || binding != BIND_SPREAD || parse_binding("nearby", &binding)
+        || !parse_schedule("guided,8", &kind, &chunk) || kind != omp_sched_guided || chunk != 8
+        || !parse_schedule("static", &kind, &chunk) || kind != omp_sched_static || chunk != 0
+        || parse_schedule("dynamic,", &kind, &chunk) || parse_schedule("dynamic,0", &kind, &chunk)
+        || parse_schedule("auto", &kind, &chunk)) {
         return 1;
     }
-    check = read_image(check_filename, check, &width, &height);
-    if (check == nullptr) {
+    image img = random_image(101, 250, 11);
+    image check = img.clone();
+    omp_set_num_threads(1);
+    run_pipeline(check, test_chain());
+    omp_set_num_threads(5);
+    int result = 0;
+    for (thread_binding b : {BIND_CLOSE, BIND_SPREAD, BIND_NONE}) {
+        set_thread_binding(b);
+        bind_threads();
+        if (thread_places() < 1) {
+            result = 1;
+        }
+        for (omp_sched_t s : {omp_sched_static, omp_sched_dynamic, omp_sched_guided}) {
+            omp_set_schedule(s, s == omp_sched_dynamic ? 3 : 0);
+            image copy = img.clone();
+            run_pipeline(copy, test_chain());
+            if (!same_image(copy, check)) {
+                result = 1;
+            }
+        }
+    }
+    return result;
+}
+
+// Reads from a descriptor until size bytes or a newline (if line is set) arrived
+string read_response(int fd, size_t size, bool line) {
+    string text;
+    char c;
+    while (text.size() < size && read(fd, &c, 1) == 1) {
+        if (line && c == '\n') {
+            break;
+        }
+        text += c;
+    }
+    return text;
+}
+
+// Checks the api of the library: routines parsed from arguments, pixels in buffers of the caller with padded rows
+// processed from several threads at once, and requests served over a socket
+int library_test() {
+    vector<routine> chain = test_chain();
+    vector<string> arguments = {"median", "2", "threshold_mean", "4", "gauss", "median", "5", "threshold", "120"};
+    vector<routine> parsed;
+    string error;
+    if (!parse_routine_arguments(arguments, &parsed, &error) || parsed.size() != chain.size()) {
         return 1;
     }
-    for (int i=0; i < width*height*3; i++) {
-        if (abs(*(img+i) - *(check+i)) > 2) { // 2 units of wiggle-room to allow for rounding errors
-            delete[] img;
-            delete[] check;
+    for (size_t k=0; k < chain.size(); k++) {
+        if (routine_name(parsed[k]) != routine_name(chain[k])) {
             return 1;
         }
     }
-    delete[] img;
-    delete[] check;
-    return 0;
+    parsed.clear();
+    if (parse_routine_arguments({"median", "sharpen"}, &parsed, &error) || error.find("sharpen") == string::npos) {
+        return 1;
+    }
+
+    image img = random_image(77, 91, 5);
+    image check = img.clone();
+    run_pipeline(check, chain);
+    image check_gray = img.luma();
+    run_pipeline(check_gray, chain);
+    size_t stride = 77*3 + 13;
+    vector<unsigned char> pixels(stride * img.height);
+    for (int i=0; i < img.height; i++) {
+        img.rgb_row(i, &pixels[i * stride]);
+    }
+    vector<vector<unsigned char>> outputs = {pixels, vector<unsigned char>(stride * img.height),
+                                             vector<unsigned char>(80 * img.height)};
+    vector<bool> done(outputs.size());
+    omp_set_num_threads(2);
+    vector<thread> threads;
+    for (size_t t=0; t < outputs.size(); t++) {
+        threads.emplace_back([&, t] {
+            pixel_buffer in = {t == 0 ? outputs[0].data() : pixels.data(), img.width, img.height, 3, stride};
+            pixel_buffer out = {outputs[t].data(), img.width, img.height, t == 2 ? 1 : 3, t == 2 ? 80 : stride};
+            done[t] = prettify_pixels(in, out, chain); // The first one in place
+        });
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+    vector<unsigned char> expected(stride);
+    for (size_t t=0; t < outputs.size(); t++) {
+        if (!done[t]) {
+            return 1;
+        }
+        for (int i=0; i < img.height; i++) {
+            if (t < 2) {
+                check.rgb_row(i, expected.data());
+            } else {
+                copy(check_gray.row(0, i), check_gray.row(0, i) + img.width, expected.data());
+            }
+            size_t row_size = t < 2 ? 77*3 : 77;
+            size_t row_stride = t < 2 ? stride : 80;
+            if (!equal(expected.begin(), expected.begin() + row_size, outputs[t].begin() + i * row_stride)) {
+                return 1;
+            }
+        }
+    }
+    pixel_buffer small = {pixels.data(), 10, 10, 3, 0};
+    pixel_buffer large = {outputs[1].data(), 10, 11, 3, 0};
+    if (prettify_pixels(small, large, chain, &error)) {
+        return 1;
+    }
+
+    char in_filename[] = "../test/library_in.ppm";
+    write_image(in_filename, img, FORMAT_P6);
+    ifstream in_file(in_filename, ios::binary);
+    string file((istreambuf_iterator<char>(in_file)), istreambuf_iterator<char>());
+    if (file.empty()) {
+        cerr << "Could not write " << in_filename << endl;
+        return 1;
+    }
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return 1;
+    }
+    bool served = false, sent = false;
+    thread server([&] { // Shuts the socket down however the connection ends, so that reading the responses never blocks
+        served = serve_connection(fds[1], fds[1]);
+        shutdown(fds[1], SHUT_RDWR);
+    });
+    thread client([&] { // Sends while the responses are read, so neither side waits for the other
+        string requests = to_string(file.size()) + " --format pam median 2 threshold_mean 4 gauss median 5 threshold 120\n"
+                        + file + to_string(file.size()) + " bogus\n" + file + "quit\n";
+        sent = send(fds[0], requests.data(), requests.size(), MSG_NOSIGNAL) == (ssize_t) requests.size();
+    });
+    int result = 0;
+    string header = read_response(fds[0], 64, true);
+    if (header.compare(0, 3, "ok ") != 0) {
+        result = 1;
+    } else {
+        string body = read_response(fds[0], stoul(header.substr(3)), false);
+        image processed = decode_image((const unsigned char*) body.data(), body.size(), "response");
+        result = body.compare(0, 2, "P7") == 0 && same_image(processed, check) ? 0 : 1;
+    }
+    if (read_response(fds[0], 256, true).compare(0, 6, "error ") != 0) {
+        result = 1;
+    }
+    client.join();
+    server.join();
+    close(fds[0]);
+    close(fds[1]);
+    remove(in_filename);
+    return served && sent ? result : 1;
+}
+
+// Global threshold without the pipeline: pixels whose intensity is above thresh become white
+void brute_force_threshold(image &img, int thresh) {
+    for (int i=0; i < img.height; i++) {
+        for (int j=0; j < img.width; j++) {
+            int sum = 0;
+            for (int c=0; c < img.channels; c++) {
+                sum += img.row(c, i)[j];
+            }
+            if (sum / img.channels > thresh) {
+                for (int c=0; c < img.channels; c++) {
+                    img.row(c, i)[j] = 255;
+                }
+            }
+        }
+    }
+}
+
+// Checks that the planner merges, drops and fuses thresholds as expected, and that the planned chains give the same
+// images as applying their routines one after the other
+int plan_test() {
+    auto planned = [](const vector<string> &arguments, vector<string> *notes=nullptr) {
+        vector<routine> routines;
+        string error;
+        parse_routine_arguments(arguments, &routines, &error);
+        return plan_routines(routines, notes);
+    };
+    vector<string> notes;
+    vector<routine> plan = planned({"gauss", "threshold", "120", "threshold", "100"}, &notes);
+    if (plan.size() != 1 || plan[0].fused_thresh != 100 || notes.size() != 2) {
+        return 1;
+    }
+    plan = planned({"threshold", "120", "threshold", "100", "threshold", "130"});
+    if (plan.size() != 1 || plan[0].thresh != 100 || plan[0].fused_thresh >= 0) {
+        return 1;
+    }
+    plan = planned({"threshold", "255", "median", "2", "threshold", "300"}); // Only the median is left
+    if (plan.size() != 1 || plan[0].kind != ROUTINE_MEDIAN_FILTER) {
+        return 1;
+    }
+    plan = planned({"median", "2", "gauss", "threshold", "-3", "mean"});
+    if (plan.size() != 2 || plan[0].thresh != -3) {
+        return 1;
+    }
+
+    vector<vector<string>> chains = {
+        {"gauss", "threshold", "120", "threshold", "140"},
+        {"threshold", "90", "threshold", "140", "threshold_gauss", "3", "5", "threshold", "1"},
+        {"median", "2", "threshold", "-1", "mean", "2", "threshold", "250"},
+        {"threshold_sauvola", "4", "threshold", "255", "threshold", "254", "median", "1", "threshold", "30"},
+        {"mean", "3", "threshold_auto", "threshold", "60", "threshold_bradley", "5", "threshold", "200"},
+    };
+    omp_set_num_threads(3);
+    int result = 0;
+    for (int channels : {1, 3}) {
+        image img = random_image(71, 83, 13);
+        if (channels == 1) {
+            img = img.luma();
+        }
+        for (const vector<string> &arguments : chains) {
+            vector<routine> routines;
+            string error;
+            if (!parse_routine_arguments(arguments, &routines, &error)) {
+                return 1;
+            }
+            image planned = img.clone();
+            run_pipeline(planned, routines);
+            image check = img.clone();
+            for (const routine &r : routines) {
+                if (r.kind == ROUTINE_THRESHOLD) {
+                    brute_force_threshold(check, r.thresh);
+                } else {
+                    run_pipeline(check, {r});
+                }
+            }
+            if (!same_image(planned, check)) {
+                result = 1;
+            }
+        }
+    }
+    return result;
+}
+
+int threshold_test() {
+    char in_filename[] = "../test/in.ppm";
+    char check_filename[] = "../test/out_threshold.ppm";
+    image img = read_image(in_filename);
+    if (img.empty()) {
+        return 1;
+    }
+    threshold(img, 100);
+    image check = read_image(check_filename);
+    return same_image(img, check, 2) ? 0 : 1; // 2 units of wiggle-room to allow for rounding errors
+}
+
+int threshold_adaptive_mean_test() {
+    char in_filename[] = "../test/in.ppm";
+    char check_filename[] = "../test/out_threshold_adaptive_mean.ppm";
+    image img = read_image(in_filename);
+    if (img.empty()) {
+        return 1;
+    }
+    threshold_adaptive_mean(img, 4, 10);
+    image check = read_image(check_filename);
+    return same_image(img, check, 2) ? 0 : 1; // 2 units of wiggle-room to allow for rounding errors
 }
 
 int threshold_adaptive_gauss_test() {
     char in_filename[] = "../test/in.ppm";
     char check_filename[] = "../test/out_threshold_adaptive_gauss.ppm";
-    unsigned char *img, *check;
-    int width, height;
-    img = read_image(in_filename, img, &width, &height);
-    img = threshold_adaptive_gauss(img, width, height, 4, 10);
-    if (img == nullptr) {
+    image img = read_image(in_filename);
+    if (img.empty()) {
         return 1;
     }
-    check = read_image(check_filename, check, &width, &height);
-    if (check == nullptr) {
+    threshold_adaptive_gauss(img, 4, 10);
+    image check = read_image(check_filename);
+    return same_image(img, check, 2) ? 0 : 1; // 2 units of wiggle-room to allow for rounding errors
+}
+
+// Checks that the kernels specialized for small radii give exactly the same result as the generic ones, on every
+// simd level, also on images just large enough for the radius
+int specialized_test() {
+    int sizes[][2] = {{83, 41}, {14, 17}, {15, 14}}; // The smallest images radius 6 is allowed for
+    simd_level levels[] = {SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+    int result = 0;
+    for (auto &size : sizes) {
+        for (int radius=1; radius <= specialized_radius+1; radius++) {
+            image img = random_image(size[0], size[1], radius);
+            for (simd_level level : levels) {
+                if (level > detected_simd_level()) {
+                    continue;
+                }
+                set_simd_level(level);
+                image mean = img.clone(), gauss = img.clone();
+                image mean_generic = img.clone(), gauss_generic = img.clone();
+                set_specialized_kernels(true);
+                mean_filter(mean, radius);
+                gauss_filter(gauss, radius);
+                set_specialized_kernels(false);
+                mean_filter(mean_generic, radius);
+                gauss_filter(gauss_generic, radius);
+                set_specialized_kernels(true);
+                if (!same_image(mean, mean_generic) || !same_image(gauss, gauss_generic)) {
+                    cerr << "Specialized kernels differ for radius " << radius << " on " << size[0] << "x" << size[1]
+                         << endl;
+                    result = 1;
+                }
+            }
+        }
+    }
+    set_simd_level(detected_simd_level());
+    return result;
+}
+
+// Pixel of a row or column of n pixels that a border policy takes for pos, mirroring as often as needed
+int border_source(int pos, int n, border_policy border) {
+    if (border == BORDER_REPLICATE) {
+        return min(max(pos, 0), n-1);
+    }
+    while (n > 1 && (pos < 0 || pos >= n)) {
+        pos = pos < 0 ? -pos : 2*(n-1) - pos;
+    }
+    return n > 1 ? pos : 0;
+}
+
+// Checks the border policies of the filters against filtering the image extended by the policy, whose center has
+// all its windows inside, and that replicated or reflected borders don't darken a plain page
+int border_test() {
+    int sizes[][2] = {{37, 23}, {16, 17}}; // Windows of radius 7 reach across all of the smaller image
+    int radii[] = {1, 2, 4, 7};
+    border_policy borders[] = {BORDER_REPLICATE, BORDER_REFLECT};
+    median_algorithm algorithms[] = {MEDIAN_SLIDING, MEDIAN_CONSTANT, MEDIAN_NETWORK};
+    int result = 0;
+    for (auto &size : sizes) {
+        int width = size[0], height = size[1];
+        for (int radius : radii) {
+            image img = random_image(width, height, radius);
+            for (border_policy border : borders) {
+                image extended(width + 2*radius, height + 2*radius, 3);
+                for (int c=0; c < 3; c++) {
+                    for (int i=0; i < extended.height; i++) {
+                        for (int j=0; j < extended.width; j++) {
+                            extended.row(c, i)[j] = img.row(c, border_source(i-radius, height, border))[border_source(j-radius, width, border)];
+                        }
+                    }
+                }
+                vector<function<void(image&, border_policy)>> filters = {
+                    [&](image &target, border_policy b) { mean_filter(target, radius, b); },
+                    [&](image &target, border_policy b) { gauss_filter(target, radius, b); },
+                };
+                for (median_algorithm algorithm : algorithms) {
+                    filters.push_back([=](image &target, border_policy b) { median_filter(target, radius, algorithm, b); });
+                }
+                for (size_t f=0; f < filters.size(); f++) {
+                    image expected = extended.clone();
+                    filters[f](expected, BORDER_IGNORE);
+                    image filtered = img.clone();
+                    filters[f](filtered, border);
+                    bool same = true;
+                    for (int c=0; c < 3; c++) {
+                        for (int i=0; i < height; i++) {
+                            same &= equal(filtered.row(c, i), filtered.row(c, i) + width, expected.row(c, i+radius) + radius);
+                        }
+                    }
+                    if (!same) {
+                        cerr << "Filter " << f << " with border " << border << " differs for radius " << radius
+                             << " on " << width << "x" << height << endl;
+                        result = 1;
+                    }
+                }
+            }
+        }
+    }
+    image page(40, 30, 1);
+    for (int i=0; i < page.height; i++) {
+        fill(page.row(0, i), page.row(0, i) + page.width, 200);
+    }
+    for (border_policy border : borders) {
+        image mean = page.clone(), gauss = page.clone();
+        mean_filter(mean, 6, border);
+        gauss_filter(gauss, 6, border);
+        if (!same_image(mean, page) || !same_image(gauss, page)) {
+            cerr << "Border " << border << " darkens a plain page" << endl;
+            result = 1;
+        }
+    }
+    image shadowed = page.clone();
+    mean_filter(shadowed, 6);
+    if (shadowed.row(0, 0)[0] >= 200) { // Ignoring the border counts the pixels outside as black
+        cerr << "Ignoring the border doesn't darken the corners anymore" << endl;
+        result = 1;
+    }
+    return result;
+}
+
+// A page with rows of text-like blocks, rules longer than the largest fax codes, a noisy patch and curves, with dark
+// and light pixels on both sides of the bilevel threshold
+image bilevel_page() {
+    image img(2900, 300, 1);
+    unsigned int seed = 5;
+    for (int i=0; i < img.height; i++) {
+        unsigned char *row = img.row(0, i);
+        for (int j=0; j < img.width; j++) {
+            seed = seed * 1103515245 + 12345;
+            bool black = false;
+            if (i == 20 || i == 21) {
+                black = j >= 10;
+            } else if (i >= 40 && i < 120) {
+                black = (j / 7 + i / 9) % 5 == 0 && j % 300 < 250;
+            } else if (i >= 150 && i < 170) {
+                black = (seed >> 16) % 3 == 0;
+            } else if (i >= 180 && i < 260) {
+                black = abs(j - 600 - (i - 180) * 3) < 2 || (j - 1500) * (j - 1500) + (i - 220) * (i - 220) * 4 < 1600;
+            }
+            row[j] = black ? (seed >> 24) % 128 : 255 - (seed >> 24) % 100;
+        }
+    }
+    return img;
+}
+
+vector<unsigned char> file_contents(const char *filename) {
+    ifstream in(filename, ios::binary);
+    return vector<unsigned char>((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+// Decodes a png as raster_writer writes it, 8 bit gray or rgb without interlacing, and checks the crc of every chunk
+// and the adler-32 of the zlib stream. Returns an empty image if any of that fails.
+image decode_png(const vector<unsigned char> &file) {
+    auto big_endian = [&](size_t at) {
+        return (uint32_t) file[at] << 24 | file[at+1] << 16 | file[at+2] << 8 | file[at+3];
+    };
+    if (file.size() < 8 || memcmp(file.data(), "\x89PNG\r\n\x1a\n", 8) != 0) {
+        return image();
+    }
+    int width = 0, height = 0, channels = 0;
+    vector<unsigned char> stream;
+    for (size_t pos=8; pos + 12 <= file.size(); pos += 12 + big_endian(pos)) {
+        size_t length = big_endian(pos);
+        if (pos + 12 + length > file.size() || crc32(0, &file[pos+4], length + 4) != big_endian(pos + 8 + length)) {
+            return image();
+        }
+        string type(file.begin() + pos + 4, file.begin() + pos + 8);
+        if (type == "IHDR") {
+            width = big_endian(pos + 8);
+            height = big_endian(pos + 12);
+            channels = file[pos + 17] == 0 ? 1 : 3;
+        } else if (type == "IDAT") {
+            stream.insert(stream.end(), file.begin() + pos + 8, file.begin() + pos + 8 + length);
+        }
+    }
+    size_t row_size = 1 + (size_t) width * channels;
+    vector<unsigned char> filtered(row_size * height);
+    uLongf size = filtered.size();
+    if (width == 0 || uncompress(filtered.data(), &size, stream.data(), stream.size()) != Z_OK
+        || size != filtered.size()) {
+        return image();
+    }
+    image img(width, height, channels);
+    vector<unsigned char> above(width * channels, 0), row(width * channels);
+    for (int i=0; i < height; i++) {
+        const unsigned char *in = &filtered[i * row_size];
+        if (in[0] > 4) {
+            return image();
+        }
+        for (int k=0; k < width * channels; k++) {
+            int a = k >= channels ? row[k - channels] : 0, b = above[k], c = k >= channels ? above[k - channels] : 0;
+            int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            int predicted[5] = {0, a, b, (a + b) / 2, pa <= pb && pa <= pc ? a : pb <= pc ? b : c};
+            row[k] = in[1 + k] + predicted[in[0]];
+        }
+        for (int c=0; c < channels; c++) {
+            for (int j=0; j < width; j++) {
+                img.row(c, i)[j] = row[j * channels + c];
+            }
+        }
+        above = row;
+    }
+    return img;
+}
+
+// Checks the compressed and 1 bit formats: pbm bits against the threshold, png by decoding it, and the group 4 tiff
+// against a file that libtiff decodes to the page. Files have to be the same for any number of threads, and when the
+// image is streamed in strips.
+int compressed_output_test() {
+    char pbm_filename[] = "../test/compressed_out.pbm";
+    char png_filename[] = "../test/compressed_out.png";
+    char tiff_filename[] = "../test/compressed_out.tif";
+    char in_filename[] = "../test/compressed_in.pgm";
+    image page = bilevel_page();
+    int result = 0;
+    write_image(pbm_filename, page, FORMAT_PBM);
+    vector<unsigned char> pbm = file_contents(pbm_filename);
+    string header = "P4\n2900 300\n";
+    size_t row_bytes = (page.width + 7) / 8;
+    if (pbm.size() != header.size() + row_bytes * page.height || memcmp(pbm.data(), header.data(), header.size())) {
         return 1;
     }
-    for (int i=0; i < width*height*3; i++) {
-        if (abs(*(img+i) - *(check+i)) > 2) { // 2 units of wiggle-room to allow for rounding errors
-            delete[] img;
-            delete[] check;
-            return 1;
+    for (int i=0; i < page.height; i++) {
+        for (int j=0; j < page.width; j++) {
+            bool black = pbm[header.size() + i * row_bytes + j / 8] >> (7 - j % 8) & 1;
+            if (black != (page.row(0, i)[j] < bilevel_threshold)) {
+                result = 1;
+            }
         }
     }
-    delete[] img;
-    delete[] check;
-    return 0;
+
+    vector<unsigned char> tiff_check = file_contents("../test/out_g4.tif");
+    image color = random_image(517, 300, 13); // Several chunks of rgb rows, and of gray ones for the page
+    for (int threads : {1, 3}) {
+        omp_set_num_threads(threads);
+        write_image(tiff_filename, page, FORMAT_TIFF);
+        if (file_contents(tiff_filename) != tiff_check) {
+            cerr << "Group 4 tiff with " << threads << " threads differs from the check file" << endl;
+            result = 1;
+        }
+        for (const image *img : {&page, &color}) {
+            write_image(png_filename, *img, FORMAT_PNG);
+            if (!same_image(decode_png(file_contents(png_filename)), *img)) {
+                cerr << "Png with " << threads << " threads doesn't decode to the image" << endl;
+                result = 1;
+            }
+        }
+    }
+
+    write_image(in_filename, page, FORMAT_P5);
+    write_image(png_filename, page, FORMAT_PNG);
+    vector<unsigned char> png_check = file_contents(png_filename);
+    for (image_format format : {FORMAT_PNG, FORMAT_TIFF}) {
+        char *out_filename = format == FORMAT_PNG ? png_filename : tiff_filename;
+        vector<unsigned char> check = format == FORMAT_PNG ? png_check : tiff_check;
+        size_t memory_limit = strip_memory({}, page.width, 1, format, 37);
+        if (!stream_image(in_filename, out_filename, {}, format, false, memory_limit)
+            || file_contents(out_filename) != check) {
+            cerr << "Format " << format << " differs when it's written in strips" << endl;
+            result = 1;
+        }
+    }
+    remove(pbm_filename);
+    remove(png_filename);
+    remove(tiff_filename);
+    remove(in_filename);
+    return result;
+}
+
+// Checks the means and gausses computed on pyramid levels against the exact ones on noise, stripes of many periods and
+// a page: away from the edges no pixel of a filter may be off by more than pyramid_error, and an adaptive threshold may
+// only decide differently where the exact background is that close to the pixel. The result mustn't depend on the
+// bands of the threads, pages smaller than a block still work, and without an allowed error nothing is approximated.
+int pyramid_test() {
+    vector<image> pages;
+    pages.push_back(random_image(301, 203, 11).luma());
+    image stripes(256, 180, 1);
+    for (int i=0; i < stripes.height; i++) {
+        for (int j=0; j < stripes.width; j++) {
+            int period = 1 + i / 5; // Every period from 1 to 36, horizontal and vertical
+            stripes.row(0, i)[j] = (j / period + (i % period < period/2 ? 1 : 0)) % 2 ? 230 : 20;
+        }
+    }
+    pages.push_back(move(stripes));
+    pages.push_back(bimodal_page(333, 222));
+    routine_kind kinds[] = {ROUTINE_MEAN_FILTER, ROUTINE_GAUSS_FILTER, ROUTINE_THRESHOLD_ADAPTIVE_MEAN,
+                            ROUTINE_THRESHOLD_ADAPTIVE_GAUSS};
+    int result = 0;
+    for (const image &page : pages) {
+        for (routine_kind kind : kinds) {
+            bool gauss = kind == ROUTINE_GAUSS_FILTER || kind == ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+            for (int radius : {13, 24, 40}) {
+                routine r, exact_mean;
+                r.kind = kind;
+                r.radius = radius;
+                r.max_error = 8;
+                exact_mean.kind = gauss ? ROUTINE_GAUSS_FILTER : ROUTINE_MEAN_FILTER;
+                exact_mean.radius = radius;
+                int factor = pyramid_factor(r);
+                if (gauss && radius == 40 && factor == 1) {
+                    cerr << "The gauss with radius 40 isn't approximated within 8 levels" << endl;
+                    result = 1;
+                }
+                double bound = factor > 1 ? pyramid_error(r, factor) : 0;
+                image background = page.clone(), approximate = page.clone();
+                run_pipeline(background, {exact_mean});
+                omp_set_num_threads(1);
+                run_pipeline(approximate, {r});
+                omp_set_num_threads(4);
+                image banded = page.clone();
+                run_pipeline(banded, {r});
+                if (!same_image(approximate, banded)) {
+                    cerr << "The pyramid depends on the bands for kind " << kind << " and radius " << radius << endl;
+                    result = 1;
+                }
+                bool threshold = kind == ROUTINE_THRESHOLD_ADAPTIVE_MEAN || kind == ROUTINE_THRESHOLD_ADAPTIVE_GAUSS;
+                image exact = page.clone();
+                routine exact_routine = r;
+                exact_routine.max_error = 0;
+                run_pipeline(exact, {exact_routine});
+                int margin = radius + 2*factor;
+                for (int i=margin; i < page.height - margin; i++) {
+                    for (int j=margin; j < page.width - margin; j++) {
+                        int difference = abs(approximate.row(0, i)[j] - exact.row(0, i)[j]);
+                        if (threshold && difference != 0) { // Compare the background instead
+                            difference = abs(page.row(0, i)[j] + r.C - background.row(0, i)[j]);
+                        }
+                        if (difference > bound) {
+                            cerr << "Kind " << kind << " with radius " << radius << " on a 1/" << factor << " level is off by "
+                                 << difference << " at " << j << "," << i << ", more than " << bound << endl;
+                            result = 1;
+                            i = page.height;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (int size : {6, 9, 17, 70}) { // Plain pages with levels of a few blocks, some of them partial, stay plain
+        image plain(size, size + 2, 1);
+        for (int i=0; i < plain.height; i++) {
+            fill(plain.row(0, i), plain.row(0, i) + size, 200);
+        }
+        for (routine_kind kind : kinds) {
+            routine r;
+            r.kind = kind;
+            r.radius = size/2 - 1;
+            r.border = BORDER_REPLICATE;
+            r.max_error = 100;
+            image filtered = plain.clone();
+            run_pipeline(filtered, {r});
+            int expected = kind == ROUTINE_MEAN_FILTER || kind == ROUTINE_GAUSS_FILTER ? 200 : 255;
+            for (int i=0; i < plain.height; i++) {
+                if (count(filtered.row(0, i), filtered.row(0, i) + size, expected) != size) {
+                    cerr << "Kind " << kind << " changes a plain " << size << "x" << size + 2 << " page" << endl;
+                    result = 1;
+                    break;
+                }
+            }
+        }
+    }
+    routine exact;
+    exact.kind = ROUTINE_GAUSS_FILTER;
+    exact.radius = 120;
+    if (pyramid_factor(exact) != 1) {
+        cerr << "A gauss without an allowed error is approximated" << endl;
+        result = 1;
+    }
+    return result;
+}
+
+// Checks that the stage cache gives back the longest stored prefix of a chain exactly, only for the same input, gray
+// conversion and parameters, ignores entries that were cut off and keeps the most recently used entries within its size
+int stage_cache_test() {
+    char in_filename[] = "../test/cache_in.ppm";
+    string directory = "../test/stage_cache";
+    image page = random_image(70, 45, 3);
+    write_image(in_filename, page, FORMAT_P6);
+    uint64_t input_hash, same_hash;
+    int result = 0;
+    if (!hash_file(in_filename, &input_hash) || !hash_file(in_filename, &same_hash) || input_hash != same_hash) {
+        result = 1;
+    }
+    const unsigned char abc[] = {'a', 'b', 'c'};
+    if (hash_bytes(nullptr, 0) != 0xef46db3751d8e999ULL || hash_bytes(abc, 3) != 0x44bc2cf5ad770999ULL) {
+        cerr << "hash_bytes doesn't give the hashes of xxHash64" << endl;
+        result = 1;
+    }
+    vector<routine> chain = test_chain();
+    image before_last = page.clone(), after = page.clone();
+    run_pipeline(before_last, vector<routine>(chain.begin(), chain.end() - 1));
+    run_pipeline(after, chain);
+    {
+        stage_cache cache(directory, 1 << 20, input_hash, false);
+        image loaded;
+        if (cache.load(chain, &loaded) != -1 || !cache.store(chain, 4, before_last) || !cache.store(chain, 5, after)) {
+            result = 1;
+        }
+        if (cache.load(chain, &loaded) != 5 || !same_image(loaded, after)) {
+            result = 1;
+        }
+        vector<routine> changed = chain;
+        changed[4].thresh = 90;
+        if (cache.load(changed, &loaded) != 4 || !same_image(loaded, before_last)) {
+            cerr << "A changed last routine doesn't resume from the routines before it" << endl;
+            result = 1;
+        }
+        changed[1].border = BORDER_REFLECT;
+        if (cache.load(changed, &loaded) != -1) {
+            cerr << "A changed border policy uses a cached result" << endl;
+            result = 1;
+        }
+    }
+    image loaded;
+    if (stage_cache(directory, 1 << 20, input_hash, true).load(chain, &loaded) != -1
+        || stage_cache(directory, 1 << 20, input_hash + 1, false).load(chain, &loaded) != -1) {
+        cerr << "A result is used for another input" << endl;
+        result = 1;
+    }
+    vector<string> entries;
+    DIR *listing = opendir(directory.c_str());
+    while (dirent *entry = listing ? readdir(listing) : nullptr) {
+        if (entry->d_name[0] != '.') {
+            entries.push_back(directory + "/" + entry->d_name);
+        }
+    }
+    if (listing) {
+        closedir(listing);
+    }
+    if (entries.size() != 2) {
+        result = 1;
+    }
+    for (const string &entry : entries) { // Cut off every entry, they have to be ignored
+        if (truncate(entry.c_str(), 100) != 0) {
+            result = 1;
+        }
+    }
+    stage_cache small(directory, 40000, input_hash, false); // Room for two entries of a 70x45 rgb image, 17 KB each
+    if (small.load(chain, &loaded) != -1) {
+        cerr << "A cut off entry was loaded" << endl;
+        result = 1;
+    }
+    for (int prefix=1; prefix <= 5; prefix++) {
+        small.store(chain, prefix, page);
+    }
+    int kept = 0;
+    for (int prefix=0; prefix <= 5; prefix++) {
+        vector<routine> shorter(chain.begin(), chain.begin() + prefix);
+        kept += small.load(shorter, &loaded) == prefix ? 1 : 0;
+    }
+    if (kept != 2 || small.load(chain, &loaded) != 5) {
+        cerr << "The cache keeps " << kept << " entries instead of the 2 most recent" << endl;
+        result = 1;
+    }
+    listing = opendir(directory.c_str());
+    while (dirent *entry = listing ? readdir(listing) : nullptr) {
+        if (entry->d_name[0] != '.') {
+            remove((directory + "/" + entry->d_name).c_str());
+        }
+    }
+    if (listing) {
+        closedir(listing);
+    }
+    rmdir(directory.c_str());
+    remove(in_filename);
+    return result;
+}
+
+// Checks that overlap_image writes the same files as read_image, run_pipeline and write_image, for every input
+// format, with threshold_auto first, in the middle or not at all, and that it fails on a truncated file
+int overlap_test() {
+    char in_filename[] = "../test/overlap_in.img";
+    char out_filename[] = "../test/overlap_out.img";
+    char check_filename[] = "../test/overlap_check.img";
+    image color = random_image(61, 150, 5);
+    image gray = color.luma();
+    struct input {
+        const image *img;
+        image_format format;
+        int planes; // What image_planes has to give for the file
+    };
+    vector<input> inputs = {{&color, FORMAT_P6, 3}, {&color, FORMAT_PAM, 3}, {&gray, FORMAT_P5, 1}, {&gray, FORMAT_P6, 1},
+                            {&color, FORMAT_P3, 0}};
+    vector<vector<routine>> chains = {test_chain(), test_chain(), test_chain(), {}};
+    chains[1].insert(chains[1].begin(), routine());
+    chains[1][0].kind = ROUTINE_THRESHOLD_AUTO;
+    chains[2][2].kind = ROUTINE_THRESHOLD_AUTO;
+    image_format outputs[] = {FORMAT_P6, FORMAT_P5, FORMAT_PNG, FORMAT_TIFF};
+    omp_set_num_threads(3);
+    set_verbose(false);
+    int result = 0;
+    for (const input &in : inputs) {
+        write_image(in_filename, *in.img, in.format);
+        raster_reader probe;
+        if (!probe.open(in_filename) || probe.image_planes() != in.planes) {
+            cerr << "image_planes is wrong for format " << in.format << endl;
+            result = 1;
+        }
+        int planes = read_image(in_filename).channels;
+        for (const vector<routine> &chain : chains) {
+            for (image_format format : outputs) {
+                int channels = gray_format(format) ? 1 : planes;
+                image check = read_image(in_filename);
+                if (check.channels > channels) {
+                    check = check.luma();
+                }
+                run_pipeline(check, chain);
+                write_image(check_filename, check, format);
+                if (!overlap_image(in_filename, out_filename, chain, format, channels)
+                    || file_contents(out_filename) != file_contents(check_filename)) {
+                    cerr << "overlap_image differs for input " << in.format << ", output " << format << " and "
+                         << chain.size() << " routines" << endl;
+                    result = 1;
+                }
+            }
+        }
+    }
+    vector<unsigned char> contents = file_contents(in_filename); // The P3 file, which is long enough to be opened
+    ofstream truncated(in_filename, ios::binary);                // and only found to be truncated while decoding
+    truncated.write((const char*) contents.data(), contents.size() * 2 / 3);
+    truncated.close();
+    if (overlap_image(in_filename, out_filename, test_chain(), FORMAT_P6, 3)) {
+        cerr << "overlap_image doesn't fail on a truncated file" << endl;
+        result = 1;
+    }
+    set_verbose(true);
+    remove(in_filename);
+    remove(out_filename);
+    remove(check_filename);
+    return result;
+}
+
+// A page with lines of letters that go down to the right by degrees, and white margins
+image skewed_page(int width, int height, double degrees) {
+    image img(width, height, 1);
+    double slope = tan(degrees * M_PI / 180), cx = width / 2.0, cy = height / 2.0;
+    for (int i=0; i < height; i++) {
+        for (int j=0; j < width; j++) {
+            double along = (j - cx) + (i - cy) * slope, across = (i - cy) - (j - cx) * slope;
+            bool letter = fabs(along) < width * 0.4 && fabs(across) < height * 0.4
+                       && fmod(across + 1000, 24) < 12 && fmod(along + 1000, 10) < 7;
+            img.row(0, i)[j] = letter ? 30 : 240;
+        }
+    }
+    return img;
+}
+
+// Checks that skew_angle finds the angle of skewed pages, that deskew straightens them, that the scalar and the
+// vector rotation give the same pixels, and that deskew in a chain gives what it gives on its own
+int deskew_test() {
+    int result = 0;
+    for (double degrees : {-3.3, 0.0, 1.7, 4.2}) {
+        image page = skewed_page(600, 400, degrees);
+        double found = skew_angle(page), found_color = skew_angle(page.to_rgb());
+        if (fabs(found - degrees) > 0.1 || found_color != found) {
+            cerr << "Skew of " << degrees << " degrees found as " << found << " (color " << found_color << ")" << endl;
+            result = 1;
+        }
+        deskew(page);
+        if (fabs(skew_angle(page)) > 0.1) {
+            cerr << "A page skewed by " << degrees << " degrees is still skewed by " << skew_angle(page) << endl;
+            result = 1;
+        }
+    }
+    if (fabs(skew_angle(skewed_page(600, 400, 4.2), 2)) > 2) {
+        cerr << "skew_angle searches beyond its maximum angle" << endl;
+        result = 1;
+    }
+
+    image color = random_image(1100, 90, 7), gray = color.luma();
+    for (const image *img : {&color, &gray}) {
+        image turned = img->clone();
+        rotate(turned, 0);
+        if (!same_image(turned, *img)) {
+            cerr << "Rotating by 0 degrees changes the image" << endl;
+            result = 1;
+        }
+        simd_level level = current_simd_level();
+        for (double degrees : {7.3, -30.0, 90.0, 181.5}) {
+            set_simd_level(SIMD_SCALAR);
+            image scalar = img->clone();
+            rotate(scalar, degrees);
+            set_simd_level(SIMD_AVX2);
+            image vectorized = img->clone();
+            rotate(vectorized, degrees);
+            set_simd_level(level);
+            if (!same_image(scalar, vectorized)) {
+                cerr << "Scalar and vector rotation by " << degrees << " degrees differ" << endl;
+                result = 1;
+            }
+        }
+    }
+    image white(300, 200, 3);
+    for (int c=0; c < 3; c++) {
+        for (int i=0; i < white.height; i++) {
+            memset(white.row(c, i), 255, white.width);
+        }
+    }
+    image turned = white.clone();
+    rotate(turned, 12);
+    if (skew_angle(white) != 0 || !same_image(turned, white)) {
+        cerr << "A white page doesn't stay white" << endl;
+        result = 1;
+    }
+
+    image page = skewed_page(600, 400, 2.4);
+    vector<routine> chain(4);
+    chain[0].kind = ROUTINE_THRESHOLD_ADAPTIVE_MEAN;
+    chain[0].radius = 6;
+    chain[1].kind = ROUTINE_DESKEW;
+    chain[2].kind = ROUTINE_THRESHOLD;
+    chain[2].thresh = 128;
+    chain[3].kind = ROUTINE_GAUSS_FILTER;
+    image piped = page.clone(), check = page.clone();
+    run_pipeline(piped, chain);
+    threshold_adaptive_mean(check, 6, 10);
+    deskew(check);
+    threshold(check, 128);
+    gauss_filter(check, 1);
+    if (!same_image(piped, check) || plan_routines(chain).size() != 4) {
+        cerr << "deskew in a chain differs from deskew on its own" << endl;
+        result = 1;
+    }
+    vector<routine> parsed;
+    if (!parse_routine_arguments({"deskew", "12", "deskew"}, &parsed, nullptr) || parsed.size() != 2
+        || parsed[0].angle != 12 || parsed[1].angle != deskew_default_angle || routine_name(parsed[0]) != "deskew 12") {
+        cerr << "deskew is not parsed with its angle" << endl;
+        result = 1;
+    }
+    parsed[0].angle = 50;
+    if (valid_routine(parsed[0], 600, 400)) {
+        cerr << "deskew accepts an angle of 50 degrees" << endl;
+        result = 1;
+    }
+
+    char in_filename[] = "../test/deskew_in.pgm";
+    char out_filename[] = "../test/deskew_out.pgm";
+    char check_filename[] = "../test/deskew_check.pgm";
+    set_verbose(false);
+    write_image(in_filename, page, FORMAT_P5);
+    write_image(check_filename, piped, FORMAT_P5);
+    if (!overlap_image(in_filename, out_filename, chain, FORMAT_P5, 1)
+        || file_contents(out_filename) != file_contents(check_filename)) {
+        cerr << "overlap_image differs with deskew in the chain" << endl;
+        result = 1;
+    }
+    vector<routine> first = {chain[1]};
+    check = page.clone();
+    deskew(check);
+    write_image(check_filename, check, FORMAT_P5);
+    if (!overlap_image(in_filename, out_filename, first, FORMAT_P5, 1)
+        || file_contents(out_filename) != file_contents(check_filename)) {
+        cerr << "overlap_image differs with deskew first" << endl;
+        result = 1;
+    }
+    if (stream_image(in_filename, out_filename, chain, FORMAT_P5, true, (size_t) 1 << 30, nullptr)) {
+        cerr << "A chain with deskew is streamed" << endl;
+        result = 1;
+    }
+    set_verbose(true);
+    remove(in_filename);
+    remove(out_filename);
+    remove(check_filename);
+    return result;
 }
 
 int main(int argc, char* argv[]) {
@@ -204,6 +1631,83 @@ int main(int argc, char* argv[]) {
         case THRESHOLD_ADAPTIVE_GAUSS:
             return threshold_adaptive_gauss_test();
             break;
+        case WRITE_IMG_P6: {
+            char out_filename[] = "../test/out_p6.ppm";
+            return write_image_binary_test(FORMAT_P6, out_filename);
+        }
+        case WRITE_IMG_P5: {
+            char out_filename[] = "../test/out_p5.pgm";
+            return write_image_binary_test(FORMAT_P5, out_filename);
+        }
+        case WRITE_IMG_PAM: {
+            char out_filename[] = "../test/out.pam";
+            return write_image_binary_test(FORMAT_PAM, out_filename);
+        }
+        case MEAN_FILTER_RADII:
+            return mean_filter_radii_test();
+            break;
+        case GAUSS_FILTER_SIMD:
+            return gauss_filter_simd_test();
+            break;
+        case MEDIAN_FILTER:
+            return median_filter_test();
+        case PIPELINE:
+            return pipeline_test();
+            break;
+        case GRAY_IMAGE:
+            return gray_image_test();
+            break;
+        case BUFFER_POOL:
+            return buffer_pool_test();
+            break;
+        case BATCH:
+            return batch_test();
+            break;
+        case PROFILE:
+            return profile_test();
+            break;
+        case THRESHOLD_SAUVOLA:
+            return local_threshold_test(true);
+            break;
+        case THRESHOLD_BRADLEY:
+            return local_threshold_test(false);
+            break;
+        case THRESHOLD_AUTO:
+            return threshold_auto_test();
+            break;
+        case STREAM:
+            return stream_test();
+            break;
+        case THREADING:
+            return threading_test();
+            break;
+        case LIBRARY:
+            return library_test();
+            break;
+        case PLAN:
+            return plan_test();
+            break;
+        case SPECIALIZED:
+            return specialized_test();
+            break;
+        case BORDER:
+            return border_test();
+            break;
+        case COMPRESSED_OUTPUT:
+            return compressed_output_test();
+            break;
+        case PYRAMID:
+            return pyramid_test();
+            break;
+        case STAGE_CACHE:
+            return stage_cache_test();
+            break;
+        case OVERLAP:
+            return overlap_test();
+            break;
+        case DESKEW:
+            return deskew_test();
+            break;
         default:
             cerr << "Unknown test number entered." << endl;
             return 1;
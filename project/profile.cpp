@@ -0,0 +1,281 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+#include "profile.hpp"
+#include "pool.hpp"
+
+using namespace std;
+
+// One complete event of the trace
+struct trace_event {
+    string name;
+    string category;
+    int thread;
+    double start, seconds;
+    vector<pair<string, double>> args;
+};
+
+static atomic<bool> enabled(false);
+static double origin = 0;
+static mutex profile_lock;
+static vector<trace_event> events;
+static vector<profile_totals> totals; // In the order the steps were first seen
+static atomic<int> next_thread(0);
+static thread_local int thread_number = -1;
+static thread_local int depth = 0;
+
+void set_profiling(bool on) {
+    if (on && !enabled) {
+        origin = omp_get_wtime();
+    }
+    enabled = on;
+}
+
+bool profiling() {
+    return enabled;
+}
+
+double profile_time() {
+    return omp_get_wtime() - origin;
+}
+
+int profile_thread() {
+    if (thread_number < 0) {
+        thread_number = next_thread++;
+    }
+    return thread_number;
+}
+
+int profile_depth() {
+    return depth;
+}
+
+// Counters opened for the calling thread the first time they are read, counting only user space
+struct perf_counters {
+    int cycles = -1;
+    int instructions = -1;
+    bool opened = false;
+
+    ~perf_counters() {
+        if (cycles >= 0) {
+            close(cycles);
+        }
+        if (instructions >= 0) {
+            close(instructions);
+        }
+    }
+    static int open_counter(uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0); // This thread, on any cpu
+    }
+    void open() {
+        opened = true;
+        cycles = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+        instructions = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+    }
+};
+
+static thread_local perf_counters counters;
+
+// Where perf_event_open isn't permitted (perf_event_paranoid, containers) the counters are invalid
+hardware_counters read_hardware_counters() {
+    hardware_counters values;
+    if (!counters.opened) {
+        counters.open();
+    }
+    if (counters.cycles < 0 || counters.instructions < 0) {
+        return values;
+    }
+    values.valid = read(counters.cycles, &values.cycles, sizeof(uint64_t)) == sizeof(uint64_t)
+                && read(counters.instructions, &values.instructions, sizeof(uint64_t)) == sizeof(uint64_t);
+    return values;
+}
+
+hardware_counters operator-(const hardware_counters &end, const hardware_counters &start) {
+    hardware_counters difference;
+    difference.valid = end.valid && start.valid;
+    if (difference.valid) {
+        difference.cycles = end.cycles - start.cycles;
+        difference.instructions = end.instructions - start.instructions;
+    }
+    return difference;
+}
+
+void add_trace_event(const string &name, const string &category, int thread, double start, double seconds,
+                     const vector<pair<string, double>> &args) {
+    lock_guard<mutex> guard(profile_lock);
+    events.push_back({name, category, thread, start, seconds, args});
+}
+
+void add_profile_totals(const profile_totals &step) {
+    lock_guard<mutex> guard(profile_lock);
+    profile_totals *found = nullptr;
+    for (profile_totals &t : totals) {
+        if (t.name == step.name && t.depth == step.depth) {
+            found = &t;
+        }
+    }
+    if (found == nullptr) {
+        totals.push_back(step);
+        return;
+    }
+    found->count += step.count;
+    found->seconds += step.seconds;
+    found->busy += step.busy;
+    found->idle += step.idle;
+    found->bytes_allocated += step.bytes_allocated;
+    found->bytes_moved += step.bytes_moved;
+    if (step.counters.valid) {
+        found->counters.valid = true;
+        found->counters.cycles += step.counters.cycles;
+        found->counters.instructions += step.counters.instructions;
+    }
+}
+
+// The step is added to the totals right away, so that it comes before the stages that are added while it runs
+profile_step::profile_step(const string &name) : enabled(profiling()) {
+    if (!enabled) {
+        return;
+    }
+    totals.name = name;
+    totals.depth = depth++;
+    add_profile_totals(totals);
+    start_allocated = default_pool().system_bytes();
+    start_counters = read_hardware_counters();
+    start = profile_time();
+}
+
+profile_step::~profile_step() {
+    if (!enabled) {
+        return;
+    }
+    double end = profile_time();
+    depth--;
+    totals.count = 1;
+    totals.seconds = end - start;
+    totals.bytes_allocated = default_pool().system_bytes() - start_allocated;
+    add_counters(read_hardware_counters() - start_counters);
+    vector<pair<string, double>> args = {{"bytes_allocated", (double) totals.bytes_allocated}};
+    if (totals.bytes_moved > 0) {
+        args.push_back({"bytes_moved", totals.bytes_moved});
+    }
+    if (totals.busy > 0) {
+        args.push_back({"busy_seconds", totals.busy});
+        args.push_back({"idle_seconds", totals.idle});
+    }
+    add_trace_event(totals.name, "step", profile_thread(), start, totals.seconds, args);
+    add_profile_totals(totals);
+}
+
+void profile_step::add_thread_time(double busy, double idle) {
+    totals.busy += busy;
+    totals.idle += idle;
+}
+
+void profile_step::add_counters(const hardware_counters &c) {
+    if (c.valid) {
+        totals.counters.valid = true;
+        totals.counters.cycles += c.cycles;
+        totals.counters.instructions += c.instructions;
+    }
+}
+
+static string json_string(const string &text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Writes all events in the trace event format, as complete events with times in microseconds
+bool write_trace(const string &filename) {
+    ofstream out(filename);
+    if (!out) {
+        cerr << "Error: Could not write the trace to " << filename << "." << endl;
+        return false;
+    }
+    lock_guard<mutex> guard(profile_lock);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    out << fixed << setprecision(3);
+    for (size_t k=0; k < events.size(); k++) {
+        const trace_event &e = events[k];
+        out << (k ? "," : "") << "\n  {\"name\": " << json_string(e.name) << ", \"cat\": " << json_string(e.category)
+            << ", \"ph\": \"X\", \"pid\": " << getpid() << ", \"tid\": " << e.thread
+            << ", \"ts\": " << e.start * 1e6 << ", \"dur\": " << e.seconds * 1e6 << ", \"args\": {";
+        for (size_t a=0; a < e.args.size(); a++) {
+            out << (a ? ", " : "") << json_string(e.args[a].first) << ": " << defaultfloat << setprecision(9)
+                << e.args[a].second << fixed << setprecision(3);
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+    if (!out) {
+        cerr << "Error: Could not write the trace to " << filename << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+// One line per step and stage: wall, busy and idle time, newly allocated memory, bandwidth and, where the
+// hardware counters could be read, cycles and instructions per cycle. Stages are indented below their step.
+void print_profile_summary(ostream &out) {
+    lock_guard<mutex> guard(profile_lock);
+    bool any_counters = false;
+    for (const profile_totals &t : totals) {
+        any_counters = any_counters || t.counters.valid;
+    }
+    out << left << setw(28) << "step" << right << setw(6) << "count" << setw(11) << "wall ms" << setw(11) << "busy ms"
+        << setw(11) << "idle ms" << setw(11) << "alloc MB" << setw(10) << "MB/s";
+    if (any_counters) {
+        out << setw(12) << "Mcycles" << setw(6) << "IPC";
+    }
+    out << endl;
+    out << fixed;
+    for (const profile_totals &t : totals) {
+        out << left << setw(28) << string(2*t.depth, ' ') + t.name << right << setw(6) << t.count
+            << setprecision(2) << setw(11) << t.seconds * 1e3;
+        if (t.busy > 0) {
+            out << setw(11) << t.busy * 1e3;
+        } else {
+            out << setw(11) << "-";
+        }
+        if (t.idle > 0) {
+            out << setw(11) << t.idle * 1e3;
+        } else {
+            out << setw(11) << "-";
+        }
+        out << setprecision(1) << setw(11) << t.bytes_allocated / 1e6;
+        if (t.bytes_moved > 0 && t.seconds > 0) {
+            out << setw(10) << t.bytes_moved / t.seconds / 1e6;
+        } else {
+            out << setw(10) << "-";
+        }
+        if (any_counters && t.counters.valid && t.counters.cycles > 0) {
+            out << setw(12) << t.counters.cycles / 1e6 << setprecision(2) << setw(6)
+                << (double) t.counters.instructions / t.counters.cycles;
+        } else if (any_counters) {
+            out << setw(12) << "-" << setw(6) << "-";
+        }
+        out << endl;
+    }
+    if (!any_counters) {
+        out << "(hardware counters are not available, perf_event_open is not permitted)" << endl;
+    }
+}
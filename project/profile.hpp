@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <ostream>
+
+using namespace std;
+
+// Profiling of the steps of a run (reading, the pipeline and its stages, writing). While it is enabled, the steps
+// report their times, allocations and bandwidth here, to be written as a chrome trace (chrome://tracing, Perfetto)
+// and printed as a summary table. While it is disabled, the steps only check profiling() and do nothing else.
+
+// Hardware counters of the calling thread, only valid where perf_event_open is permitted
+struct hardware_counters {
+    bool valid = false;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+};
+
+// Totals of a step or stage over all the times it ran, one line of the summary
+struct profile_totals {
+    string name;
+    int depth = 0; // Stages are nested in the step running them
+    long count = 0;
+    double seconds = 0; // Wall time
+    double busy = 0; // Time the threads of its parallel regions spent working, summed over the threads
+    double idle = 0; // Time the threads of its parallel regions waited for the others, summed over the threads
+    size_t bytes_allocated = 0; // Bytes the buffer pool had to allocate from the system
+    double bytes_moved = 0; // Bytes read and written
+    hardware_counters counters;
+};
+
+void set_profiling(bool enabled);
+bool profiling();
+double profile_time(); // Seconds since profiling was enabled
+int profile_thread(); // Small number identifying the calling thread in the trace
+int profile_depth(); // Number of steps the calling thread is in
+hardware_counters read_hardware_counters();
+hardware_counters operator-(const hardware_counters &end, const hardware_counters &start);
+
+void add_trace_event(const string &name, const string &category, int thread, double start, double seconds,
+                     const vector<pair<string, double>> &args = {});
+void add_profile_totals(const profile_totals &totals); // Summed up with earlier totals of the same name
+
+// Measures a step on the calling thread, from its construction to its destruction
+// Steps can nest, steps of several threads at once are summed up, so their allocations are only approximate
+class profile_step {
+public:
+    profile_step(const string &name);
+    ~profile_step();
+    profile_step(const profile_step&) = delete;
+    profile_step& operator=(const profile_step&) = delete;
+    void add_bytes_moved(double bytes) { totals.bytes_moved += bytes; }
+    void add_thread_time(double busy, double idle);
+    void add_counters(const hardware_counters &counters);
+private:
+    bool enabled;
+    profile_totals totals;
+    double start;
+    size_t start_allocated;
+    hardware_counters start_counters;
+};
+
+bool write_trace(const string &filename);
+void print_profile_summary(ostream &out);
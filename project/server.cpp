@@ -0,0 +1,335 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.hpp"
+#include "api.hpp"
+
+using namespace std;
+
+// Runs jobs one after the other on a thread of its own, so that the requests of all connections share one OpenMP
+// team that stays warm, and a connection waiting for its client doesn't hold any threads of the team
+class job_worker {
+public:
+    job_worker() : worker([this] { work(); }) {}
+    job_worker(const job_worker&) = delete;
+    job_worker& operator=(const job_worker&) = delete;
+    // Returns once job has run
+    void run(function<void()> job) {
+        packaged_task<void()> task(job);
+        future<void> done = task.get_future();
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.push_back(move(task));
+        }
+        wake.notify_one();
+        done.get();
+    }
+private:
+    void work() {
+        while (true) {
+            packaged_task<void()> task;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this] { return !jobs.empty(); });
+                task = move(jobs.front());
+                jobs.pop_front();
+            }
+            task();
+        }
+    }
+    mutex lock;
+    condition_variable wake;
+    deque<packaged_task<void()>> jobs;
+    thread worker; // Last, so that it starts once everything else is initialized
+};
+
+// Like default_pool, the worker is never destroyed, connections may still use it at exit
+static job_worker& shared_worker() {
+    static job_worker *worker = new job_worker();
+    return *worker;
+}
+
+// Reads a descriptor through a buffer, so that request lines don't have to be read byte by byte
+class frame_reader {
+public:
+    frame_reader(int fd) : fd(fd) {}
+    // Reads up to the next newline, false at the end of the input or for lines longer than the buffer
+    bool line(string *text) {
+        text->clear();
+        while (true) {
+            if (pos == filled && !fill()) {
+                return false;
+            }
+            unsigned char c = buffer[pos++];
+            if (c == '\n') {
+                return true;
+            }
+            if (text->size() >= sizeof(buffer)) {
+                return false;
+            }
+            *text += c;
+        }
+    }
+    bool bytes(unsigned char *data, size_t size) {
+        while (size > 0) {
+            if (pos == filled) {
+                if (size >= sizeof(buffer)) { // Large payloads go straight to their destination
+                    ssize_t got = read(fd, data, size);
+                    if (got < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (got <= 0) {
+                        return false;
+                    }
+                    data += got;
+                    size -= got;
+                    continue;
+                }
+                if (!fill()) {
+                    return false;
+                }
+            }
+            size_t n = min(size, filled - pos);
+            memcpy(data, buffer + pos, n);
+            pos += n;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+private:
+    bool fill() {
+        ssize_t got;
+        do {
+            got = read(fd, buffer, sizeof(buffer));
+        } while (got < 0 && errno == EINTR);
+        pos = 0;
+        filled = got > 0 ? got : 0;
+        return got > 0;
+    }
+    int fd;
+    unsigned char buffer[1 << 16];
+    size_t pos = 0, filled = 0;
+};
+
+// Writes to a socket don't raise SIGPIPE when the client has hung up, they fail like any other write. Other
+// descriptors can't be told so, the program decides what SIGPIPE does for them.
+static bool send_all(int fd, bool to_socket, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = to_socket ? send(fd, data, size, MSG_NOSIGNAL) : write(fd, data, size);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Sends the file behind in_fd, to descriptors other than sockets without copying it through user space. sendfile
+// can't be kept from raising SIGPIPE, so sockets get the file mapped into memory.
+static bool send_file(int out_fd, bool to_socket, int in_fd, size_t size) {
+    if (to_socket && size > 0) {
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        bool sent = send_all(out_fd, true, (const char*) data, size);
+        munmap(data, size);
+        return sent;
+    }
+    off_t offset = 0;
+    while ((size_t) offset < size) {
+        ssize_t sent = sendfile(out_fd, in_fd, &offset, size - offset);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decodes, filters and encodes the file of a request. The result is written to a file in memory, so that its size is
+// known before it's sent. Returns the descriptor of that file, or -1 and sets error.
+static int process_request(const unsigned char *data, size_t size, const vector<string> &arguments, string *error,
+                           size_t *result_size) {
+    image_format format = FORMAT_P3;
+    bool format_set = false, gray = false;
+    border_policy border = BORDER_IGNORE;
+    int max_error = 0;
+    vector<string> names;
+    for (size_t k=0; k < arguments.size(); k++) {
+        if (arguments[k] == "--gray") {
+            gray = true;
+        } else if (arguments[k] == "--border" && k+1 < arguments.size()) {
+            if (!parse_border(arguments[++k].c_str(), &border)) {
+                *error = "Unknown border policy " + arguments[k];
+                return -1;
+            }
+        } else if (arguments[k] == "--approximate" && k+1 < arguments.size()) {
+            max_error = atoi(arguments[++k].c_str());
+            if (max_error <= 0) {
+                *error = "--approximate needs a positive number of levels, not " + arguments[k];
+                return -1;
+            }
+        } else if (arguments[k] == "--format" && k+1 < arguments.size()) {
+            format_set = true;
+            if (!parse_format(arguments[++k].c_str(), &format)) {
+                *error = "Unknown output format " + arguments[k];
+                return -1;
+            }
+        } else {
+            names.push_back(arguments[k]);
+        }
+    }
+    vector<routine> routines;
+    if (!parse_routine_arguments(names, &routines, error)) {
+        return -1;
+    }
+    for (routine &r : routines) {
+        r.border = border;
+        r.max_error = max_error;
+    }
+    if (!format_set && size >= 2) { // Same format as the input
+        format = data[1] == '5' ? FORMAT_P5 : data[1] == '6' ? FORMAT_P6 : data[1] == '7' ? FORMAT_PAM : FORMAT_P3;
+    }
+    image img = decode_image(data, size, "request");
+    if (img.empty()) {
+        *error = "Could not decode the image, it has to be a ppm, pgm or pam file";
+        return -1;
+    }
+    if ((gray || gray_format(format)) && img.channels > 1) {
+        img = img.luma();
+    }
+    run_pipeline(img, routines);
+    int fd = memfd_create("prettify_result", 0);
+    if (fd < 0) {
+        *error = "Could not create a file for the result";
+        return -1;
+    }
+    raster_writer writer;
+    if (!writer.open(fd, img.width, img.height, format, false, img.channels) || !writer.write_rows(img, 0, img.height)
+        || !writer.close()) {
+        close(fd);
+        *error = "Could not write the result";
+        return -1;
+    }
+    *result_size = writer.bytes_written();
+    return fd;
+}
+
+// Serves requests read from in_fd, sending the responses to out_fd, until the input ends or says quit. Requests whose
+// file is larger than max_request bytes are refused before anything is allocated for them.
+// Returns false if the input was cut off or malformed, or if the responses couldn't be sent
+bool serve_connection(int in_fd, int out_fd, size_t max_request) {
+    struct stat status;
+    bool to_socket = fstat(out_fd, &status) == 0 && S_ISSOCK(status.st_mode);
+    frame_reader in(in_fd);
+    string header;
+    while (in.line(&header)) {
+        istringstream words(header);
+        vector<string> arguments;
+        string word;
+        while (words >> word) {
+            arguments.push_back(word);
+        }
+        if (arguments.empty()) {
+            continue;
+        }
+        if (arguments[0] == "quit") {
+            return true;
+        }
+        char *end;
+        unsigned long long size = strtoull(arguments[0].c_str(), &end, 10);
+        if (*end != '\0' || size == 0 || size > max_request) {
+            string response = "error Requests start with the size of their file, up to "
+                            + to_string(max_request >> 20) + " MB\n";
+            send_all(out_fd, to_socket, response.data(), response.size());
+            return false; // The file can't be skipped without its size
+        }
+        arguments.erase(arguments.begin());
+        pooled_array<unsigned char> data(size);
+        if (!in.bytes(data.data(), size)) {
+            return false;
+        }
+        string error;
+        size_t result_size = 0;
+        int result = -1;
+        shared_worker().run([&] { result = process_request(data.data(), size, arguments, &error, &result_size); });
+        if (result < 0) {
+            string response = "error " + error + "\n";
+            if (!send_all(out_fd, to_socket, response.data(), response.size())) {
+                return false;
+            }
+            continue;
+        }
+        string response = "ok " + to_string(result_size) + "\n";
+        bool sent = send_all(out_fd, to_socket, response.data(), response.size())
+                    && send_file(out_fd, to_socket, result, result_size);
+        close(result);
+        if (!sent) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Listens on a unix socket at path and serves every connection on a thread of its own, until the process ends
+// Returns false if the socket can't be created
+bool serve_socket(const char *path, size_t max_request) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        cerr << "Error: The socket path " << path << " is too long." << endl;
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // A socket left behind by an earlier server
+    if (listener < 0 || ::bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        cerr << "Error: Could not listen on " << path << ": " << strerror(errno) << "." << endl;
+        if (listener >= 0) {
+            close(listener);
+        }
+        return false;
+    }
+    cout << "Listening on " << path << endl;
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            cerr << "Error: Could not accept connections on " << path << ": " << strerror(errno) << "." << endl;
+            close(listener);
+            return false;
+        }
+        thread([connection, max_request] {
+            serve_connection(connection, connection, max_request);
+            close(connection);
+        }).detach();
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+using namespace std;
+
+// A long-running prettify that processes one image after the other without starting a process for each, so that
+// its threads, buffer pool and caches stay warm. Requests and responses are framed like this:
+//   request:  <bytes> [--format p3|p5|p6|pam|pbm|png|tiff] [--gray] [--border ignore|replicate|reflect] [--approximate levels] [routines]\n followed by the bytes of a ppm, pgm or pam file
+//   response: ok <bytes>\n followed by the bytes of the resulting file, or error <message>\n
+// The routines are given like on the command line, the output has the format of the input unless --format is given.
+// A line "quit" or the end of the input ends the connection.
+
+// Largest file a request may carry by default, larger scans should be streamed from disk instead. The server holds
+// the whole file while it's processed, prettify --serve lowers the limit to --max-memory.
+const size_t serve_max_request = (size_t) 1 << 30;
+
+bool serve_connection(int in_fd, int out_fd, size_t max_request=serve_max_request);
+bool serve_socket(const char *path, size_t max_request=serve_max_request);
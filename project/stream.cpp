@@ -0,0 +1,325 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <omp.h>
+#include "stream.hpp"
+#include "profile.hpp"
+#include "compress.hpp"
+
+using namespace std;
+
+// Bytes processing an image as a whole takes: the image itself and the result of the routines
+size_t image_memory(int width, int height, int channels) {
+    size_t stride = ((size_t) width + 63) / 64 * 64;
+    return 2 * stride * height * channels;
+}
+
+// Bytes stream_image needs for strips of strip_rows rows: the ring of input rows with the halos, the rings and the
+// state every thread's stages keep, the rows a compressed format collects, and per row of the strip its input, its
+// result and its formatted output
+size_t strip_memory(const vector<routine> &routines, int width, int channels, image_format format, int strip_rows) {
+    vector<routine> chain = plan_routines(routines);
+    size_t stride = ((size_t) width + 63) / 64 * 64;
+    size_t row_bytes = stride * channels;
+    int halo = 0;
+    size_t thread_bytes = 0;
+    for (const routine &r : chain) {
+        halo += routine_halo(r);
+        thread_bytes += (2 * (size_t) routine_halo(r) + 2) * row_bytes + routine_memory(r, width, channels);
+    }
+    size_t fixed = omp_get_max_threads() * thread_bytes + (2 * (size_t) halo + 2) * row_bytes + 3 * stride
+                 + chunk_encoder_memory(width, channels, format);
+    return fixed + strip_rows * (2 * row_bytes + raster_writer::formatted_row_size(width, format));
+}
+
+// Reads the whole file once to find the threshold of a threshold_auto at the start of the chain
+static bool stream_threshold(char in_filename[], int channels, threshold_method method, int *thresh) {
+    profile_step step("histogram");
+    raster_reader reader;
+    if (!reader.open(in_filename)) {
+        return false;
+    }
+    image row(reader.width, 1, channels);
+    unsigned char *planes[3];
+    for (int c=0; c < channels; c++) {
+        planes[c] = row.row(c, 0);
+    }
+    pooled_array<unsigned char> intensities(reader.width);
+    uint64_t histogram[256] = {};
+    for (int i=0; i < reader.height; i++) {
+        if (!reader.read_row(planes, channels)) {
+            return false;
+        }
+        row.luma_row(0, intensities.data());
+        for (int j=0; j < reader.width; j++) {
+            histogram[intensities[j]]++;
+        }
+    }
+    *thresh = histogram_threshold(histogram, method);
+    return true;
+}
+
+// Processes an image too large to be held in memory at once: it is read, filtered and written in horizontal strips.
+// The input rows of a strip, with the halos of all routines above and below it, are kept in a ring, so every row is
+// read from the file only once; the rows of a strip are split into bands over the threads like in run_pipeline, and
+// written as soon as the strip is done. Strips are as high as memory_limit allows, see strip_memory. All sizes are
+// 64 bit, the image may have more pixels than an int can count.
+// A threshold_auto needs the histogram of its input, which takes another pass over the file, so it has to come first.
+// A deskew rotates rows into each other from all over the image, so it can't be streamed.
+// Returns false with a message if the image can't be processed, strip_rows is set to the rows per strip
+bool stream_image(char in_filename[], char out_filename[], const vector<routine> &routines, image_format format,
+                  bool gray, size_t memory_limit, int *strip_rows) {
+    raster_reader reader;
+    if (!reader.open(in_filename)) {
+        return false;
+    }
+    int width = reader.width, height = reader.height;
+    int channels = gray || gray_format(format) ? 1 : reader.channels;
+    vector<routine> chain;
+    for (const routine &r : routines) {
+        if (valid_routine(r, width, height)) {
+            chain.push_back(r);
+        }
+    }
+    chain = plan_routines(chain);
+    for (size_t k=0; k < chain.size(); k++) {
+        if (chain[k].kind == ROUTINE_DESKEW) {
+            cerr << "Error: " << deskew_id << " needs the whole image, it can't be streamed." << endl;
+            return false;
+        }
+        if (chain[k].kind != ROUTINE_THRESHOLD_AUTO) {
+            continue;
+        }
+        if (k > 0) {
+            cerr << "Error: When streaming, " << threshold_auto_id << " has to be the first routine." << endl;
+            return false;
+        }
+        if (!stream_threshold(in_filename, channels, chain[k].method, &chain[k].thresh)) {
+            return false;
+        }
+    }
+
+    size_t fixed = strip_memory(chain, width, channels, format, 0);
+    size_t per_row = strip_memory(chain, width, channels, format, 1) - fixed;
+    if (memory_limit < fixed + per_row) {
+        cerr << "Error: Processing " << in_filename << " in strips needs at least "
+             << ((fixed + per_row + (1 << 20) - 1) >> 20) << " MB." << endl;
+        return false;
+    }
+    int strip = (int) min((size_t) height, (memory_limit - fixed) / per_row);
+    if (strip_rows != nullptr) {
+        *strip_rows = strip;
+    }
+    int halo = 0;
+    for (const routine &r : chain) {
+        halo += routine_halo(r);
+    }
+    int capacity = strip + 2*halo + 2;
+    image source(width, capacity, channels);
+    image result(width, strip, channels);
+    row_buffer in(source.row(0, 0), source.stride, height, capacity);
+    row_buffer out(result.row(0, 0), result.stride, height, strip);
+    raster_writer writer;
+    if (!writer.open(out_filename, width, height, format, channels)) {
+        cerr << "Error: Could not write " << out_filename << "." << endl;
+        return false;
+    }
+    int next_read = 0;
+    for (int first=0; first < height; first += strip) {
+        int last = min(first + strip, height) - 1;
+        {
+            profile_step step("read_strip");
+            for (; next_read <= min(last + halo, height-1); next_read++) { // The strip and the halo below it
+                unsigned char *planes[3];
+                for (int c=0; c < channels; c++) {
+                    planes[c] = in.row(c, next_read);
+                }
+                if (!reader.read_row(planes, channels)) {
+                    cerr << "Error: " << in_filename << " contains fewer samples than its header announces." << endl;
+                    return false;
+                }
+            }
+        }
+        if (chain.empty()) {
+            for (int y=first; y <= last; y++) {
+                for (int c=0; c < channels; c++) {
+                    memcpy(out.row(c, y), in.row(c, y), width);
+                }
+            }
+        } else {
+            profile_step step("pipeline");
+            run_bands(in, out, chain, width, height, channels, first, last, step);
+        }
+        profile_step step("write_strip");
+        size_t written = writer.bytes_written();
+        if (!writer.write_rows(result, 0, last - first + 1)) {
+            cerr << "Error: Could not write " << out_filename << "." << endl;
+            return false;
+        }
+        step.add_bytes_moved(writer.bytes_written() - written);
+    }
+    if (!writer.close()) {
+        cerr << "Error: Could not write " << out_filename << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+// Rows of overlap_image that the decoding thread has read and that the routines have finished, each only grows
+struct overlap_progress {
+    mutex lock;
+    condition_variable changed;
+    int read = 0, done = 0;
+    bool failed = false; // Reading or writing failed, everyone stops
+    // Waits until rows is at least count, returns false if something failed instead
+    bool wait(const int &rows, int count) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&] { return rows >= count || failed; });
+        return !failed;
+    }
+    void update(int &rows, int count, bool failure=false) {
+        {
+            lock_guard<mutex> guard(lock);
+            rows = count;
+            failed |= failure;
+        }
+        changed.notify_all();
+    }
+};
+
+// Processes an image that fits into memory while it is read and written. A thread decodes the rows of the file
+// into the image, the routines start on a strip as soon as its rows and the halo below it are decoded, and another
+// thread encodes the rows of the result as soon as they are final, so that decoding and encoding, which each run on
+// one thread, overlap with the routines on all the others. channels has to be image_planes() of the file, or 1 if it
+// is converted to grayscale, so that the result is the one of read_image, run_pipeline and write_image.
+// A threshold_auto needs all of its input: as the first routine it waits for the whole file, after others the
+// routines from there on run on the whole image before the result is written. So do the routines from a deskew on.
+// Returns false with a message if the image can't be processed
+bool overlap_image(char in_filename[], char out_filename[], const vector<routine> &routines, image_format format,
+                   int channels) {
+    raster_reader reader;
+    if (!reader.open(in_filename)) {
+        return false;
+    }
+    int width = reader.width, height = reader.height;
+    vector<routine> chain;
+    for (const routine &r : routines) {
+        if (valid_routine(r, width, height)) {
+            chain.push_back(r);
+        }
+    }
+    chain = plan_routines(chain);
+    size_t overlapped = 0; // Routines that run on strips, the others run on the whole image afterwards
+    while (overlapped < chain.size() && chain[overlapped].kind != ROUTINE_DESKEW
+           && (overlapped == 0 || chain[overlapped].kind != ROUTINE_THRESHOLD_AUTO)) {
+        overlapped++;
+    }
+    image source(width, height, channels);
+    image result = chain.empty() ? image() : image(width, height, channels);
+    const image &final = chain.empty() ? source : result;
+    raster_writer writer;
+    if (!writer.open(out_filename, width, height, format, channels)) {
+        cerr << "Error: Could not write " << out_filename << "." << endl;
+        return false;
+    }
+    overlap_progress progress;
+    const int notify_rows = 16; // The decoding thread wakes the others every few rows
+    thread decoder([&] {
+        profile_step step("read_image");
+        for (int i=0; i < height; i++) {
+            unsigned char *planes[3];
+            for (int c=0; c < channels; c++) {
+                planes[c] = source.row(c, i);
+            }
+            if (!reader.read_row(planes, channels)) {
+                cerr << "Error: " << in_filename << " contains fewer samples than its header announces." << endl;
+                progress.update(progress.read, i, true);
+                return;
+            }
+            if ((i+1) % notify_rows == 0 || i+1 == height) {
+                progress.update(progress.read, i+1);
+            }
+        }
+        step.add_bytes_moved((double) width * height * reader.channels);
+    });
+    thread encoder([&] {
+        profile_step step("write_image");
+        int written = 0;
+        while (written < height && progress.wait(progress.done, written + 1)) {
+            int done;
+            {
+                lock_guard<mutex> guard(progress.lock);
+                done = progress.done;
+            }
+            if (!writer.write_rows(final, written, done - written)) {
+                cerr << "Error: Could not write " << out_filename << "." << endl;
+                progress.update(progress.done, done, true);
+                return;
+            }
+            written = done;
+        }
+        step.add_bytes_moved(writer.bytes_written());
+    });
+
+    bool ok = true;
+    if (chain.empty()) { // The rows are final once they're decoded
+        for (int rows=0; ok && rows < height; ) {
+            ok = progress.wait(progress.read, rows + 1);
+            lock_guard<mutex> guard(progress.lock);
+            rows = progress.read;
+            progress.done = rows;
+            progress.changed.notify_all();
+        }
+    } else {
+        if (chain[0].kind == ROUTINE_THRESHOLD_AUTO) {
+            ok = progress.wait(progress.read, height);
+            if (ok) {
+                chain[0].thresh = auto_threshold(source, chain[0].method);
+            }
+        }
+        vector<routine> head(chain.begin(), chain.begin() + overlapped), tail(chain.begin() + overlapped, chain.end());
+        int halo = 0;
+        for (const routine &r : head) {
+            halo += routine_halo(r);
+        }
+        // Strips short enough that the first one starts early, long enough that the bands of the threads aren't
+        // mostly their halos
+        int strip = max({64, 4*halo, (height + 15) / 16});
+        row_buffer in(source), out(result);
+        for (int first=0; ok && !head.empty() && first < height; first += strip) {
+            int last = min(first + strip, height) - 1;
+            ok = progress.wait(progress.read, min(last + halo + 1, height));
+            if (ok) {
+                profile_step step("pipeline");
+                run_bands(in, out, head, width, height, channels, first, last, step);
+                if (tail.empty()) {
+                    progress.update(progress.done, last + 1);
+                }
+            }
+        }
+        if (ok && head.empty()) { // A deskew comes first, it starts from the whole image
+            ok = progress.wait(progress.read, height);
+            if (ok) {
+                result = move(source);
+            }
+        }
+        if (ok && !tail.empty()) {
+            run_pipeline(result, tail);
+            progress.update(progress.done, height);
+        }
+    }
+    decoder.join();
+    encoder.join();
+    if (!ok || progress.failed) {
+        return false;
+    }
+    if (!writer.close()) {
+        cerr << "Error: Could not write " << out_filename << "." << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "prettify.hpp"
+#include "pipeline.hpp"
+using namespace std;
+
+size_t image_memory(int width, int height, int channels);
+size_t strip_memory(const vector<routine> &chain, int width, int channels, image_format format, int strip_rows);
+bool stream_image(char in_filename[], char out_filename[], const vector<routine> &routines, image_format format,
+                  bool gray, size_t memory_limit, int *strip_rows=nullptr);
+bool overlap_image(char in_filename[], char out_filename[], const vector<routine> &routines, image_format format,
+                   int channels);
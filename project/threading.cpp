@@ -0,0 +1,151 @@
+#include <fstream>
+#include <vector>
+#include <map>
+#include <utility>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <sched.h>
+#include "threading.hpp"
+
+using namespace std;
+
+static thread_binding binding = BIND_NONE;
+static bool allowed_known = false;
+static cpu_set_t allowed; // Cpus the process could run on before any thread was pinned
+static vector<cpu_set_t> places;
+static int team_size = 1; // Threads the places are spread over
+static atomic<int> next_slot(0);
+static atomic<int> generation(0); // Incremented whenever the binding changes, so that threads pin themselves again
+static thread_local int pinned_generation = 0;
+static thread_local bool pinned = false;
+
+bool parse_binding(const char *text, thread_binding *binding) {
+    if (bind_none_id.compare(text) == 0) {
+        *binding = BIND_NONE;
+    } else if (bind_close_id.compare(text) == 0) {
+        *binding = BIND_CLOSE;
+    } else if (bind_spread_id.compare(text) == 0) {
+        *binding = BIND_SPREAD;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses a schedule like OMP_SCHEDULE does: static, dynamic or guided, optionally followed by a comma and the chunk
+// size. A chunk of 0 lets OpenMP choose it.
+bool parse_schedule(const char *text, omp_sched_t *kind, int *chunk) {
+    string name = text;
+    *chunk = 0;
+    size_t comma = name.find(',');
+    if (comma != string::npos) {
+        char *end;
+        long value = strtol(text + comma + 1, &end, 10);
+        if (*end != '\0' || end == text + comma + 1 || value < 1 || value > 1 << 20) {
+            return false;
+        }
+        *chunk = value;
+        name = name.substr(0, comma);
+    }
+    if (name == "static") {
+        *kind = omp_sched_static;
+    } else if (name == "dynamic") {
+        *kind = omp_sched_dynamic;
+    } else if (name == "guided") {
+        *kind = omp_sched_guided;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Reads a number from the sysfs topology of a cpu, -1 if it isn't available
+static int cpu_topology(int cpu, const char *name) {
+    ifstream in("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/" + name);
+    int value = -1;
+    if (!(in >> value)) {
+        return -1;
+    }
+    return value;
+}
+
+// One place per core the process may run on, ordered by socket and core, with all hyper threads of the core
+static vector<cpu_set_t> core_places() {
+    map<pair<int, int>, cpu_set_t> cores;
+    for (int cpu=0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        int package = cpu_topology(cpu, "physical_package_id");
+        int core = cpu_topology(cpu, "core_id");
+        pair<int, int> key = core < 0 ? make_pair(package, -1 - cpu) : make_pair(package, core); // Unknown: own core
+        if (cores.find(key) == cores.end()) {
+            CPU_ZERO(&cores[key]);
+        }
+        CPU_SET(cpu, &cores[key]);
+    }
+    vector<cpu_set_t> result;
+    for (auto &core : cores) {
+        result.push_back(core.second);
+    }
+    return result;
+}
+
+// Sets how the threads are placed from now on, for as many threads as OpenMP currently uses. Threads move to their
+// place the next time they call pin_thread, BIND_NONE lets pinned threads run anywhere again.
+void set_thread_binding(thread_binding new_binding) {
+    if (!allowed_known) {
+        allowed_known = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        if (!allowed_known) {
+            return;
+        }
+    }
+    binding = new_binding;
+    places = core_places();
+    team_size = omp_get_max_threads();
+    next_slot = 0;
+    generation++;
+}
+
+thread_binding current_binding() {
+    return binding;
+}
+
+// Number of cores the threads can be placed on
+int thread_places() {
+    if (places.empty()) {
+        set_thread_binding(binding);
+    }
+    return places.size();
+}
+
+// Moves the calling thread to its place, once per thread and binding. Threads get their places in the order they
+// first call this, whichever team or batch worker they belong to, so every thread of the process has its own core
+// as long as there are enough of them.
+void pin_thread() {
+    if (pinned_generation == generation) {
+        return;
+    }
+    pinned_generation = generation;
+    if (binding == BIND_NONE) {
+        if (pinned) {
+            sched_setaffinity(0, sizeof(allowed), &allowed);
+            pinned = false;
+        }
+        return;
+    }
+    if (places.empty()) {
+        return;
+    }
+    int slot = next_slot++;
+    int count = places.size();
+    int place = binding == BIND_CLOSE ? slot % count : (int) ((long) (slot % team_size) * count / team_size);
+    pinned = sched_setaffinity(0, sizeof(cpu_set_t), &places[place]) == 0;
+}
+
+// Pins all threads of a parallel region right away, before they first touch the memory of an image
+void bind_threads() {
+    #pragma omp parallel
+    pin_thread();
+}
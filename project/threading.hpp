@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <omp.h>
+using namespace std;
+
+// How the threads working on an image are placed on the cores of the machine. Threads are pinned the first time they
+// work on an image and keep their core, so that the rows a thread wrote first (and whose pages the kernel therefore
+// put on its NUMA node) are processed by the same thread later. Places are the cores the process may run on, hyper
+// threads of one core share a place, like OMP_PLACES=cores.
+enum thread_binding {
+    BIND_NONE, // The operating system moves threads around as it likes (or OMP_PROC_BIND decides)
+    BIND_CLOSE, // Thread k runs on core k, filling one socket before the next
+    BIND_SPREAD // Threads are spread evenly over all cores, so that all sockets and their memory are used
+};
+
+const string bind_none_id = "none";
+const string bind_close_id = "close";
+const string bind_spread_id = "spread";
+
+bool parse_binding(const char *text, thread_binding *binding);
+bool parse_schedule(const char *text, omp_sched_t *kind, int *chunk);
+void set_thread_binding(thread_binding binding);
+thread_binding current_binding();
+int thread_places();
+void pin_thread();
+void bind_threads();